@@ -47,14 +47,122 @@ extern "C"
         AOS_WS_CLIENT_MODE_INSECURE,    // Use TCP as transport layer
     } aos_ws_client_mode_t;
 
+    /**
+     * @brief Websocket client socket tuning presets
+     */
+    typedef enum
+    {
+        AOS_WS_CLIENT_TUNING_NONE,        // Leave the network stack defaults
+        AOS_WS_CLIENT_TUNING_INTERACTIVE, // Small frames sent right away, dead peers detected in about 25s
+        AOS_WS_CLIENT_TUNING_BULK,        // Coalesced writes, dead peers detected in about 50s
+        AOS_WS_CLIENT_TUNING_LOW_POWER,   // Coalesced writes, a keep-alive probe every 5 minutes when idle
+    } aos_ws_client_tuning_t;
+
+    /**
+     * @brief Websocket client tuning override for on/off socket options
+     */
+    typedef enum
+    {
+        AOS_WS_CLIENT_OPTION_PRESET,   // Use the tuning preset value
+        AOS_WS_CLIENT_OPTION_ENABLED,  // Enable the option
+        AOS_WS_CLIENT_OPTION_DISABLED, // Disable the option
+    } aos_ws_client_option_t;
+
+    /**
+     * @brief Websocket client incoming data details, as delivered to on_data_ex
+     */
+    typedef struct aos_ws_client_rx_info_t
+    {
+        uint8_t opcode;   // Frame opcode (1 text, 2 binary, 0 continuation of a fragmented message)
+        bool fin;         // Final frame of the message
+        size_t frame_len; // Frame payload length, data is its last part when offset + data_len reaches it
+        size_t offset;    // Offset of data in the frame payload
+        int64_t rx_us;    // esp_timer_get_time() right after the transport read that completed data
+    } aos_ws_client_rx_info_t;
+
+    /**
+     * @brief Websocket client incoming message, as delivered in batches
+     */
+    typedef struct aos_ws_client_message_t
+    {
+        const void *data; // Message data
+        size_t data_len;  // Message data length
+        uint8_t opcode;   // Frame opcode (1 text, 2 binary, 0 continuation of a fragmented message)
+        bool fin;         // Final frame of the message
+    } aos_ws_client_message_t;
+
+    /**
+     * @brief Websocket client route for incoming messages
+     */
+    typedef struct aos_ws_client_route_t
+    {
+        const void *key;                                                    // Topic key, config.route_key_len bytes long
+        void (*on_data)(const void *data, size_t data_len, void *user_ctx); // Handler for messages matching the key
+        void *user_ctx;                                                     // Handler context
+    } aos_ws_client_route_t;
+
+    /**
+     * @brief Websocket client shared certificates, see aos_ws_client_certs_alloc
+     */
+    typedef struct aos_ws_client_certs_t aos_ws_client_certs_t;
+
+#define AOS_WS_CLIENT_LANES_MAX 4
+
+    /**
+     * @brief Websocket client send lane policies, applied when a message is queued on a full lane
+     */
+    typedef enum
+    {
+        AOS_WS_CLIENT_LANE_DROP_NEWEST, // Reject the new message
+        AOS_WS_CLIENT_LANE_DROP_OLDEST, // Drop the oldest queued message
+        AOS_WS_CLIENT_LANE_COALESCE,    // Replace the queued message with the same key (on any fill level), otherwise drop the oldest
+    } aos_ws_client_lane_policy_t;
+
+    /**
+     * @brief Websocket client send lane
+     */
+    typedef struct aos_ws_client_lane_t
+    {
+        aos_ws_client_lane_policy_t policy; // Full lane policy (defaults to AOS_WS_CLIENT_LANE_DROP_NEWEST)
+        uint32_t depth;                     // Maximum queued messages (required)
+        size_t slot_size;                   // Maximum message length (required)
+        size_t key_offset;                  // Offset of the coalescing key in messages (defaults to 0)
+        size_t key_len;                     // Length of the coalescing key in bytes (required with AOS_WS_CLIENT_LANE_COALESCE)
+    } aos_ws_client_lane_t;
+
+#define AOS_WS_CLIENT_ENDPOINTS_MAX 4
+
+    /**
+     * @brief Websocket client endpoint
+     */
+    typedef struct aos_ws_client_endpoint_t
+    {
+        const char *host; // Host to connect to (required)
+        uint16_t port;    // Server port (defaults to config.port)
+        const char *path; // Server path (defaults to config.path)
+    } aos_ws_client_endpoint_t;
+
+    /**
+     * @brief Websocket client in-place frame encoder, see aos_ws_client_encode_begin
+     */
+    typedef struct aos_ws_client_encoder_t
+    {
+        aos_task_t *client; // Websocket client task
+        uint8_t *data;      // Payload start in the staging frame (NULL once ended or aborted)
+        size_t len;         // Payload bytes written so far
+        size_t size;        // Payload capacity (config.tx_frame_size)
+        uint32_t frame;     // Staging frame index
+        bool overflow;      // A write did not fit, the frame will be discarded
+    } aos_ws_client_encoder_t;
+
     /**
      * @brief Websocket client configuration
      */
     typedef struct aos_ws_client_config_t
     {
-        void (*on_data)(const void *data, size_t data_len);             // Handler for data events (required)
+        void (*on_data)(const void *data, size_t data_len);             // Handler for data events (required without on_data_ex)
         void (*event_handler)(aos_ws_client_event_t event, void *args); // Unexpected events handler (required)
-        const char *host;                                               // Host to connect to (required)
+        const char *host;                                               // Host to connect to (required without endpoints)
         const char *path;                                               // Server path (defaults to "/")
         aos_ws_client_mode_t mode;                                      // Connection mode (defaults to AOS_WS_CLIENT_MODE_SECURE)
         uint16_t port;                                                  // Server port (defaults to 443)
@@ -64,6 +172,7 @@ extern "C"
         const char *server_cert_chain_pem;                              // Server certificate chain in PEM format (defaults to NULL)
         const char *client_cert_chain_pem;                              // Client certificate chain in PEM format (defaults to NULL)
         const char *client_key_pem;                                     // Client key in PEM format (defaults to NULL)
+        aos_ws_client_certs_t *certs;                                   // Shared parsed certificates, replacing the PEM fields above (defaults to NULL)
         uint32_t connection_attempts;                                   // Number of connection attempts before giving up (defaults to 3)
         uint32_t reconnection_attempts;                                 // Number of recovery attempts before giving up (defaults to UINT32_MAX)
         uint32_t retry_interval_ms;                                     // Interval in ms between connection/recovery attempts (defaults to 3000)
@@ -74,8 +183,173 @@ extern "C"
         uint32_t queuesize;                                             // Task queue size (defaults to 3)
         uint32_t priority;                                              // Task priority (defaults to 1)
         const char *name;                                               // Task name (defaults to NULL)
+        bool readahead;                                                 // Parse frames from whole buffer reads, needs buffer_size >= 14 (defaults to false)
+        bool lazy_resources;                                            // Allocate transports and buffer on connect, release them once disconnected (defaults to false)
+        void (*on_data_batch)(const aos_ws_client_message_t *messages, size_t messages_len); // Handler for the whole frames read in one poll, replacing on_data (defaults to NULL)
+        uint32_t batch_max_messages;                                    // Maximum messages per batch (defaults to 8)
+        size_t batch_max_bytes;                                         // Maximum data bytes per batch (defaults to buffer_size)
+        void *(*sink_acquire)(size_t *out_len);                         // Destination buffer provider for binary messages, bypassing on_data (defaults to NULL)
+        void (*sink_commit)(void *data, size_t data_len, bool fin);     // Handler for filled sink buffers, empty and non-final on an aborted message (defaults to NULL)
+        size_t rpc_id_offset;                                           // Offset of the correlation ID in RPC requests and responses (defaults to 0)
+        size_t rpc_id_len;                                              // Length of the correlation ID in bytes, up to 8 (defaults to 0, RPC disabled)
+        uint32_t rpc_max_in_flight;                                     // Maximum RPC requests awaiting a response (defaults to 16)
+        uint32_t rpc_timeout_ms;                                        // Default RPC response timeout in ms (defaults to 5000)
+        size_t (*rx_backlog)(void);                                     // Application backlog provider, reading pauses while it is high (defaults to NULL)
+        size_t rx_high_water;                                           // Backlog at which reading pauses (required with rx_backlog)
+        size_t rx_low_water;                                            // Backlog at which reading resumes (defaults to rx_high_water / 2)
+        const aos_ws_client_lane_t *lanes;                              // Non-blocking send lanes for aos_ws_client_try_send, by decreasing priority (defaults to NULL)
+        size_t lanes_len;                                               // Number of lanes, up to AOS_WS_CLIENT_LANES_MAX (defaults to 0)
+        uint32_t tx_frames;                                             // Staging frames for aos_ws_client_encode_begin/end (defaults to 0, disabled)
+        size_t tx_frame_size;                                           // Maximum encoded payload length (defaults to buffer_size)
+        uint32_t session_window;                                        // Unacknowledged messages replayed after reconnections, see tools/aos_ws_session_server.py (defaults to 0, disabled)
+        size_t session_slot_size;                                       // Maximum session message length (defaults to buffer_size)
+        uint32_t rate_bytes_per_s;                                      // Outgoing data rate limit in bytes/s (defaults to 0, unlimited)
+        uint32_t rate_messages_per_s;                                   // Outgoing message rate limit in messages/s (defaults to 0, unlimited)
+        uint32_t rate_burst_bytes;                                      // Byte bucket size (defaults to rate_bytes_per_s)
+        uint32_t rate_burst_messages;                                   // Message bucket size (defaults to rate_messages_per_s)
+        uint32_t rate_queue_size;                                       // Maximum sends held back by the rate limiter, further sends fail (defaults to 8)
+        const aos_ws_client_route_t *routes;                            // Routes for incoming messages, kept unchanged while allocated (defaults to NULL)
+        size_t routes_len;                                              // Number of routes (defaults to 0)
+        size_t route_key_offset;                                        // Offset of the topic key in incoming messages (defaults to 0)
+        size_t route_key_len;                                           // Length of the topic key in bytes (required with routes)
+        const aos_ws_client_endpoint_t *endpoints;                      // Endpoints replacing host, by preference when never connected (defaults to NULL)
+        size_t endpoints_len;                                           // Number of endpoints, up to AOS_WS_CLIENT_ENDPOINTS_MAX (defaults to 0)
+        uint32_t endpoint_failures;                                     // Consecutive handshake failures before switching endpoint (defaults to 2)
+        uint32_t endpoint_recheck_ms;                                   // Interval in ms between checks for a better endpoint, run on a helper task (defaults to 60000)
+        aos_ws_client_tuning_t tuning;                                  // Socket tuning preset (defaults to AOS_WS_CLIENT_TUNING_NONE)
+        aos_ws_client_option_t tcp_nodelay;                             // Disable Nagle's algorithm (defaults to the preset)
+        uint32_t keepalive_idle_s;                                      // Idle time in s before keep-alive probes, enabling them (defaults to the preset)
+        uint32_t keepalive_interval_s;                                  // Interval in s between keep-alive probes (defaults to the preset)
+        uint32_t keepalive_count;                                       // Unanswered keep-alive probes before dropping the connection (defaults to the preset)
+        void (*on_data_ex)(const void *data, size_t data_len, const aos_ws_client_rx_info_t *info, void *user_ctx); // Handler for data events with details (defaults to NULL)
+        void *on_data_ctx;                                              // Context passed to on_data_ex (defaults to NULL)
+        uint16_t tls_max_fragment_len;                                  // TLS record size to negotiate: 512, 1024, 2048 or 4096, see README for requirements (defaults to 0, 16384)
+        bool standby;                                                   // Keep a second connection open to fail over to (defaults to false)
+        uint32_t standby_ping_ms;                                       // Interval in ms between standby pings (defaults to 15000)
+        uint32_t standby_delay_ms;                                      // Delay in ms before building the standby after a (re)connection (defaults to 1000)
+        uint32_t lowpower_window_ms;                                    // Interval in ms between wake windows when idle (defaults to 0, disabled)
+        uint32_t lowpower_linger_ms;                                    // Time in ms kept awake after traffic (defaults to 200)
     } aos_ws_client_config_t;
 
+    /**
+     * @brief Websocket client trace events
+     */
+    typedef enum
+    {
+        AOS_WS_CLIENT_TRACE_ENQUEUE,     // Request enqueued to the client task (opcode: request type)
+        AOS_WS_CLIENT_TRACE_WRITE_START, // Frame write started
+        AOS_WS_CLIENT_TRACE_WRITE_END,   // Frame write ended (data_len: 0 on failure)
+        AOS_WS_CLIENT_TRACE_READ,        // Frame data read from transport
+        AOS_WS_CLIENT_TRACE_DISPATCH,    // Frame data dispatched to the application
+        AOS_WS_CLIENT_TRACE_STATE,       // Client state changed (opcode: new state)
+    } aos_ws_client_trace_event_t;
+
+    /**
+     * @brief Websocket client trace entry
+     */
+    typedef struct aos_ws_client_trace_entry_t
+    {
+        uint32_t timestamp_us;  // Lower 32 bits of esp_timer_get_time()
+        uint32_t data_len : 24; // Frame length (saturated)
+        uint32_t event : 4;     // aos_ws_client_trace_event_t
+        uint32_t opcode : 4;    // Frame opcode
+    } aos_ws_client_trace_entry_t;
+
+#define AOS_WS_CLIENT_STAGE_HISTOGRAM_BUCKETS 16
+
+    /**
+     * @brief Websocket client hot path stages
+     */
+    typedef enum
+    {
+        AOS_WS_CLIENT_STAGE_QUEUE,    // From request enqueue to its handler running
+        AOS_WS_CLIENT_STAGE_SEND,     // Framing, masking and writing a frame (esp_transport_ws_send_raw)
+        AOS_WS_CLIENT_STAGE_READ,     // Transport reads returning data
+        AOS_WS_CLIENT_STAGE_CALLBACK, // Application data callbacks
+        AOS_WS_CLIENT_STAGE_MAX,
+    } aos_ws_client_stage_t;
+
+    /**
+     * @brief Websocket client stage latency statistics
+     *
+     * Histogram bucket i counts samples below 2^i us (the last bucket counts all the rest).
+     */
+    typedef struct aos_ws_client_stage_stats_t
+    {
+        uint32_t count;                                            // Samples
+        uint32_t min_us;                                           // Minimum latency
+        uint32_t max_us;                                           // Maximum latency
+        uint64_t sum_us;                                           // Sum of latencies
+        uint32_t histogram[AOS_WS_CLIENT_STAGE_HISTOGRAM_BUCKETS]; // Latency histogram (log2 us)
+    } aos_ws_client_stage_stats_t;
+
+    /**
+     * @brief Websocket client send lane statistics
+     */
+    typedef struct aos_ws_client_lane_stats_t
+    {
+        uint32_t sent;      // Messages written
+        uint32_t dropped;   // Messages rejected or dropped by the lane policy
+        uint32_t coalesced; // Messages replaced by a newer one with the same key
+        uint32_t peak;      // Highest number of queued messages
+    } aos_ws_client_lane_stats_t;
+
+    /**
+     * @brief Websocket client endpoint statistics
+     */
+    typedef struct aos_ws_client_endpoint_stats_t
+    {
+        uint32_t rtt_us;      // Smoothed handshake time (0 until connected once)
+        uint32_t connections; // Successful handshakes
+        uint32_t failures;    // Failed handshakes
+        uint32_t streak;      // Consecutive failed handshakes
+        bool down;            // Skipped until a recheck finds it reachable
+    } aos_ws_client_endpoint_stats_t;
+
+    /**
+     * @brief Websocket client statistics
+     */
+    typedef struct aos_ws_client_stats_t
+    {
+        aos_ws_client_stage_stats_t stages[AOS_WS_CLIENT_STAGE_MAX]; // Per-stage latencies (requires CONFIG_AOS_WS_CLIENT_PROFILE)
+        size_t resources_size;                                       // Heap used by transports and receive buffer, as measured on their last allocation
+        bool resources_allocated;                                    // Transports and receive buffer are allocated (always, unless lazy_resources)
+        bool rx_paused;                                              // Reading is paused by receive flow control
+        uint32_t rx_pauses;                                          // Number of times reading was paused
+        uint64_t rx_paused_us;                                       // Total time reading was paused, including the current pause
+        uint64_t rx_paused_max_us;                                   // Longest completed pause
+        aos_ws_client_lane_stats_t lanes[AOS_WS_CLIENT_LANES_MAX];   // Per-lane statistics
+        int64_t rate_tokens_bytes;                                   // Byte tokens currently available (negative after an oversized message)
+        uint32_t rate_tokens_messages;                               // Message tokens currently available
+        uint32_t rate_held;                                          // Times sends were delayed by the rate limiter
+        uint64_t rate_delay_us;                                      // Accumulated delay imposed by the rate limiter
+        uint32_t tx_encoded;                                         // Staged frames written
+        uint32_t tx_refused;                                         // Encodings refused for lack of a free staging frame
+        uint32_t session_unacked;                                    // Session messages kept until acknowledged by the server
+        uint32_t session_replayed;                                   // Session messages sent again after a reconnection
+        uint32_t session_duplicates;                                 // Replayed server messages dropped as already delivered
+        uint32_t stack_free_min;                                     // Task stack high-water mark in bytes (requires CONFIG_AOS_WS_CLIENT_SIZING)
+        uint32_t queue_peak;                                         // Highest number of pending requests, including blocked senders (requires CONFIG_AOS_WS_CLIENT_SIZING)
+        size_t rx_fill_peak;                                         // Highest receive buffer fill (requires CONFIG_AOS_WS_CLIENT_SIZING)
+        size_t rx_frame_max;                                         // Largest received frame payload (requires CONFIG_AOS_WS_CLIENT_SIZING)
+        uint32_t recommended_stacksize;                              // Stack used so far plus 25% headroom (requires CONFIG_AOS_WS_CLIENT_SIZING)
+        uint32_t recommended_queuesize;                              // Queue size that would not have blocked any sender (requires CONFIG_AOS_WS_CLIENT_SIZING)
+        size_t recommended_buffer_size;                              // Buffer size holding the largest frame whole (requires CONFIG_AOS_WS_CLIENT_SIZING)
+        uint32_t endpoint;                                           // Current endpoint index
+        uint32_t endpoint_switches;                                  // Times the current endpoint changed
+        aos_ws_client_endpoint_stats_t endpoints[AOS_WS_CLIENT_ENDPOINTS_MAX]; // Per-endpoint statistics
+        bool socket_nodelay;                                         // Nagle's algorithm disabled on the current connection
+        size_t connection_size;                                      // Heap taken by the current connection, TLS session included (approximate)
+        bool standby_ready;                                          // Standby connection is up
+        uint32_t standby_endpoint;                                   // Endpoint index of the standby connection
+        uint32_t standby_builds;                                     // Standby connections established
+        uint32_t standby_failovers;                                  // Times the client switched over to the standby
+        uint32_t standby_failover_us;                                // Duration of the last switch over
+        uint32_t lowpower_wakeups;                                   // Times the client woke up, for a wake window or a send, while connected
+        uint32_t lowpower_wakeups_per_hour;                          // Wakeups per hour since the first connection
+        uint64_t lowpower_active_us;                                 // Time spent awake while connected (approximate radio-active time)
+    } aos_ws_client_stats_t;
+
     /**
      * @brief Allocate a new Websocket client
      *
@@ -91,6 +365,45 @@ extern "C"
      */
     void aos_ws_client_free(aos_task_t *task);
 
+    /**
+     * @brief Parse certificates and key once, to be shared by any number of Websocket clients
+     *
+     * Clients configured with the returned handle hand the parsed certificates straight to each TLS
+     * connection, instead of parsing their PEM text again on every connect. Each client holds a reference
+     * until freed, so the handle can be freed as soon as the clients using it are allocated.
+     * Without a server chain, the global CA store is used. Connections whose TLS setup could not use them
+     * are aborted.
+     *
+     * @note Requires CONFIG_AOS_WS_CLIENT_SHARED_CERTS (itself depending on CONFIG_MBEDTLS_CERTIFICATE_BUNDLE),
+     * returns NULL otherwise.
+     *
+     * @param server_cert_chain_pem Server certificate chain in PEM format (NULL for the global CA store)
+     * @param client_cert_chain_pem Client certificate chain in PEM format (can be NULL)
+     * @param client_key_pem Client key in PEM format (can be NULL)
+     * @return aos_ws_client_certs_t* Shared certificates
+     */
+    aos_ws_client_certs_t *aos_ws_client_certs_alloc(const char *server_cert_chain_pem, const char *client_cert_chain_pem, const char *client_key_pem);
+
+    /**
+     * @brief Release a reference to shared certificates
+     *
+     * @param certs Shared certificates
+     */
+    void aos_ws_client_certs_free(aos_ws_client_certs_t *certs);
+
+    /**
+     * @brief Copy the trace ring, oldest entry first
+     *
+     * @note Requires CONFIG_AOS_WS_CLIENT_TRACE, returns 0 otherwise.
+     * Can be called from any task. Decode on host with tools/aos_ws_trace.py.
+     *
+     * @param task Websocket client task
+     * @param out_entries Destination array
+     * @param max_entries Destination array capacity
+     * @return size_t Number of entries copied
+     */
+    size_t aos_ws_client_trace_dump(aos_task_t *task, aos_ws_client_trace_entry_t *out_entries, size_t max_entries);
+
     AOS_DECLARE(aos_ws_client_connect, uint8_t out_err)
     /**
      * @brief Connect
@@ -142,6 +455,122 @@ extern "C"
      */
     aos_future_t *aos_ws_client_send_binary(aos_task_t *client, aos_future_t *future);
 
+    /**
+     * @brief Queue data on a send lane without blocking
+     *
+     * Can be called from any task. Data is copied, so it can be reused as soon as this returns.
+     *
+     * @param client Websocket client instance
+     * @param lane Lane index (lower lanes are sent first)
+     * @param binary Send as binary instead of text
+     * @param data Data to be sent
+     * @param data_len Data length, up to the lane slot_size
+     * @return uint8_t 0 when queued, other when rejected
+     */
+    uint8_t aos_ws_client_try_send(aos_task_t *client, uint32_t lane, bool binary, const void *data, size_t data_len);
+
+    /**
+     * @brief Start encoding a binary message in place, in a free staging frame
+     *
+     * Can be called from any task, never blocks. Write the payload with aos_ws_client_encode_reserve or
+     * the CBOR and MessagePack helpers, then queue it with aos_ws_client_encode_end, or release the frame
+     * with aos_ws_client_encode_abort. Frames are sent in the order they were begun, so a frame left open
+     * holds back the ones after it.
+     *
+     * @param client Websocket client instance
+     * @param encoder Encoder to initialize
+     * @return uint8_t 0 when a frame was reserved, other when none is free
+     */
+    uint8_t aos_ws_client_encode_begin(aos_task_t *client, aos_ws_client_encoder_t *encoder);
+
+    /**
+     * @brief Reserve the next len payload bytes, for writing them directly
+     *
+     * @param encoder Encoder
+     * @param len Number of bytes
+     * @return void* Destination, NULL if the frame is full (which also sets encoder->overflow)
+     */
+    void *aos_ws_client_encode_reserve(aos_ws_client_encoder_t *encoder, size_t len);
+
+    /**
+     * @brief Finalize the frame header and masking in place and queue the frame for sending
+     *
+     * @param encoder Encoder
+     * @return uint8_t 0 when queued, other on overflow (the frame is then released)
+     */
+    uint8_t aos_ws_client_encode_end(aos_ws_client_encoder_t *encoder);
+
+    /**
+     * @brief Release the staging frame without sending it
+     *
+     * @param encoder Encoder
+     */
+    void aos_ws_client_encode_abort(aos_ws_client_encoder_t *encoder);
+
+    /**
+     * @brief CBOR (RFC 8949) item writers, overflowing writes set encoder->overflow
+     */
+    void aos_ws_client_cbor_uint(aos_ws_client_encoder_t *encoder, uint64_t value);
+    void aos_ws_client_cbor_int(aos_ws_client_encoder_t *encoder, int64_t value);
+    void aos_ws_client_cbor_bytes(aos_ws_client_encoder_t *encoder, const void *data, size_t data_len);
+    void aos_ws_client_cbor_text(aos_ws_client_encoder_t *encoder, const char *data, size_t data_len);
+    void aos_ws_client_cbor_array(aos_ws_client_encoder_t *encoder, size_t items);
+    void aos_ws_client_cbor_map(aos_ws_client_encoder_t *encoder, size_t pairs);
+    void aos_ws_client_cbor_bool(aos_ws_client_encoder_t *encoder, bool value);
+    void aos_ws_client_cbor_null(aos_ws_client_encoder_t *encoder);
+    void aos_ws_client_cbor_float(aos_ws_client_encoder_t *encoder, float value);
+    void aos_ws_client_cbor_double(aos_ws_client_encoder_t *encoder, double value);
+
+    /**
+     * @brief MessagePack item writers, overflowing writes set encoder->overflow
+     */
+    void aos_ws_client_msgpack_uint(aos_ws_client_encoder_t *encoder, uint64_t value);
+    void aos_ws_client_msgpack_int(aos_ws_client_encoder_t *encoder, int64_t value);
+    void aos_ws_client_msgpack_bin(aos_ws_client_encoder_t *encoder, const void *data, size_t data_len);
+    void aos_ws_client_msgpack_str(aos_ws_client_encoder_t *encoder, const char *data, size_t data_len);
+    void aos_ws_client_msgpack_array(aos_ws_client_encoder_t *encoder, size_t items);
+    void aos_ws_client_msgpack_map(aos_ws_client_encoder_t *encoder, size_t pairs);
+    void aos_ws_client_msgpack_bool(aos_ws_client_encoder_t *encoder, bool value);
+    void aos_ws_client_msgpack_nil(aos_ws_client_encoder_t *encoder);
+    void aos_ws_client_msgpack_float(aos_ws_client_encoder_t *encoder, float value);
+    void aos_ws_client_msgpack_double(aos_ws_client_encoder_t *encoder, double value);
+
+    AOS_DECLARE(aos_ws_client_rpc, void *in_data, size_t in_data_len, uint32_t in_timeout_ms, void *in_response, size_t in_response_size, size_t out_response_len, uint8_t out_err)
+    /**
+     * @brief Send a binary RPC request and wait for its response
+     *
+     * The correlation ID is read from in_data at config.rpc_id_offset. The first incoming text or binary
+     * message carrying the same ID at the same offset resolves the future instead of reaching on_data.
+     * Any number of requests (up to config.rpc_max_in_flight) can be awaiting a response at once.
+     * Requests still pending when the connection is lost fail.
+     *
+     * @warning in_data will be temporarily and non-permanently manipulated before being sent, and in_response
+     * is written from the websocket task. Ensure both stay accessible until the future is resolved.
+     *
+     * @param client Websocket client instance
+     * @param future Future
+     * @param in_data (future args) Request data, including its correlation ID
+     * @param in_data_len (future args) Request data length
+     * @param in_timeout_ms (future args) Response timeout in ms (0 for config.rpc_timeout_ms)
+     * @param in_response (future args) Response buffer
+     * @param in_response_size (future args) Response buffer size (longer responses are truncated)
+     * @param out_response_len (future args) Full response length
+     * @param out_err (future args) 0 on success, 1 on fail, 2 on timeout, 3 on a switch to a better endpoint
+     * @return aos_future_t* Same future as input
+     */
+    aos_future_t *aos_ws_client_rpc(aos_task_t *client, aos_future_t *future);
+
+    AOS_DECLARE(aos_ws_client_stats_get, aos_ws_client_stats_t out_stats)
+    /**
+     * @brief Get statistics
+     *
+     * @param client Websocket client instance
+     * @param future Future
+     * @param out_stats (future args) Statistics
+     * @return aos_future_t* Same future as input
+     */
+    aos_future_t *aos_ws_client_stats_get(aos_task_t *client, aos_future_t *future);
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
@@ -24,7 +24,19 @@
 #include <esp_transport_tcp.h>
 #include <esp_transport_ssl.h>
 #include <esp_transport_ws.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <esp_random.h>
+#include <esp_tls.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <mbedtls/version.h>
+#include <mbedtls/ssl.h>
+#include <lwip/sockets.h>
 #include <sdkconfig.h>
+#if CONFIG_PM_ENABLE
+#include <esp_pm.h>
+#endif
 #if CONFIG_AOS_WS_CLIENT_LOG_NONE
 #define LOG_LOCAL_LEVEL ESP_LOG_NONE
 #elif CONFIG_AOS_WS_CLIENT_LOG_ERROR
@@ -48,26 +60,286 @@ typedef enum
     RECONNECTING,
 } _aos_ws_client_state_t;
 
+#define _AOS_WS_CLIENT_ROUTE_NONE UINT16_MAX
+#define _AOS_WS_CLIENT_RPC_NONE UINT16_MAX
+#define _AOS_WS_CLIENT_RPC_WHEEL_SLOTS 64
+#define _AOS_WS_CLIENT_RPC_WHEEL_TICK_MS 50
+#define _AOS_WS_CLIENT_TX_HEADER_MAX 14 // 2 bytes, 8 bytes extended length, 4 bytes mask key
+#define _AOS_WS_CLIENT_RX_HEADER_MAX 14 // Same, should the server mask its frames
+#define _AOS_WS_CLIENT_SESSION_HEADER 5 // Type, sequence number
+#define _AOS_WS_CLIENT_SESSION_DATA 0x01
+#define _AOS_WS_CLIENT_SESSION_ACK 0x02
+#define _AOS_WS_CLIENT_SESSION_RESUME 0x03
+#define _AOS_WS_CLIENT_SESSION_TEXT 0x80
+#define _AOS_WS_CLIENT_SESSION_NEW 0x01
+
+typedef struct _aos_ws_client_rpc_t
+{
+    uint64_t id;
+    aos_future_t *future;
+    uint32_t deadline;
+    uint16_t wheel_prev;
+    uint16_t wheel_next;
+    size_t response_fill;
+} _aos_ws_client_rpc_t;
+
+typedef enum
+{
+    _AOS_WS_CLIENT_SLOT_READY,
+    _AOS_WS_CLIENT_SLOT_WRITING,
+    _AOS_WS_CLIENT_SLOT_READING,
+} _aos_ws_client_slot_state_t;
+
+typedef struct _aos_ws_client_slot_t
+{
+    size_t data_len;
+    bool binary;
+    uint8_t state; // Slot data is only copied while READY slots are claimed outside the lock
+    char data[];
+} _aos_ws_client_slot_t;
+
+typedef struct _aos_ws_client_lane_t
+{
+    char *slots;
+    size_t stride;
+    uint32_t head;
+    uint32_t count;
+    aos_ws_client_lane_stats_t stats;
+} _aos_ws_client_lane_t;
+
+typedef struct _aos_ws_client_endpoint_t
+{
+    const char *host;
+    uint16_t port;
+    const char *path;
+    int64_t down_stamp;
+    aos_ws_client_endpoint_stats_t stats;
+} _aos_ws_client_endpoint_t;
+
+typedef enum
+{
+    _AOS_WS_CLIENT_WORKER_IDLE,
+    _AOS_WS_CLIENT_WORKER_PROBE,
+    _AOS_WS_CLIENT_WORKER_CONNECT,
+} _aos_ws_client_worker_job_t;
+
+typedef struct _aos_ws_client_tuning_preset_t
+{
+    aos_ws_client_option_t tcp_nodelay;
+    uint32_t keepalive_idle_s;
+    uint32_t keepalive_interval_s;
+    uint32_t keepalive_count;
+} _aos_ws_client_tuning_preset_t;
+
+typedef struct _aos_ws_client_held_t
+{
+    aos_future_t *future;
+    uint32_t taskevt;
+    int64_t since;
+} _aos_ws_client_held_t;
+
+typedef enum
+{
+    _AOS_WS_CLIENT_TX_FREE,
+    _AOS_WS_CLIENT_TX_ENCODING,
+    _AOS_WS_CLIENT_TX_READY,
+    _AOS_WS_CLIENT_TX_ABORTED,
+} _aos_ws_client_tx_state_t;
+
+typedef struct _aos_ws_client_tx_frame_t
+{
+    uint8_t state;
+    uint8_t header_len;
+    size_t len;
+} _aos_ws_client_tx_frame_t;
+
+struct aos_ws_client_certs_t
+{
+    uint32_t refs;
+    bool server;
+    bool client;
+    mbedtls_x509_crt server_chain;
+    mbedtls_x509_crt client_chain;
+    mbedtls_pk_context client_key;
+};
+
 typedef struct _aos_ws_client_ctx_t
 {
     _aos_ws_client_state_t state;
     aos_ws_client_config_t config;
     char *buffer;
+    size_t readahead_len;
+    size_t readahead_pos;
+    aos_ws_client_message_t *batch;
+    size_t batch_len;
+    size_t batch_bytes;
+    bool rx_paused;
+    int64_t rx_paused_since;
+    uint32_t rx_pauses;
+    uint64_t rx_paused_us;
+    uint64_t rx_paused_max_us;
+    ws_transport_opcodes_t rx_opcode;
+    bool rx_fin;
+    size_t rx_payload_len;
+    int64_t rx_stamp;
+    size_t rx_remaining;
+    void *sink_buffer;
+    size_t sink_buffer_len;
+    size_t sink_buffer_fill;
+    bool sink_message;
     esp_transport_handle_t parent_transport;
     esp_transport_handle_t transport;
+    size_t resources_size;
     unsigned int connection_attempt;
     unsigned int reconnection_attempt;
     aos_future_t *connect_future;
     aos_task_loop_handle_t *poll_loop;
     aos_task_loop_handle_t *retry_loop;
+    uint16_t *route_table;
+    uint32_t route_table_mask;
+    uint16_t route_rx;
+    _aos_ws_client_rpc_t *rpc_pool;
+    uint16_t *rpc_table;
+    uint32_t rpc_table_mask;
+    uint16_t rpc_free;
+    uint16_t rpc_in_flight;
+    uint16_t rpc_rx;
+    uint16_t rpc_wheel[_AOS_WS_CLIENT_RPC_WHEEL_SLOTS];
+    uint32_t rpc_tick;
+    _aos_ws_client_lane_t lanes[AOS_WS_CLIENT_LANES_MAX];
+    char *lane_tx;
+    _aos_ws_client_tx_frame_t *tx_frames;
+    uint8_t *tx_staging;
+    size_t tx_stride;
+    uint32_t tx_head;
+    uint32_t tx_count;
+    uint32_t tx_encoded;
+    uint32_t tx_refused;
+    uint8_t *session_slots;
+    size_t *session_lens;
+    size_t session_stride;
+    uint8_t session_id[8];
+    uint32_t session_head;
+    uint32_t session_count;
+    uint32_t session_tx_seq;
+    uint32_t session_rx_seq;
+    uint32_t session_acked_rx_seq;
+    bool session_resume;
+    bool session_resuming;
+    bool session_rx_skip;
+    bool session_rx_header; // The current frame started with a session header, stripped before dispatch
+    uint32_t session_replayed;
+    uint32_t session_duplicates;
+    _aos_ws_client_endpoint_t endpoints[AOS_WS_CLIENT_ENDPOINTS_MAX];
+    uint32_t endpoints_len;
+    uint32_t endpoint;
+    uint32_t endpoint_switches;
+    int64_t endpoint_recheck_stamp;
+    _aos_ws_client_worker_job_t worker_job; // Blocking job handed over to the helper task, if any
+    bool worker_done;
+    bool worker_switch;
+    uint32_t worker_endpoint;
+    uint32_t worker_reachable;
+    int worker_err;
+    int64_t worker_us;
+    esp_transport_keep_alive_t keep_alive;
+    bool socket_nodelay;
+    uint8_t tls_mfl_code;
+    size_t connection_size;
+    esp_transport_handle_t standby_parent_transport;
+    esp_transport_handle_t standby_transport;
+    bool standby_ready;
+    uint32_t standby_endpoint;
+    int64_t standby_due;
+    int64_t standby_ping_stamp;
+    int64_t standby_pong_stamp;
+    uint32_t standby_builds;
+    uint32_t standby_failovers;
+    uint32_t standby_failover_us;
+    bool lowpower_window;
+    int64_t lowpower_awake_stamp;
+    int64_t lowpower_tx_stamp;
+    int64_t lowpower_stamp;
+    uint32_t lowpower_wakeups;
+    uint64_t lowpower_active_us;
+#if CONFIG_PM_ENABLE
+    esp_pm_lock_handle_t lowpower_pm_lock;
+#endif
+    int64_t rate_bytes;
+    int64_t rate_messages;
+    int64_t rate_stamp;
+    int64_t rate_blocked_since;
+    _aos_ws_client_held_t *rate_queue;
+    uint32_t rate_queue_head;
+    uint32_t rate_queue_count;
+    uint32_t rate_held;
+    uint64_t rate_delay_us;
+    portMUX_TYPE lock;
+#if CONFIG_AOS_WS_CLIENT_TRACE
+    aos_ws_client_trace_entry_t trace[CONFIG_AOS_WS_CLIENT_TRACE_ENTRIES];
+    uint32_t trace_head;
+#endif
+#if CONFIG_AOS_WS_CLIENT_PROFILE
+    aos_ws_client_stage_stats_t stages[AOS_WS_CLIENT_STAGE_MAX];
+    uint32_t queue_stamps[CONFIG_AOS_WS_CLIENT_PROFILE_QUEUE_STAMPS];
+    uint32_t queue_stamps_head;
+    uint32_t queue_stamps_tail;
+#endif
+#if CONFIG_AOS_WS_CLIENT_SIZING
+    uint32_t sizing_pending;
+    uint32_t sizing_queue_peak;
+    uint32_t sizing_stack_free_min;
+    size_t sizing_rx_fill_peak;
+    size_t sizing_rx_frame_max;
+#endif
 } _aos_ws_client_ctx_t;
 
+typedef struct _aos_ws_client_connecting_t
+{
+    _aos_ws_client_ctx_t *ctx;
+    TaskHandle_t task;
+    esp_err_t certs_err; // Outcome of the TLS setup hook, which esp-tls may not check
+    struct _aos_ws_client_connecting_t *next;
+} _aos_ws_client_connecting_t;
+
+#if CONFIG_AOS_WS_CLIENT_TRACE
+#define _AOS_WS_CLIENT_TRACE(ctx, event, opcode, data_len) _aos_ws_client_trace(ctx, event, opcode, data_len)
+#else
+#define _AOS_WS_CLIENT_TRACE(ctx, event, opcode, data_len) (void)(ctx)
+#endif
+
+#if CONFIG_AOS_WS_CLIENT_PROFILE
+#define _AOS_WS_CLIENT_PROFILE_START(stamp) uint32_t stamp = (uint32_t)esp_timer_get_time()
+#define _AOS_WS_CLIENT_PROFILE_END(ctx, stage, stamp) _aos_ws_client_profile(ctx, stage, (uint32_t)esp_timer_get_time() - stamp)
+#define _AOS_WS_CLIENT_PROFILE_ENQUEUE(ctx) _aos_ws_client_profile_enqueue(ctx)
+#define _AOS_WS_CLIENT_PROFILE_DEQUEUE(ctx) _aos_ws_client_profile_dequeue(ctx)
+#else
+#define _AOS_WS_CLIENT_PROFILE_START(stamp)
+#define _AOS_WS_CLIENT_PROFILE_END(ctx, stage, stamp)
+#define _AOS_WS_CLIENT_PROFILE_ENQUEUE(ctx) (void)(ctx)
+#define _AOS_WS_CLIENT_PROFILE_DEQUEUE(ctx) (void)(ctx)
+#endif
+
+#if CONFIG_AOS_WS_CLIENT_SIZING
+#define _AOS_WS_CLIENT_SIZING_ENQUEUE(ctx) _aos_ws_client_sizing_enqueue(ctx)
+#define _AOS_WS_CLIENT_SIZING_DEQUEUE(ctx) _aos_ws_client_sizing_dequeue(ctx)
+#define _AOS_WS_CLIENT_SIZING_FILL(ctx, fill) (ctx)->sizing_rx_fill_peak = (fill) > (ctx)->sizing_rx_fill_peak ? (fill) : (ctx)->sizing_rx_fill_peak
+#define _AOS_WS_CLIENT_SIZING_FRAME(ctx, len) (ctx)->sizing_rx_frame_max = (len) > (ctx)->sizing_rx_frame_max ? (len) : (ctx)->sizing_rx_frame_max
+#else
+#define _AOS_WS_CLIENT_SIZING_ENQUEUE(ctx) (void)(ctx)
+#define _AOS_WS_CLIENT_SIZING_DEQUEUE(ctx) (void)(ctx)
+#define _AOS_WS_CLIENT_SIZING_FILL(ctx, fill) (void)(ctx)
+#define _AOS_WS_CLIENT_SIZING_FRAME(ctx, len) (void)(ctx)
+#endif
+
 typedef enum
 {
     AOS_WS_CLIENT_TASKEVT_CONNECT,
     AOS_WS_CLIENT_TASKEVT_DISCONNECT,
     AOS_WS_CLIENT_TASKEVT_SEND_TEXT,
     AOS_WS_CLIENT_TASKEVT_SEND_BINARY,
+    AOS_WS_CLIENT_TASKEVT_STATS_GET,
+    AOS_WS_CLIENT_TASKEVT_RPC,
 } _aos_ws_client_taskevt_t;
 
 static void _aos_ws_client_disconnect(aos_task_t *task);
@@ -76,24 +348,227 @@ static void _aos_ws_client_handler_connect(aos_task_t *task, aos_future_t *futur
 static void _aos_ws_client_handler_disconnect(aos_task_t *task, aos_future_t *future);
 static void _aos_ws_client_handler_send_text(aos_task_t *task, aos_future_t *future);
 static void _aos_ws_client_handler_send_binary(aos_task_t *task, aos_future_t *future);
+static void _aos_ws_client_handler_stats_get(aos_task_t *task, aos_future_t *future);
+static void _aos_ws_client_handler_rpc(aos_task_t *task, aos_future_t *future);
+static aos_future_t *_aos_ws_client_send(aos_task_t *client, _aos_ws_client_taskevt_t taskevt, aos_future_t *future, size_t data_len);
 static void _aos_ws_client_retry_loop(aos_task_t *task);
 static void _aos_ws_client_poll_loop(aos_task_t *task);
+static void _aos_ws_client_readahead(aos_task_t *task);
+static int _aos_ws_client_parse_header(aos_task_t *task, const char *data, size_t data_len);
+static void _aos_ws_client_dispatch(aos_task_t *task, bool new_frame, char *data, uint32_t data_len);
+static void _aos_ws_client_sink(aos_task_t *task, const char *data, uint32_t data_len);
+static size_t _aos_ws_client_sink_head(aos_task_t *task, ws_transport_opcodes_t opcode);
+static void _aos_ws_client_rx_reset(aos_task_t *task);
+static bool _aos_ws_client_rx_throttle(aos_task_t *task);
+static void _aos_ws_client_lanes_drain(aos_task_t *task);
+static void _aos_ws_client_tx_drain(aos_task_t *task);
+static int _aos_ws_client_tx_write(_aos_ws_client_ctx_t *ctx, const uint8_t *data, size_t data_len);
+static void _aos_ws_client_encode_tagged(aos_ws_client_encoder_t *encoder, uint8_t tag, uint64_t value, size_t value_len);
+static void _aos_ws_client_cbor_head(aos_ws_client_encoder_t *encoder, uint8_t major, uint64_t value);
+static void _aos_ws_client_write_text(aos_task_t *task, aos_future_t *future);
+static void _aos_ws_client_write_binary(aos_task_t *task, aos_future_t *future);
+static void _aos_ws_client_write_rpc(aos_task_t *task, aos_future_t *future);
+static uint8_t _aos_ws_client_session_send(aos_task_t *task, bool binary, const void *data, size_t data_len);
+static int _aos_ws_client_session_write(aos_task_t *task, const uint8_t *data, size_t data_len);
+static bool _aos_ws_client_session_receive(aos_task_t *task, bool new_frame, char **data, uint32_t *data_len);
+static void _aos_ws_client_session_poll(aos_task_t *task);
+static void _aos_ws_client_session_release(_aos_ws_client_ctx_t *ctx, uint32_t seq);
+static void _aos_ws_client_endpoint_update(aos_task_t *task, uint32_t index, bool connected, int64_t handshake_us);
+static uint32_t _aos_ws_client_endpoint_rank(_aos_ws_client_ctx_t *ctx);
+static bool _aos_ws_client_endpoint_better(_aos_ws_client_ctx_t *ctx, uint32_t endpoint);
+static void _aos_ws_client_endpoint_switch(_aos_ws_client_ctx_t *ctx, uint32_t endpoint);
+static void _aos_ws_client_endpoint_recheck(aos_task_t *task);
+static void _aos_ws_client_endpoint_reconsider(aos_task_t *task);
+static bool _aos_ws_client_worker_start(_aos_ws_client_ctx_t *ctx, _aos_ws_client_worker_job_t job);
+static void _aos_ws_client_worker(void *args);
+static void _aos_ws_client_worker_poll(aos_task_t *task);
+static void _aos_ws_client_worker_wait(_aos_ws_client_ctx_t *ctx);
+static void _aos_ws_client_tuning_apply(_aos_ws_client_ctx_t *ctx, esp_transport_handle_t parent_transport);
+static void _aos_ws_client_standby_poll(aos_task_t *task);
+static void _aos_ws_client_standby_build(aos_task_t *task);
+static uint32_t _aos_ws_client_standby_endpoint(_aos_ws_client_ctx_t *ctx);
+static bool _aos_ws_client_standby_promote(aos_task_t *task);
+static void _aos_ws_client_standby_move(aos_task_t *task);
+static void _aos_ws_client_standby_drop(_aos_ws_client_ctx_t *ctx);
+static void _aos_ws_client_standby_free(_aos_ws_client_ctx_t *ctx);
+static bool _aos_ws_client_lowpower_poll(aos_task_t *task);
+static void _aos_ws_client_lowpower_send(aos_task_t *task);
+static void _aos_ws_client_lowpower_wake(_aos_ws_client_ctx_t *ctx, int64_t now);
+static void _aos_ws_client_lowpower_rest(_aos_ws_client_ctx_t *ctx, int64_t now);
+static void _aos_ws_client_rate_refill(aos_task_t *task);
+static bool _aos_ws_client_rate_fits(aos_task_t *task, size_t data_len);
+static void _aos_ws_client_rate_consume(aos_task_t *task, size_t data_len);
+static bool _aos_ws_client_rate_hold(aos_task_t *task, uint32_t taskevt, aos_future_t *future, size_t data_len);
+static void _aos_ws_client_rate_release(aos_task_t *task);
+static size_t _aos_ws_client_rate_len(_aos_ws_client_held_t *held);
+static void _aos_ws_client_rate_fail(_aos_ws_client_held_t *held);
+static void _aos_ws_client_rate_fail_all(aos_task_t *task);
+static void _aos_ws_client_rx_resume(aos_task_t *task);
+static void _aos_ws_client_batch_add(aos_task_t *task, const char *data, uint32_t data_len);
+static void _aos_ws_client_batch_flush(aos_task_t *task);
+static void _aos_ws_client_state_set(aos_task_t *task, _aos_ws_client_state_t state);
+static bool _aos_ws_client_resources_alloc(_aos_ws_client_ctx_t *ctx);
+static bool _aos_ws_client_transport_alloc(_aos_ws_client_ctx_t *ctx, esp_transport_handle_t *out_parent_transport, esp_transport_handle_t *out_transport);
+static int _aos_ws_client_connect(aos_task_t *task);
+static int _aos_ws_client_transport_connect(_aos_ws_client_ctx_t *ctx, esp_transport_handle_t parent_transport, esp_transport_handle_t transport, uint32_t endpoint);
+static esp_err_t _aos_ws_client_certs_attach(void *conf);
+static void _aos_ws_client_resources_free(_aos_ws_client_ctx_t *ctx);
+static uint32_t _aos_ws_client_rpc_find(_aos_ws_client_ctx_t *ctx, uint64_t id);
+static void _aos_ws_client_rpc_insert(_aos_ws_client_ctx_t *ctx, uint64_t id, aos_future_t *future, uint32_t timeout_ms);
+static bool _aos_ws_client_rpc_receive(aos_task_t *task, bool new_frame, const char *data, uint32_t data_len);
+static uint32_t _aos_ws_client_route_hash(_aos_ws_client_ctx_t *ctx, const void *key);
+static bool _aos_ws_client_route_receive(aos_task_t *task, bool new_frame, const char *data, uint32_t data_len);
+static void _aos_ws_client_rpc_expire(aos_task_t *task);
+static void _aos_ws_client_rpc_fail_all(aos_task_t *task, uint8_t err);
+#if CONFIG_AOS_WS_CLIENT_TRACE
+static void _aos_ws_client_trace(_aos_ws_client_ctx_t *ctx, aos_ws_client_trace_event_t event, uint8_t opcode, size_t data_len);
+#endif
+#if CONFIG_AOS_WS_CLIENT_PROFILE
+static void _aos_ws_client_profile(_aos_ws_client_ctx_t *ctx, aos_ws_client_stage_t stage, uint32_t latency_us);
+static void _aos_ws_client_profile_enqueue(_aos_ws_client_ctx_t *ctx);
+static void _aos_ws_client_profile_dequeue(_aos_ws_client_ctx_t *ctx);
+#endif
+#if CONFIG_AOS_WS_CLIENT_SIZING
+static void _aos_ws_client_sizing_enqueue(_aos_ws_client_ctx_t *ctx);
+static void _aos_ws_client_sizing_dequeue(_aos_ws_client_ctx_t *ctx);
+static void _aos_ws_client_sizing_get(_aos_ws_client_ctx_t *ctx, aos_ws_client_stats_t *stats);
+#endif
 
 static const char *_tag = "AOS Websocket client";
 
+// Connections currently set up with shared certificates, looked up by task from the TLS setup hook
+static _aos_ws_client_connecting_t *_aos_ws_client_connecting = NULL;
+static portMUX_TYPE _aos_ws_client_connecting_lock = portMUX_INITIALIZER_UNLOCKED;
+static const _aos_ws_client_tuning_preset_t _aos_ws_client_tunings[] = {
+    [AOS_WS_CLIENT_TUNING_NONE] = {0},
+    [AOS_WS_CLIENT_TUNING_INTERACTIVE] = {AOS_WS_CLIENT_OPTION_ENABLED, 10, 5, 3},
+    [AOS_WS_CLIENT_TUNING_BULK] = {AOS_WS_CLIENT_OPTION_DISABLED, 30, 5, 4},
+    [AOS_WS_CLIENT_TUNING_LOW_POWER] = {AOS_WS_CLIENT_OPTION_DISABLED, 300, 60, 3},
+};
+
 aos_task_t *aos_ws_client_alloc(aos_ws_client_config_t *config)
 {
     ESP_LOGD(_tag, "%s", __FUNCTION__);
     _aos_ws_client_ctx_t *ctx = NULL;
     aos_task_t *task = NULL;
-    esp_transport_handle_t parent_transport = NULL;
-    esp_transport_handle_t transport = NULL;
-    char *buffer = NULL;
+    _aos_ws_client_rpc_t *rpc_pool = NULL;
+    uint16_t *rpc_table = NULL;
+    uint32_t rpc_table_size = 1;
+    uint16_t *route_table = NULL;
+    uint32_t route_table_size = 1;
+    aos_ws_client_message_t *batch = NULL;
+    _aos_ws_client_lane_t lanes[AOS_WS_CLIENT_LANES_MAX] = {0};
+    char *lane_tx = NULL;
+    _aos_ws_client_tx_frame_t *tx_frames = NULL;
+    uint8_t *tx_staging = NULL;
+    size_t tx_stride = 0;
+    uint8_t *session_slots = NULL;
+    size_t *session_lens = NULL;
+    size_t session_stride = 0;
+    _aos_ws_client_held_t *rate_queue = NULL;
+    aos_ws_client_certs_t *tls_certs = NULL;
+    uint8_t tls_mfl_code = 0;
 
     // Verify config
-    if (!config->host || !config->event_handler || !config->on_data)
+    if ((!config->host && !config->endpoints_len) || !config->event_handler || (!config->on_data && !config->on_data_ex))
+    {
+        ESP_LOGE(_tag, "Incomplete configuration (host:%u event_handler:%u on_data:%u)", config->host != NULL || config->endpoints_len, config->event_handler != NULL, config->on_data != NULL || config->on_data_ex != NULL);
+        goto aos_ws_client_alloc_err;
+    }
+    if (config->endpoints_len > AOS_WS_CLIENT_ENDPOINTS_MAX || (config->endpoints_len && !config->endpoints))
+    {
+        ESP_LOGE(_tag, "Invalid endpoint configuration (endpoints:%u endpoints_len:%u)", config->endpoints != NULL, config->endpoints_len);
+        goto aos_ws_client_alloc_err;
+    }
+    for (size_t i = 0; i < config->endpoints_len; i++)
+    {
+        if (!config->endpoints[i].host)
+        {
+            ESP_LOGE(_tag, "Invalid endpoint configuration (endpoint:%u host:0)", i);
+            goto aos_ws_client_alloc_err;
+        }
+    }
+    if (config->mode > AOS_WS_CLIENT_MODE_INSECURE)
+    {
+        ESP_LOGE(_tag, "Invalid mode (mode:%u)", config->mode);
+        goto aos_ws_client_alloc_err;
+    }
+    if (config->tls_max_fragment_len)
+    {
+        // Negotiated through the certificate bundle setup hook, and only saves memory with resizable record buffers
+#if !defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+        ESP_LOGE(_tag, "TLS maximum fragment length requires CONFIG_MBEDTLS_SSL_MAX_FRAGMENT_LENGTH");
+        goto aos_ws_client_alloc_err;
+#elif !CONFIG_AOS_WS_CLIENT_SHARED_CERTS
+        ESP_LOGE(_tag, "TLS maximum fragment length requires CONFIG_AOS_WS_CLIENT_SHARED_CERTS (CONFIG_MBEDTLS_CERTIFICATE_BUNDLE)");
+        goto aos_ws_client_alloc_err;
+#elif !CONFIG_MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
+        ESP_LOGE(_tag, "TLS maximum fragment length requires CONFIG_MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH");
+        goto aos_ws_client_alloc_err;
+#else
+        switch (config->tls_max_fragment_len)
+        {
+        case 512:
+            tls_mfl_code = MBEDTLS_SSL_MAX_FRAG_LEN_512;
+            break;
+        case 1024:
+            tls_mfl_code = MBEDTLS_SSL_MAX_FRAG_LEN_1024;
+            break;
+        case 2048:
+            tls_mfl_code = MBEDTLS_SSL_MAX_FRAG_LEN_2048;
+            break;
+        case 4096:
+            tls_mfl_code = MBEDTLS_SSL_MAX_FRAG_LEN_4096;
+            break;
+        default:
+            ESP_LOGE(_tag, "Invalid TLS maximum fragment length (tls_max_fragment_len:%u)", config->tls_max_fragment_len);
+            goto aos_ws_client_alloc_err;
+        }
+#endif
+    }
+    if (config->tuning > AOS_WS_CLIENT_TUNING_LOW_POWER || config->tcp_nodelay > AOS_WS_CLIENT_OPTION_DISABLED)
+    {
+        ESP_LOGE(_tag, "Invalid tuning (tuning:%u tcp_nodelay:%u)", config->tuning, config->tcp_nodelay);
+        goto aos_ws_client_alloc_err;
+    }
+    // A frame header must always fit in the buffer for the parser to make progress
+    if (config->readahead && (config->buffer_size ? config->buffer_size : CONFIG_AOS_WS_CLIENT_BUFFERSIZE_DEFAULT) < _AOS_WS_CLIENT_RX_HEADER_MAX)
+    {
+        ESP_LOGE(_tag, "Invalid readahead configuration (buffer_size:%u)", config->buffer_size ? config->buffer_size : CONFIG_AOS_WS_CLIENT_BUFFERSIZE_DEFAULT);
+        goto aos_ws_client_alloc_err;
+    }
+    if (!config->sink_acquire != !config->sink_commit)
+    {
+        ESP_LOGE(_tag, "Incomplete sink configuration (sink_acquire:%u sink_commit:%u)", config->sink_acquire != NULL, config->sink_commit != NULL);
+        goto aos_ws_client_alloc_err;
+    }
+    if (config->rpc_id_len > sizeof(uint64_t) || config->rpc_max_in_flight >= _AOS_WS_CLIENT_RPC_NONE)
+    {
+        ESP_LOGE(_tag, "Invalid RPC configuration (rpc_id_len:%u rpc_max_in_flight:%u)", config->rpc_id_len, config->rpc_max_in_flight);
+        goto aos_ws_client_alloc_err;
+    }
+    if (config->rx_backlog && (!config->rx_high_water || config->rx_low_water >= config->rx_high_water))
+    {
+        ESP_LOGE(_tag, "Invalid flow control configuration (rx_high_water:%u rx_low_water:%u)", config->rx_high_water, config->rx_low_water);
+        goto aos_ws_client_alloc_err;
+    }
+    if (config->lanes_len > AOS_WS_CLIENT_LANES_MAX || (config->lanes_len && !config->lanes))
+    {
+        ESP_LOGE(_tag, "Invalid lane configuration (lanes:%u lanes_len:%u)", config->lanes != NULL, config->lanes_len);
+        goto aos_ws_client_alloc_err;
+    }
+    for (size_t i = 0; i < config->lanes_len; i++)
+    {
+        const aos_ws_client_lane_t *lane = &config->lanes[i];
+        if (!lane->depth || !lane->slot_size || (lane->policy == AOS_WS_CLIENT_LANE_COALESCE && (!lane->key_len || lane->key_offset + lane->key_len > lane->slot_size)))
+        {
+            ESP_LOGE(_tag, "Invalid lane configuration (lane:%u depth:%u slot_size:%u key_len:%u)", i, lane->depth, lane->slot_size, lane->key_len);
+            goto aos_ws_client_alloc_err;
+        }
+    }
+    if (config->routes_len && (!config->routes || !config->route_key_len || config->routes_len >= _AOS_WS_CLIENT_ROUTE_NONE))
     {
-        ESP_LOGE(_tag, "Incomplete configuration (host:%u event_handler:%u on_data:%u)", config->host != NULL, config->event_handler != NULL, config->on_data != NULL);
+        ESP_LOGE(_tag, "Invalid route configuration (routes:%u routes_len:%u route_key_len:%u)", config->routes != NULL, config->routes_len, config->route_key_len);
         goto aos_ws_client_alloc_err;
     }
 
@@ -111,6 +586,7 @@ aos_task_t *aos_ws_client_alloc(aos_ws_client_config_t *config)
         .server_cert_chain_pem = config->server_cert_chain_pem ? config->server_cert_chain_pem : NULL,
         .client_cert_chain_pem = config->client_cert_chain_pem ? config->client_cert_chain_pem : NULL,
         .client_key_pem = config->client_key_pem ? config->client_key_pem : NULL,
+        .certs = config->certs,
         .connection_attempts = config->connection_attempts ? config->connection_attempts : CONFIG_AOS_WS_CLIENT_CONNECTIONATTEMPTS_DEFAULT,
         .reconnection_attempts = config->reconnection_attempts ? config->reconnection_attempts : CONFIG_AOS_WS_CLIENT_RECONNECTIONATTEMPTS_DEFAULT,
         .retry_interval_ms = config->retry_interval_ms ? config->retry_interval_ms : CONFIG_AOS_WS_CLIENT_RETRYINTERVALMS_DEFAULT,
@@ -121,11 +597,68 @@ aos_task_t *aos_ws_client_alloc(aos_ws_client_config_t *config)
         .queuesize = config->queuesize ? config->queuesize : CONFIG_AOS_WS_CLIENT_TASK_QUEUESIZE_DEFAULT,
         .priority = config->priority ? config->priority : CONFIG_AOS_WS_CLIENT_TASK_PRIORITY_DEFAULT,
         .name = config->name ? config->name : NULL,
+        .readahead = config->readahead,
+        .lazy_resources = config->lazy_resources,
+        .on_data_batch = config->on_data_batch,
+        .batch_max_messages = config->batch_max_messages ? config->batch_max_messages : CONFIG_AOS_WS_CLIENT_BATCHMAXMESSAGES_DEFAULT,
+        .sink_acquire = config->sink_acquire,
+        .sink_commit = config->sink_commit,
+        .rpc_id_offset = config->rpc_id_offset,
+        .rpc_id_len = config->rpc_id_len,
+        .rpc_max_in_flight = config->rpc_max_in_flight ? config->rpc_max_in_flight : CONFIG_AOS_WS_CLIENT_RPC_MAXINFLIGHT_DEFAULT,
+        .rpc_timeout_ms = config->rpc_timeout_ms ? config->rpc_timeout_ms : CONFIG_AOS_WS_CLIENT_RPC_TIMEOUTMS_DEFAULT,
+        .rx_backlog = config->rx_backlog,
+        .rx_high_water = config->rx_backlog ? config->rx_high_water : 0,
+        .rx_low_water = config->rx_low_water ? config->rx_low_water : config->rx_high_water / 2,
+        .rate_bytes_per_s = config->rate_bytes_per_s,
+        .rate_messages_per_s = config->rate_messages_per_s,
+        .rate_burst_bytes = config->rate_burst_bytes ? config->rate_burst_bytes : config->rate_bytes_per_s,
+        .rate_burst_messages = config->rate_burst_messages ? config->rate_burst_messages : config->rate_messages_per_s,
+        .rate_queue_size = config->rate_queue_size ? config->rate_queue_size : CONFIG_AOS_WS_CLIENT_RATEQUEUESIZE_DEFAULT,
+        .lanes = config->lanes_len ? config->lanes : NULL,
+        .lanes_len = config->lanes_len,
+        .tx_frames = config->tx_frames,
+        .session_window = config->session_window,
+        .routes = config->routes_len ? config->routes : NULL,
+        .routes_len = config->routes_len,
+        .route_key_offset = config->route_key_offset,
+        .route_key_len = config->route_key_len,
+        .endpoints = config->endpoints_len ? config->endpoints : NULL,
+        .endpoints_len = config->endpoints_len,
+        .endpoint_failures = config->endpoint_failures ? config->endpoint_failures : CONFIG_AOS_WS_CLIENT_ENDPOINTFAILURES_DEFAULT,
+        .endpoint_recheck_ms = config->endpoint_recheck_ms ? config->endpoint_recheck_ms : CONFIG_AOS_WS_CLIENT_ENDPOINTRECHECKMS_DEFAULT,
+        .tuning = config->tuning,
+        .on_data_ex = config->on_data_ex,
+        .on_data_ctx = config->on_data_ctx,
+        .tls_max_fragment_len = config->tls_max_fragment_len,
+        .standby = config->standby,
+        .standby_ping_ms = config->standby_ping_ms ? config->standby_ping_ms : CONFIG_AOS_WS_CLIENT_STANDBYPINGMS_DEFAULT,
+        .standby_delay_ms = config->standby_delay_ms ? config->standby_delay_ms : CONFIG_AOS_WS_CLIENT_STANDBYDELAYMS_DEFAULT,
+        .lowpower_window_ms = config->lowpower_window_ms,
+        .lowpower_linger_ms = config->lowpower_linger_ms ? config->lowpower_linger_ms : CONFIG_AOS_WS_CLIENT_LOWPOWERLINGERMS_DEFAULT,
     };
 
+    const _aos_ws_client_tuning_preset_t *tuning = &_aos_ws_client_tunings[complete_config.tuning];
+    complete_config.tcp_nodelay = config->tcp_nodelay ? config->tcp_nodelay : tuning->tcp_nodelay;
+    complete_config.keepalive_idle_s = config->keepalive_idle_s ? config->keepalive_idle_s : tuning->keepalive_idle_s;
+    complete_config.keepalive_interval_s = config->keepalive_interval_s ? config->keepalive_interval_s : tuning->keepalive_interval_s;
+    complete_config.keepalive_count = config->keepalive_count ? config->keepalive_count : tuning->keepalive_count;
+
+    complete_config.batch_max_bytes = config->batch_max_bytes ? config->batch_max_bytes : complete_config.buffer_size;
+    complete_config.tx_frame_size = config->tx_frame_size ? config->tx_frame_size : complete_config.buffer_size;
+    complete_config.session_slot_size = config->session_slot_size ? config->session_slot_size : complete_config.buffer_size;
+
+    // Negotiating the fragment length takes the TLS setup hook, which only works with parsed certificates
+    if (tls_mfl_code && !complete_config.certs && complete_config.mode != AOS_WS_CLIENT_MODE_INSECURE)
+    {
+        tls_certs = aos_ws_client_certs_alloc(complete_config.server_cert_chain_pem, complete_config.client_cert_chain_pem, complete_config.client_key_pem);
+        if (!tls_certs)
+            goto aos_ws_client_alloc_err;
+        complete_config.certs = tls_certs;
+    }
+
     // Allocate resources
     ctx = calloc(1, sizeof(_aos_ws_client_ctx_t));
-    buffer = calloc(complete_config.buffer_size, sizeof(char));
     aos_task_config_t task_config = {
         .stacksize = complete_config.stacksize,
         .queuesize = complete_config.queuesize,
@@ -133,75 +666,85 @@ aos_task_t *aos_ws_client_alloc(aos_ws_client_config_t *config)
         .name = complete_config.name,
         .args = ctx};
     task = aos_task_alloc(&task_config);
-    if (!ctx || !buffer || !task)
+    if (!ctx || !task)
         goto aos_ws_client_alloc_err;
 
-    // Configure transports
-    switch (complete_config.mode)
-    {
-    case AOS_WS_CLIENT_MODE_SECURE:
-    case AOS_WS_CLIENT_MODE_SECURE_TEST:
+    // RPC lookup table is kept at most half full to keep probe sequences short
+    if (complete_config.rpc_id_len)
     {
-        ESP_LOGD(_tag, "Setting up SSL transport (port:%u)", complete_config.port);
-        parent_transport = esp_transport_ssl_init();
-        if (!parent_transport)
+        while (rpc_table_size < 2 * complete_config.rpc_max_in_flight)
+            rpc_table_size <<= 1;
+        rpc_pool = calloc(complete_config.rpc_max_in_flight, sizeof(_aos_ws_client_rpc_t));
+        rpc_table = malloc(rpc_table_size * sizeof(uint16_t));
+        if (!rpc_pool || !rpc_table)
             goto aos_ws_client_alloc_err;
+    }
 
-        if (complete_config.server_cert_chain_pem)
-        {
-            esp_transport_ssl_set_cert_data(parent_transport, complete_config.server_cert_chain_pem, strlen(complete_config.server_cert_chain_pem));
-        }
-        else
-        {
-            esp_transport_ssl_enable_global_ca_store(parent_transport);
-        }
-
-        if (complete_config.client_cert_chain_pem && complete_config.client_key_pem)
-        {
-            esp_transport_ssl_set_client_cert_data(parent_transport, complete_config.client_cert_chain_pem, strlen(complete_config.client_cert_chain_pem));
-            esp_transport_ssl_set_client_key_data(parent_transport, complete_config.client_key_pem, strlen(complete_config.client_key_pem));
-        }
+    if (complete_config.on_data_batch)
+    {
+        batch = calloc(complete_config.batch_max_messages, sizeof(aos_ws_client_message_t));
+        if (!batch)
+            goto aos_ws_client_alloc_err;
+    }
 
-        if (complete_config.mode == AOS_WS_CLIENT_MODE_SECURE_TEST)
+    // Lane slots are preallocated so that queueing never allocates, one slot is staged for writing at a time
+    if (complete_config.lanes_len)
+    {
+        size_t lane_tx_size = 0;
+        for (size_t i = 0; i < complete_config.lanes_len; i++)
         {
-            esp_transport_ssl_skip_common_name_check(parent_transport);
+            const aos_ws_client_lane_t *lane = &complete_config.lanes[i];
+            lanes[i].stride = (sizeof(_aos_ws_client_slot_t) + lane->slot_size + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+            lanes[i].slots = malloc(lane->depth * lanes[i].stride);
+            if (!lanes[i].slots)
+                goto aos_ws_client_alloc_err;
+            if (lane->slot_size > lane_tx_size)
+                lane_tx_size = lane->slot_size;
         }
-
-        break;
+        lane_tx = malloc(lane_tx_size);
+        if (!lane_tx)
+            goto aos_ws_client_alloc_err;
     }
-    case AOS_WS_CLIENT_MODE_INSECURE:
+
+    // Staging frames leave room for the longest header ahead of the payload, so that each frame is contiguous
+    if (complete_config.tx_frames)
     {
-        ESP_LOGD(_tag, "Setting up TCP transport (port:%u)", complete_config.port);
-        parent_transport = esp_transport_tcp_init();
-        if (!parent_transport)
+        tx_stride = (_AOS_WS_CLIENT_TX_HEADER_MAX + complete_config.tx_frame_size + 3) & ~(size_t)3;
+        tx_frames = calloc(complete_config.tx_frames, sizeof(_aos_ws_client_tx_frame_t));
+        if (!tx_frames)
+            goto aos_ws_client_alloc_err;
+        tx_staging = malloc(complete_config.tx_frames * tx_stride);
+        if (!tx_staging)
             goto aos_ws_client_alloc_err;
-
-        break;
     }
-    default:
-        goto aos_ws_client_alloc_err;
+
+    // Messages are kept with their session header, so that replaying them is a plain write
+    if (complete_config.session_window)
+    {
+        session_stride = (_AOS_WS_CLIENT_SESSION_HEADER + complete_config.session_slot_size + 3) & ~(size_t)3;
+        session_slots = malloc(complete_config.session_window * session_stride);
+        session_lens = calloc(complete_config.session_window, sizeof(size_t));
+        if (!session_slots || !session_lens)
+            goto aos_ws_client_alloc_err;
     }
 
-    transport = esp_transport_ws_init(parent_transport);
-    if (!transport)
-        goto aos_ws_client_alloc_err;
+    if (complete_config.rate_bytes_per_s || complete_config.rate_messages_per_s)
+    {
+        rate_queue = calloc(complete_config.rate_queue_size, sizeof(_aos_ws_client_held_t));
+        if (!rate_queue)
+            goto aos_ws_client_alloc_err;
+    }
 
-    /**
-     * In the following configuration, we set propagate_control_frames to TRUE
-     * because while the esp_transport_ws implementation CAN handle
-     * disconnections, close frames, and others, it CANNOT notify a handler of
-     * such events, including DISCONNECTIONS!
-     * Thus we need to handle that stuff on our own.
-     */
-    esp_transport_ws_config_t ws_config = {
-        .ws_path = complete_config.path,
-        .sub_protocol = complete_config.subprotocol,
-        .user_agent = complete_config.user_agent,
-        .headers = complete_config.headers,
-        .propagate_control_frames = true};
+    // Same for the route table, which never changes after this
+    if (complete_config.routes_len)
+    {
+        while (route_table_size < 2 * complete_config.routes_len)
+            route_table_size <<= 1;
+        route_table = malloc(route_table_size * sizeof(uint16_t));
+        if (!route_table)
+            goto aos_ws_client_alloc_err;
+    }
 
-    if (esp_transport_ws_set_config(transport, &ws_config) != ESP_OK)
-        goto aos_ws_client_alloc_err;
     if (aos_task_handler_set(task, _aos_ws_client_handler_connect, AOS_WS_CLIENT_TASKEVT_CONNECT))
         goto aos_ws_client_alloc_err;
     if (aos_task_handler_set(task, _aos_ws_client_handler_disconnect, AOS_WS_CLIENT_TASKEVT_DISCONNECT))
@@ -210,20 +753,112 @@ aos_task_t *aos_ws_client_alloc(aos_ws_client_config_t *config)
         goto aos_ws_client_alloc_err;
     if (aos_task_handler_set(task, _aos_ws_client_handler_send_binary, AOS_WS_CLIENT_TASKEVT_SEND_BINARY))
         goto aos_ws_client_alloc_err;
+    if (aos_task_handler_set(task, _aos_ws_client_handler_stats_get, AOS_WS_CLIENT_TASKEVT_STATS_GET))
+        goto aos_ws_client_alloc_err;
+    if (aos_task_handler_set(task, _aos_ws_client_handler_rpc, AOS_WS_CLIENT_TASKEVT_RPC))
+        goto aos_ws_client_alloc_err;
 
     // Build context
-    ctx->parent_transport = parent_transport;
-    ctx->transport = transport;
+    portMUX_INITIALIZE(&ctx->lock);
     ctx->config = complete_config;
-    ctx->buffer = buffer;
+    ctx->batch = batch;
+    memcpy(ctx->lanes, lanes, sizeof(lanes));
+    ctx->lane_tx = lane_tx;
+    ctx->tx_frames = tx_frames;
+    ctx->tx_staging = tx_staging;
+    ctx->tx_stride = tx_stride;
+    ctx->session_slots = session_slots;
+    ctx->session_lens = session_lens;
+    ctx->session_stride = session_stride;
+    esp_fill_random(ctx->session_id, sizeof(ctx->session_id));
+    // A single host is a list of one, never switched
+    ctx->endpoints_len = complete_config.endpoints_len ? complete_config.endpoints_len : 1;
+    for (size_t i = 0; i < ctx->endpoints_len; i++)
+    {
+        const aos_ws_client_endpoint_t *endpoint = complete_config.endpoints_len ? &complete_config.endpoints[i] : NULL;
+        ctx->endpoints[i].host = endpoint ? endpoint->host : complete_config.host;
+        ctx->endpoints[i].port = endpoint && endpoint->port ? endpoint->port : complete_config.port;
+        ctx->endpoints[i].path = endpoint && endpoint->path ? endpoint->path : complete_config.path;
+    }
+    ctx->tls_mfl_code = tls_mfl_code;
+    // The transports keep a pointer to it
+    ctx->keep_alive = (esp_transport_keep_alive_t){
+        .keep_alive_enable = complete_config.keepalive_idle_s != 0,
+        .keep_alive_idle = complete_config.keepalive_idle_s,
+        .keep_alive_interval = complete_config.keepalive_interval_s ? complete_config.keepalive_interval_s : 5,
+        .keep_alive_count = complete_config.keepalive_count ? complete_config.keepalive_count : 3};
+    ctx->rate_queue = rate_queue;
+    ctx->rate_bytes = (int64_t)complete_config.rate_burst_bytes * 1000000;
+    ctx->rate_messages = (int64_t)complete_config.rate_burst_messages * 1000000;
+    ctx->rate_stamp = esp_timer_get_time();
+    ctx->rpc_pool = rpc_pool;
+    ctx->rpc_table = rpc_table;
+    ctx->rpc_table_mask = rpc_table_size - 1;
+    ctx->rpc_free = rpc_pool ? 0 : _AOS_WS_CLIENT_RPC_NONE;
+    ctx->rpc_rx = _AOS_WS_CLIENT_RPC_NONE;
+    for (uint32_t i = 0; rpc_table && i < rpc_table_size; i++)
+        rpc_table[i] = _AOS_WS_CLIENT_RPC_NONE;
+    for (uint32_t i = 0; rpc_pool && i < complete_config.rpc_max_in_flight; i++)
+        rpc_pool[i].wheel_next = i + 1 < complete_config.rpc_max_in_flight ? i + 1 : _AOS_WS_CLIENT_RPC_NONE;
+    for (uint32_t i = 0; i < _AOS_WS_CLIENT_RPC_WHEEL_SLOTS; i++)
+        ctx->rpc_wheel[i] = _AOS_WS_CLIENT_RPC_NONE;
+    ctx->route_table = route_table;
+    ctx->route_table_mask = route_table_size - 1;
+    ctx->route_rx = _AOS_WS_CLIENT_ROUTE_NONE;
+    for (uint32_t i = 0; route_table && i < route_table_size; i++)
+        route_table[i] = _AOS_WS_CLIENT_ROUTE_NONE;
+    for (uint16_t i = 0; i < complete_config.routes_len; i++)
+    {
+        uint32_t slot = _aos_ws_client_route_hash(ctx, complete_config.routes[i].key);
+        while (route_table[slot] != _AOS_WS_CLIENT_ROUTE_NONE)
+        {
+            // A duplicate would never be matched
+            if (!memcmp(complete_config.routes[route_table[slot]].key, complete_config.routes[i].key, complete_config.route_key_len))
+            {
+                ESP_LOGE(_tag, "Invalid route configuration (route:%u duplicates route:%u)", i, route_table[slot]);
+                goto aos_ws_client_alloc_err;
+            }
+            slot = (slot + 1) & ctx->route_table_mask;
+        }
+        route_table[slot] = i;
+    }
+
+    if (!complete_config.lazy_resources && !_aos_ws_client_resources_alloc(ctx))
+        goto aos_ws_client_alloc_err;
+
+#if CONFIG_PM_ENABLE
+    // Without it the chip may light sleep while awake as well, only adding latency
+    if (complete_config.lowpower_window_ms && esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "aos_ws_client", &ctx->lowpower_pm_lock) != ESP_OK)
+    {
+        ESP_LOGW(_tag, "Could not create power management lock");
+        ctx->lowpower_pm_lock = NULL;
+    }
+#endif
+
+    if (complete_config.certs && !tls_certs)
+    {
+        portENTER_CRITICAL(&_aos_ws_client_connecting_lock);
+        complete_config.certs->refs++;
+        portEXIT_CRITICAL(&_aos_ws_client_connecting_lock);
+    }
 
     return task;
 
 aos_ws_client_alloc_err:
-    esp_transport_destroy(transport);
-    esp_transport_destroy(parent_transport);
     free(ctx);
-    free(buffer);
+    free(rpc_pool);
+    free(rpc_table);
+    free(route_table);
+    free(batch);
+    for (size_t i = 0; i < AOS_WS_CLIENT_LANES_MAX; i++)
+        free(lanes[i].slots);
+    free(lane_tx);
+    free(tx_frames);
+    free(tx_staging);
+    free(session_slots);
+    free(session_lens);
+    free(rate_queue);
+    aos_ws_client_certs_free(tls_certs);
     aos_task_free(task);
     return NULL;
 }
@@ -232,9 +867,37 @@ void aos_ws_client_free(aos_task_t *task)
 {
     ESP_LOGD(_tag, "%s", __FUNCTION__);
     _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
-    esp_transport_destroy(ctx->transport);
-    esp_transport_destroy(ctx->parent_transport);
-    free(ctx->buffer);
+#if CONFIG_AOS_WS_CLIENT_SIZING
+    aos_ws_client_stats_t sizing = {0};
+    _aos_ws_client_sizing_get(ctx, &sizing);
+    ESP_LOGI(_tag, "Sizing (stack_free_min:%u queue_peak:%u rx_fill_peak:%u rx_frame_max:%u) recommends stacksize:%u queuesize:%u buffer_size:%u",
+             sizing.stack_free_min, sizing.queue_peak, sizing.rx_fill_peak, sizing.rx_frame_max,
+             sizing.recommended_stacksize, sizing.recommended_queuesize, sizing.recommended_buffer_size);
+#endif
+    _aos_ws_client_worker_wait(ctx);
+    _aos_ws_client_rx_reset(task);
+    _aos_ws_client_rpc_fail_all(task, 1);
+    _aos_ws_client_rate_fail_all(task);
+    _aos_ws_client_resources_free(ctx);
+    _aos_ws_client_standby_free(ctx);
+    _aos_ws_client_lowpower_rest(ctx, esp_timer_get_time());
+#if CONFIG_PM_ENABLE
+    if (ctx->lowpower_pm_lock)
+        esp_pm_lock_delete(ctx->lowpower_pm_lock);
+#endif
+    aos_ws_client_certs_free(ctx->config.certs);
+    free(ctx->rpc_pool);
+    free(ctx->rpc_table);
+    free(ctx->route_table);
+    free(ctx->batch);
+    for (size_t i = 0; i < AOS_WS_CLIENT_LANES_MAX; i++)
+        free(ctx->lanes[i].slots);
+    free(ctx->lane_tx);
+    free(ctx->tx_frames);
+    free(ctx->tx_staging);
+    free(ctx->session_slots);
+    free(ctx->session_lens);
+    free(ctx->rate_queue);
     free(ctx);
     aos_task_free(task);
 }
@@ -242,19 +905,47 @@ void aos_ws_client_free(aos_task_t *task)
 AOS_DEFINE(aos_ws_client_send_text, char *, uint8_t)
 aos_future_t *aos_ws_client_send_text(aos_task_t *client, aos_future_t *future)
 {
-    return aos_task_send(client, AOS_WS_CLIENT_TASKEVT_SEND_TEXT, future);
+    return _aos_ws_client_send(client, AOS_WS_CLIENT_TASKEVT_SEND_TEXT, future, 0);
 }
 static void _aos_ws_client_handler_send_text(aos_task_t *task, aos_future_t *future)
 {
     ESP_LOGD(_tag, "%s", __FUNCTION__);
     AOS_ARGS_T(aos_ws_client_send_text) *args = aos_args_get(future);
     _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    _AOS_WS_CLIENT_PROFILE_DEQUEUE(ctx);
+    _AOS_WS_CLIENT_SIZING_DEQUEUE(ctx);
+    _aos_ws_client_lowpower_send(task);
+
+    if (_aos_ws_client_rate_hold(task, AOS_WS_CLIENT_TASKEVT_SEND_TEXT, future, strlen(args->in_data)))
+    {
+        return;
+    }
+    _aos_ws_client_write_text(task, future);
+}
+
+static void _aos_ws_client_write_text(aos_task_t *task, aos_future_t *future)
+{
+    AOS_ARGS_T(aos_ws_client_send_text) *args = aos_args_get(future);
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+
+    if (ctx->session_slots)
+    {
+        args->out_err = _aos_ws_client_session_send(task, false, args->in_data, strlen(args->in_data));
+        aos_resolve(future);
+        return;
+    }
 
     switch (ctx->state)
     {
     case CONNECTED:
     {
-        if (esp_transport_ws_send_raw(ctx->transport, WS_TRANSPORT_OPCODES_TEXT | WS_TRANSPORT_OPCODES_FIN, args->in_data, strlen(args->in_data), ctx->config.send_timeout_ms) < 0)
+        size_t data_len = strlen(args->in_data);
+        _AOS_WS_CLIENT_TRACE(ctx, AOS_WS_CLIENT_TRACE_WRITE_START, WS_TRANSPORT_OPCODES_TEXT, data_len);
+        _AOS_WS_CLIENT_PROFILE_START(send_stamp);
+        int err = esp_transport_ws_send_raw(ctx->transport, WS_TRANSPORT_OPCODES_TEXT | WS_TRANSPORT_OPCODES_FIN, args->in_data, data_len, ctx->config.send_timeout_ms);
+        _AOS_WS_CLIENT_PROFILE_END(ctx, AOS_WS_CLIENT_STAGE_SEND, send_stamp);
+        _AOS_WS_CLIENT_TRACE(ctx, AOS_WS_CLIENT_TRACE_WRITE_END, WS_TRANSPORT_OPCODES_TEXT, err < 0 ? 0 : data_len);
+        if (err < 0)
         {
             ESP_LOGW(_tag, "Could not send text data (errno:%d)", esp_transport_get_errno(ctx->transport));
             _aos_ws_client_onerror(task);
@@ -280,19 +971,47 @@ static void _aos_ws_client_handler_send_text(aos_task_t *task, aos_future_t *fut
 AOS_DEFINE(aos_ws_client_send_binary, void *, size_t, uint8_t)
 aos_future_t *aos_ws_client_send_binary(aos_task_t *client, aos_future_t *future)
 {
-    return aos_task_send(client, AOS_WS_CLIENT_TASKEVT_SEND_BINARY, future);
+    AOS_ARGS_T(aos_ws_client_send_binary) *args = aos_args_get(future);
+    return _aos_ws_client_send(client, AOS_WS_CLIENT_TASKEVT_SEND_BINARY, future, args->in_data_len);
 }
 static void _aos_ws_client_handler_send_binary(aos_task_t *task, aos_future_t *future)
 {
     ESP_LOGD(_tag, "%s", __FUNCTION__);
     AOS_ARGS_T(aos_ws_client_send_binary) *args = aos_args_get(future);
     _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    _AOS_WS_CLIENT_PROFILE_DEQUEUE(ctx);
+    _AOS_WS_CLIENT_SIZING_DEQUEUE(ctx);
+    _aos_ws_client_lowpower_send(task);
+
+    if (_aos_ws_client_rate_hold(task, AOS_WS_CLIENT_TASKEVT_SEND_BINARY, future, args->in_data_len))
+    {
+        return;
+    }
+    _aos_ws_client_write_binary(task, future);
+}
+
+static void _aos_ws_client_write_binary(aos_task_t *task, aos_future_t *future)
+{
+    AOS_ARGS_T(aos_ws_client_send_binary) *args = aos_args_get(future);
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+
+    if (ctx->session_slots)
+    {
+        args->out_err = _aos_ws_client_session_send(task, true, args->in_data, args->in_data_len);
+        aos_resolve(future);
+        return;
+    }
 
     switch (ctx->state)
     {
     case CONNECTED:
     {
-        if (esp_transport_ws_send_raw(ctx->transport, WS_TRANSPORT_OPCODES_BINARY | WS_TRANSPORT_OPCODES_FIN, args->in_data, args->in_data_len, ctx->config.send_timeout_ms) < 0)
+        _AOS_WS_CLIENT_TRACE(ctx, AOS_WS_CLIENT_TRACE_WRITE_START, WS_TRANSPORT_OPCODES_BINARY, args->in_data_len);
+        _AOS_WS_CLIENT_PROFILE_START(send_stamp);
+        int err = esp_transport_ws_send_raw(ctx->transport, WS_TRANSPORT_OPCODES_BINARY | WS_TRANSPORT_OPCODES_FIN, args->in_data, args->in_data_len, ctx->config.send_timeout_ms);
+        _AOS_WS_CLIENT_PROFILE_END(ctx, AOS_WS_CLIENT_STAGE_SEND, send_stamp);
+        _AOS_WS_CLIENT_TRACE(ctx, AOS_WS_CLIENT_TRACE_WRITE_END, WS_TRANSPORT_OPCODES_BINARY, err < 0 ? 0 : args->in_data_len);
+        if (err < 0)
         {
             ESP_LOGW(_tag, "Could not send binary data (errno:%d)", esp_transport_get_errno(ctx->transport));
             _aos_ws_client_onerror(task);
@@ -315,55 +1034,564 @@ static void _aos_ws_client_handler_send_binary(aos_task_t *task, aos_future_t *f
     }
 }
 
-AOS_DEFINE(aos_ws_client_connect, uint8_t)
-aos_future_t *aos_ws_client_connect(aos_task_t *client, aos_future_t *future)
-{
-    return aos_task_send(client, AOS_WS_CLIENT_TASKEVT_CONNECT, future);
-}
-static void _aos_ws_client_handler_connect(aos_task_t *task, aos_future_t *future)
+uint8_t aos_ws_client_try_send(aos_task_t *client, uint32_t lane, bool binary, const void *data, size_t data_len)
 {
     ESP_LOGD(_tag, "%s", __FUNCTION__);
-    AOS_ARGS_T(aos_ws_client_connect) *args = aos_args_get(future);
-    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(client);
+    if (lane >= ctx->config.lanes_len || data_len > ctx->config.lanes[lane].slot_size)
+    {
+        ESP_LOGW(_tag, "Could not queue data (lane:%u data_len:%u)", lane, data_len);
+        return 1;
+    }
 
-    switch (ctx->state)
+    const aos_ws_client_lane_t *config = &ctx->config.lanes[lane];
+    _aos_ws_client_lane_t *l = &ctx->lanes[lane];
+    _aos_ws_client_slot_t *slot = NULL;
+    uint8_t err = 0;
+
+    // Claim a slot under the lock, then copy outside of it so that other cores and interrupts are not held off
+    portENTER_CRITICAL(&ctx->lock);
+    if (config->policy == AOS_WS_CLIENT_LANE_COALESCE && data_len >= config->key_offset + config->key_len)
     {
-    case DISCONNECTED:
-    case CONNECTING:
-    case RECONNECTING:
+        for (uint32_t i = 0; i < l->count; i++)
+        {
+            _aos_ws_client_slot_t *queued = (_aos_ws_client_slot_t *)(l->slots + ((l->head + i) % config->depth) * l->stride);
+            if (queued->state == _AOS_WS_CLIENT_SLOT_READY && queued->data_len >= config->key_offset + config->key_len && !memcmp(queued->data + config->key_offset, (const char *)data + config->key_offset, config->key_len))
+            {
+                slot = queued;
+                l->stats.coalesced++;
+                break;
+            }
+        }
+    }
+    if (!slot && l->count == config->depth)
     {
-        // Clean slate
-        _aos_ws_client_disconnect(task);
-
-        // Resolve current connect future if any
-        if (ctx->connect_future)
+        l->stats.dropped++;
+        // The oldest message cannot be dropped while being copied in or out, the newest one is then
+        if (config->policy == AOS_WS_CLIENT_LANE_DROP_NEWEST || ((_aos_ws_client_slot_t *)(l->slots + l->head * l->stride))->state != _AOS_WS_CLIENT_SLOT_READY)
         {
-            ESP_LOGD(_tag, "Resolving connect_future");
-            AOS_ARGS_T(aos_ws_client_connect) *connect_args = aos_args_get(ctx->connect_future);
-            connect_args->out_err = 1;
-            aos_resolve(ctx->connect_future);
-            ctx->connect_future = NULL;
+            err = 1;
         }
-
-        // Perform connection attempt
-        ctx->connect_future = future;
-        ctx->connection_attempt = 0;
-        ctx->reconnection_attempt = 0;
-        if (esp_transport_connect(
-                ctx->transport,
-                ctx->config.host,
-                ctx->config.port,
-                ctx->config.send_timeout_ms) < 0)
+        else
         {
-            ESP_LOGW(_tag, "Could not connect (errno:%d)", esp_transport_get_errno(ctx->transport));
-            _aos_ws_client_onerror(task);
-            break;
+            l->head = (l->head + 1) % config->depth;
+            l->count--;
+        }
+    }
+    if (!err)
+    {
+        if (!slot)
+        {
+            slot = (_aos_ws_client_slot_t *)(l->slots + ((l->head + l->count) % config->depth) * l->stride);
+            l->count++;
+            if (l->count > l->stats.peak)
+            {
+                l->stats.peak = l->count;
+            }
+        }
+        slot->data_len = data_len;
+        slot->binary = binary;
+        slot->state = _AOS_WS_CLIENT_SLOT_WRITING;
+    }
+    portEXIT_CRITICAL(&ctx->lock);
+    if (err)
+    {
+        return err;
+    }
+
+    memcpy(slot->data, data, data_len);
+    portENTER_CRITICAL(&ctx->lock);
+    slot->state = _AOS_WS_CLIENT_SLOT_READY;
+    portEXIT_CRITICAL(&ctx->lock);
+    return 0;
+}
+
+uint8_t aos_ws_client_encode_begin(aos_task_t *client, aos_ws_client_encoder_t *encoder)
+{
+    ESP_LOGD(_tag, "%s", __FUNCTION__);
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(client);
+    memset(encoder, 0, sizeof(*encoder));
+    if (!ctx->config.tx_frames)
+    {
+        ESP_LOGW(_tag, "No staging frames configured");
+        return 1;
+    }
+
+    uint32_t frame = 0;
+    portENTER_CRITICAL(&ctx->lock);
+    bool full = ctx->tx_count == ctx->config.tx_frames;
+    if (full)
+    {
+        ctx->tx_refused++;
+    }
+    else
+    {
+        frame = (ctx->tx_head + ctx->tx_count) % ctx->config.tx_frames;
+        ctx->tx_frames[frame].state = _AOS_WS_CLIENT_TX_ENCODING;
+        ctx->tx_count++;
+    }
+    portEXIT_CRITICAL(&ctx->lock);
+    if (full)
+    {
+        return 1;
+    }
+
+    encoder->client = client;
+    encoder->data = ctx->tx_staging + frame * ctx->tx_stride + _AOS_WS_CLIENT_TX_HEADER_MAX;
+    encoder->size = ctx->config.tx_frame_size;
+    encoder->frame = frame;
+    return 0;
+}
+
+void *aos_ws_client_encode_reserve(aos_ws_client_encoder_t *encoder, size_t len)
+{
+    if (encoder->overflow || len > encoder->size - encoder->len)
+    {
+        encoder->overflow = true;
+        return NULL;
+    }
+    void *data = encoder->data + encoder->len;
+    encoder->len += len;
+    return data;
+}
+
+uint8_t aos_ws_client_encode_end(aos_ws_client_encoder_t *encoder)
+{
+    ESP_LOGD(_tag, "%s", __FUNCTION__);
+    if (!encoder->data)
+    {
+        return 1;
+    }
+    if (encoder->overflow)
+    {
+        ESP_LOGW(_tag, "Encoded message does not fit its staging frame (size:%u)", encoder->size);
+        aos_ws_client_encode_abort(encoder);
+        return 1;
+    }
+
+    // Fill the tail of the header slot, so that the header ends right where the payload starts
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(encoder->client);
+    uint8_t *payload = encoder->data;
+    size_t len = encoder->len;
+    uint8_t header_len = len < 126 ? 6 : len <= UINT16_MAX ? 8 : _AOS_WS_CLIENT_TX_HEADER_MAX;
+    uint8_t *header = payload - header_len;
+    header[0] = WS_TRANSPORT_OPCODES_FIN | WS_TRANSPORT_OPCODES_BINARY;
+    if (len < 126)
+    {
+        header[1] = 0x80 | len;
+    }
+    else if (len <= UINT16_MAX)
+    {
+        header[1] = 0x80 | 126;
+        header[2] = len >> 8;
+        header[3] = len;
+    }
+    else
+    {
+        header[1] = 0x80 | 127;
+        for (int i = 0; i < 8; i++)
+            header[2 + i] = (uint64_t)len >> (56 - 8 * i);
+    }
+
+    // Client frames must be masked, which is done in place since the payload is ours
+    uint8_t *mask = payload - 4;
+    esp_fill_random(mask, 4);
+    for (size_t i = 0; i < len; i++)
+        payload[i] ^= mask[i & 3];
+
+    portENTER_CRITICAL(&ctx->lock);
+    ctx->tx_frames[encoder->frame].header_len = header_len;
+    ctx->tx_frames[encoder->frame].len = len;
+    ctx->tx_frames[encoder->frame].state = _AOS_WS_CLIENT_TX_READY;
+    portEXIT_CRITICAL(&ctx->lock);
+    encoder->data = NULL;
+    return 0;
+}
+
+void aos_ws_client_encode_abort(aos_ws_client_encoder_t *encoder)
+{
+    ESP_LOGD(_tag, "%s", __FUNCTION__);
+    if (!encoder->data)
+    {
+        return;
+    }
+
+    // The frame keeps its place in the staging order and is skipped once reached
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(encoder->client);
+    portENTER_CRITICAL(&ctx->lock);
+    ctx->tx_frames[encoder->frame].state = _AOS_WS_CLIENT_TX_ABORTED;
+    portEXIT_CRITICAL(&ctx->lock);
+    encoder->data = NULL;
+}
+
+void aos_ws_client_cbor_uint(aos_ws_client_encoder_t *encoder, uint64_t value)
+{
+    _aos_ws_client_cbor_head(encoder, 0, value);
+}
+
+void aos_ws_client_cbor_int(aos_ws_client_encoder_t *encoder, int64_t value)
+{
+    if (value < 0)
+        _aos_ws_client_cbor_head(encoder, 1, (uint64_t)(-(value + 1)));
+    else
+        _aos_ws_client_cbor_head(encoder, 0, value);
+}
+
+void aos_ws_client_cbor_bytes(aos_ws_client_encoder_t *encoder, const void *data, size_t data_len)
+{
+    _aos_ws_client_cbor_head(encoder, 2, data_len);
+    void *dst = aos_ws_client_encode_reserve(encoder, data_len);
+    if (dst)
+        memcpy(dst, data, data_len);
+}
+
+void aos_ws_client_cbor_text(aos_ws_client_encoder_t *encoder, const char *data, size_t data_len)
+{
+    _aos_ws_client_cbor_head(encoder, 3, data_len);
+    void *dst = aos_ws_client_encode_reserve(encoder, data_len);
+    if (dst)
+        memcpy(dst, data, data_len);
+}
+
+void aos_ws_client_cbor_array(aos_ws_client_encoder_t *encoder, size_t items)
+{
+    _aos_ws_client_cbor_head(encoder, 4, items);
+}
+
+void aos_ws_client_cbor_map(aos_ws_client_encoder_t *encoder, size_t pairs)
+{
+    _aos_ws_client_cbor_head(encoder, 5, pairs);
+}
+
+void aos_ws_client_cbor_bool(aos_ws_client_encoder_t *encoder, bool value)
+{
+    _aos_ws_client_encode_tagged(encoder, value ? 0xF5 : 0xF4, 0, 0);
+}
+
+void aos_ws_client_cbor_null(aos_ws_client_encoder_t *encoder)
+{
+    _aos_ws_client_encode_tagged(encoder, 0xF6, 0, 0);
+}
+
+void aos_ws_client_cbor_float(aos_ws_client_encoder_t *encoder, float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    _aos_ws_client_encode_tagged(encoder, 0xFA, bits, 4);
+}
+
+void aos_ws_client_cbor_double(aos_ws_client_encoder_t *encoder, double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    _aos_ws_client_encode_tagged(encoder, 0xFB, bits, 8);
+}
+
+void aos_ws_client_msgpack_uint(aos_ws_client_encoder_t *encoder, uint64_t value)
+{
+    if (value < 0x80)
+        _aos_ws_client_encode_tagged(encoder, value, 0, 0);
+    else if (value <= UINT8_MAX)
+        _aos_ws_client_encode_tagged(encoder, 0xCC, value, 1);
+    else if (value <= UINT16_MAX)
+        _aos_ws_client_encode_tagged(encoder, 0xCD, value, 2);
+    else if (value <= UINT32_MAX)
+        _aos_ws_client_encode_tagged(encoder, 0xCE, value, 4);
+    else
+        _aos_ws_client_encode_tagged(encoder, 0xCF, value, 8);
+}
+
+void aos_ws_client_msgpack_int(aos_ws_client_encoder_t *encoder, int64_t value)
+{
+    if (value >= 0)
+        aos_ws_client_msgpack_uint(encoder, value);
+    else if (value >= -32)
+        _aos_ws_client_encode_tagged(encoder, (uint8_t)value, 0, 0);
+    else if (value >= INT8_MIN)
+        _aos_ws_client_encode_tagged(encoder, 0xD0, (uint8_t)value, 1);
+    else if (value >= INT16_MIN)
+        _aos_ws_client_encode_tagged(encoder, 0xD1, (uint16_t)value, 2);
+    else if (value >= INT32_MIN)
+        _aos_ws_client_encode_tagged(encoder, 0xD2, (uint32_t)value, 4);
+    else
+        _aos_ws_client_encode_tagged(encoder, 0xD3, (uint64_t)value, 8);
+}
+
+void aos_ws_client_msgpack_bin(aos_ws_client_encoder_t *encoder, const void *data, size_t data_len)
+{
+    if (data_len <= UINT8_MAX)
+        _aos_ws_client_encode_tagged(encoder, 0xC4, data_len, 1);
+    else if (data_len <= UINT16_MAX)
+        _aos_ws_client_encode_tagged(encoder, 0xC5, data_len, 2);
+    else
+        _aos_ws_client_encode_tagged(encoder, 0xC6, data_len, 4);
+    void *dst = aos_ws_client_encode_reserve(encoder, data_len);
+    if (dst)
+        memcpy(dst, data, data_len);
+}
+
+void aos_ws_client_msgpack_str(aos_ws_client_encoder_t *encoder, const char *data, size_t data_len)
+{
+    if (data_len < 32)
+        _aos_ws_client_encode_tagged(encoder, 0xA0 | data_len, 0, 0);
+    else if (data_len <= UINT8_MAX)
+        _aos_ws_client_encode_tagged(encoder, 0xD9, data_len, 1);
+    else if (data_len <= UINT16_MAX)
+        _aos_ws_client_encode_tagged(encoder, 0xDA, data_len, 2);
+    else
+        _aos_ws_client_encode_tagged(encoder, 0xDB, data_len, 4);
+    void *dst = aos_ws_client_encode_reserve(encoder, data_len);
+    if (dst)
+        memcpy(dst, data, data_len);
+}
+
+void aos_ws_client_msgpack_array(aos_ws_client_encoder_t *encoder, size_t items)
+{
+    if (items < 16)
+        _aos_ws_client_encode_tagged(encoder, 0x90 | items, 0, 0);
+    else if (items <= UINT16_MAX)
+        _aos_ws_client_encode_tagged(encoder, 0xDC, items, 2);
+    else
+        _aos_ws_client_encode_tagged(encoder, 0xDD, items, 4);
+}
+
+void aos_ws_client_msgpack_map(aos_ws_client_encoder_t *encoder, size_t pairs)
+{
+    if (pairs < 16)
+        _aos_ws_client_encode_tagged(encoder, 0x80 | pairs, 0, 0);
+    else if (pairs <= UINT16_MAX)
+        _aos_ws_client_encode_tagged(encoder, 0xDE, pairs, 2);
+    else
+        _aos_ws_client_encode_tagged(encoder, 0xDF, pairs, 4);
+}
+
+void aos_ws_client_msgpack_bool(aos_ws_client_encoder_t *encoder, bool value)
+{
+    _aos_ws_client_encode_tagged(encoder, value ? 0xC3 : 0xC2, 0, 0);
+}
+
+void aos_ws_client_msgpack_nil(aos_ws_client_encoder_t *encoder)
+{
+    _aos_ws_client_encode_tagged(encoder, 0xC0, 0, 0);
+}
+
+void aos_ws_client_msgpack_float(aos_ws_client_encoder_t *encoder, float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    _aos_ws_client_encode_tagged(encoder, 0xCA, bits, 4);
+}
+
+void aos_ws_client_msgpack_double(aos_ws_client_encoder_t *encoder, double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    _aos_ws_client_encode_tagged(encoder, 0xCB, bits, 8);
+}
+
+AOS_DEFINE(aos_ws_client_rpc, void *, size_t, uint32_t, void *, size_t, size_t, uint8_t)
+aos_future_t *aos_ws_client_rpc(aos_task_t *client, aos_future_t *future)
+{
+    AOS_ARGS_T(aos_ws_client_rpc) *args = aos_args_get(future);
+    return _aos_ws_client_send(client, AOS_WS_CLIENT_TASKEVT_RPC, future, args->in_data_len);
+}
+static void _aos_ws_client_handler_rpc(aos_task_t *task, aos_future_t *future)
+{
+    ESP_LOGD(_tag, "%s", __FUNCTION__);
+    AOS_ARGS_T(aos_ws_client_rpc) *args = aos_args_get(future);
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    _AOS_WS_CLIENT_PROFILE_DEQUEUE(ctx);
+    _AOS_WS_CLIENT_SIZING_DEQUEUE(ctx);
+    _aos_ws_client_lowpower_send(task);
+
+    if (_aos_ws_client_rate_hold(task, AOS_WS_CLIENT_TASKEVT_RPC, future, args->in_data_len))
+    {
+        return;
+    }
+    _aos_ws_client_write_rpc(task, future);
+}
+
+static void _aos_ws_client_write_rpc(aos_task_t *task, aos_future_t *future)
+{
+    AOS_ARGS_T(aos_ws_client_rpc) *args = aos_args_get(future);
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+
+    switch (ctx->state)
+    {
+    case CONNECTED:
+    {
+        uint64_t id = 0;
+        if (!ctx->config.rpc_id_len || args->in_data_len < ctx->config.rpc_id_offset + ctx->config.rpc_id_len)
+        {
+            ESP_LOGW(_tag, "RPC request without correlation ID (in_data_len:%u)", args->in_data_len);
+            args->out_err = 1;
+            aos_resolve(future);
+            break;
+        }
+        memcpy(&id, (char *)args->in_data + ctx->config.rpc_id_offset, ctx->config.rpc_id_len);
+        if (ctx->rpc_free == _AOS_WS_CLIENT_RPC_NONE || _aos_ws_client_rpc_find(ctx, id) != _AOS_WS_CLIENT_RPC_NONE)
+        {
+            ESP_LOGW(_tag, "Could not track RPC request (in_flight_full:%u)", ctx->rpc_free == _AOS_WS_CLIENT_RPC_NONE);
+            args->out_err = 1;
+            aos_resolve(future);
+            break;
+        }
+
+        // Send first: the response can only be processed by this task, after we are done here
+        _AOS_WS_CLIENT_TRACE(ctx, AOS_WS_CLIENT_TRACE_WRITE_START, WS_TRANSPORT_OPCODES_BINARY, args->in_data_len);
+        _AOS_WS_CLIENT_PROFILE_START(send_stamp);
+        int err = esp_transport_ws_send_raw(ctx->transport, WS_TRANSPORT_OPCODES_BINARY | WS_TRANSPORT_OPCODES_FIN, args->in_data, args->in_data_len, ctx->config.send_timeout_ms);
+        _AOS_WS_CLIENT_PROFILE_END(ctx, AOS_WS_CLIENT_STAGE_SEND, send_stamp);
+        _AOS_WS_CLIENT_TRACE(ctx, AOS_WS_CLIENT_TRACE_WRITE_END, WS_TRANSPORT_OPCODES_BINARY, err < 0 ? 0 : args->in_data_len);
+        if (err < 0)
+        {
+            ESP_LOGW(_tag, "Could not send RPC request (errno:%d)", esp_transport_get_errno(ctx->transport));
+            _aos_ws_client_onerror(task);
+            args->out_err = 1;
+            aos_resolve(future);
+            break;
+        }
+        _aos_ws_client_rpc_insert(ctx, id, future, args->in_timeout_ms ? args->in_timeout_ms : ctx->config.rpc_timeout_ms);
+        break;
+    }
+    case DISCONNECTED:
+    case CONNECTING:
+    case RECONNECTING:
+    {
+        args->out_err = 1;
+        aos_resolve(future);
+        break;
+    }
+    }
+}
+
+AOS_DEFINE(aos_ws_client_stats_get, aos_ws_client_stats_t)
+aos_future_t *aos_ws_client_stats_get(aos_task_t *client, aos_future_t *future)
+{
+    return _aos_ws_client_send(client, AOS_WS_CLIENT_TASKEVT_STATS_GET, future, 0);
+}
+static void _aos_ws_client_handler_stats_get(aos_task_t *task, aos_future_t *future)
+{
+    ESP_LOGD(_tag, "%s", __FUNCTION__);
+    AOS_ARGS_T(aos_ws_client_stats_get) *args = aos_args_get(future);
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    _AOS_WS_CLIENT_PROFILE_DEQUEUE(ctx);
+    _AOS_WS_CLIENT_SIZING_DEQUEUE(ctx);
+
+    memset(&args->out_stats, 0, sizeof(args->out_stats));
+#if CONFIG_AOS_WS_CLIENT_PROFILE
+    memcpy(args->out_stats.stages, ctx->stages, sizeof(ctx->stages));
+#endif
+#if CONFIG_AOS_WS_CLIENT_SIZING
+    _aos_ws_client_sizing_get(ctx, &args->out_stats);
+#endif
+    portENTER_CRITICAL(&ctx->lock);
+    for (size_t i = 0; i < ctx->config.lanes_len; i++)
+    {
+        args->out_stats.lanes[i] = ctx->lanes[i].stats;
+    }
+    portEXIT_CRITICAL(&ctx->lock);
+    _aos_ws_client_rate_refill(task);
+    args->out_stats.rate_tokens_bytes = ctx->rate_bytes / 1000000;
+    args->out_stats.rate_tokens_messages = ctx->rate_messages / 1000000;
+    args->out_stats.rate_held = ctx->rate_held;
+    args->out_stats.rate_delay_us = ctx->rate_delay_us;
+    portENTER_CRITICAL(&ctx->lock);
+    args->out_stats.tx_encoded = ctx->tx_encoded;
+    args->out_stats.tx_refused = ctx->tx_refused;
+    portEXIT_CRITICAL(&ctx->lock);
+    args->out_stats.session_unacked = ctx->session_count;
+    args->out_stats.session_replayed = ctx->session_replayed;
+    args->out_stats.session_duplicates = ctx->session_duplicates;
+    args->out_stats.endpoint = ctx->endpoint;
+    args->out_stats.endpoint_switches = ctx->endpoint_switches;
+    args->out_stats.socket_nodelay = ctx->socket_nodelay;
+    args->out_stats.connection_size = ctx->connection_size;
+    args->out_stats.standby_ready = ctx->standby_ready;
+    args->out_stats.standby_endpoint = ctx->standby_endpoint;
+    args->out_stats.standby_builds = ctx->standby_builds;
+    args->out_stats.standby_failovers = ctx->standby_failovers;
+    args->out_stats.standby_failover_us = ctx->standby_failover_us;
+    int64_t now = esp_timer_get_time();
+    args->out_stats.lowpower_wakeups = ctx->lowpower_wakeups;
+    args->out_stats.lowpower_active_us = ctx->lowpower_active_us + (ctx->lowpower_awake_stamp ? now - ctx->lowpower_awake_stamp : 0);
+    if (ctx->lowpower_stamp && now > ctx->lowpower_stamp)
+    {
+        args->out_stats.lowpower_wakeups_per_hour = (uint64_t)ctx->lowpower_wakeups * 3600000000ULL / (now - ctx->lowpower_stamp);
+    }
+    for (size_t i = 0; i < ctx->endpoints_len; i++)
+    {
+        args->out_stats.endpoints[i] = ctx->endpoints[i].stats;
+    }
+    args->out_stats.resources_size = ctx->resources_size;
+    args->out_stats.resources_allocated = ctx->transport != NULL;
+    args->out_stats.rx_paused = ctx->rx_paused;
+    args->out_stats.rx_pauses = ctx->rx_pauses;
+    args->out_stats.rx_paused_us = ctx->rx_paused_us;
+    args->out_stats.rx_paused_max_us = ctx->rx_paused_max_us;
+    if (ctx->rx_paused)
+    {
+        args->out_stats.rx_paused_us += esp_timer_get_time() - ctx->rx_paused_since;
+    }
+    aos_resolve(future);
+}
+
+AOS_DEFINE(aos_ws_client_connect, uint8_t)
+aos_future_t *aos_ws_client_connect(aos_task_t *client, aos_future_t *future)
+{
+    return _aos_ws_client_send(client, AOS_WS_CLIENT_TASKEVT_CONNECT, future, 0);
+}
+static void _aos_ws_client_handler_connect(aos_task_t *task, aos_future_t *future)
+{
+    ESP_LOGD(_tag, "%s", __FUNCTION__);
+    AOS_ARGS_T(aos_ws_client_connect) *args = aos_args_get(future);
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    _AOS_WS_CLIENT_PROFILE_DEQUEUE(ctx);
+    _AOS_WS_CLIENT_SIZING_DEQUEUE(ctx);
+
+    switch (ctx->state)
+    {
+    case DISCONNECTED:
+    case CONNECTING:
+    case RECONNECTING:
+    {
+        // Clean slate
+        _aos_ws_client_disconnect(task);
+
+        // Resolve current connect future if any
+        if (ctx->connect_future)
+        {
+            ESP_LOGD(_tag, "Resolving connect_future");
+            AOS_ARGS_T(aos_ws_client_connect) *connect_args = aos_args_get(ctx->connect_future);
+            connect_args->out_err = 1;
+            aos_resolve(ctx->connect_future);
+            ctx->connect_future = NULL;
+        }
+
+        // Transports and buffer are only missing in lazy mode, and kept while reconnecting
+        if (!ctx->transport && !_aos_ws_client_resources_alloc(ctx))
+        {
+            ESP_LOGE(_tag, "Could not allocate resources");
+            args->out_err = 1;
+            aos_resolve(future);
+            break;
+        }
+
+        // Perform connection attempt
+        ctx->connect_future = future;
+        ctx->connection_attempt = 0;
+        ctx->reconnection_attempt = 0;
+        if (_aos_ws_client_connect(task) < 0)
+        {
+            ESP_LOGW(_tag, "Could not connect (errno:%d)", esp_transport_get_errno(ctx->transport));
+            _aos_ws_client_onerror(task);
+            break;
         }
 
         // Connected! Set receive loops
         ESP_LOGI(_tag, "Connected");
         ctx->connect_future = NULL;
-        ctx->state = CONNECTED;
+        _aos_ws_client_state_set(task, CONNECTED);
         args->out_err = 0;
         aos_resolve(future);
 
@@ -386,12 +1614,14 @@ static void _aos_ws_client_handler_connect(aos_task_t *task, aos_future_t *futur
 AOS_DEFINE(aos_ws_client_disconnect)
 aos_future_t *aos_ws_client_disconnect(aos_task_t *client, aos_future_t *future)
 {
-    return aos_task_send(client, AOS_WS_CLIENT_TASKEVT_DISCONNECT, future);
+    return _aos_ws_client_send(client, AOS_WS_CLIENT_TASKEVT_DISCONNECT, future, 0);
 }
 static void _aos_ws_client_handler_disconnect(aos_task_t *task, aos_future_t *future)
 {
     ESP_LOGD(_tag, "%s", __FUNCTION__);
     _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    _AOS_WS_CLIENT_PROFILE_DEQUEUE(ctx);
+    _AOS_WS_CLIENT_SIZING_DEQUEUE(ctx);
 
     switch (ctx->state)
     {
@@ -413,7 +1643,7 @@ static void _aos_ws_client_handler_disconnect(aos_task_t *task, aos_future_t *fu
         }
 
         ESP_LOGI(_tag, "Disconnected");
-        ctx->state = DISCONNECTED;
+        _aos_ws_client_state_set(task, DISCONNECTED);
         aos_resolve(future);
         break;
     }
@@ -430,58 +1660,303 @@ static void _aos_ws_client_poll_loop(aos_task_t *task)
     ESP_LOGD(_tag, "%s", __FUNCTION__);
     _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
 
+    // Back to sleep until the next wake window, lanes and staged frames wait until then
+    if (_aos_ws_client_lowpower_poll(task))
+    {
+        return;
+    }
+
+    _aos_ws_client_rpc_expire(task);
+    _aos_ws_client_rate_release(task);
+    _aos_ws_client_lanes_drain(task);
+    _aos_ws_client_tx_drain(task);
+    if (ctx->state != CONNECTED)
+    {
+        return;
+    }
+    _aos_ws_client_session_poll(task);
+    _aos_ws_client_endpoint_recheck(task);
+    _aos_ws_client_standby_poll(task);
+    _aos_ws_client_worker_poll(task);
+    if (ctx->state != CONNECTED)
+    {
+        return;
+    }
+
+    // Leave data in the socket while the application catches up
+    if (_aos_ws_client_rx_throttle(task))
+    {
+        return;
+    }
+
+    // Resume streaming a sink frame straight into the application buffer
+    if (ctx->sink_message && ctx->rx_remaining && ctx->readahead_pos == ctx->readahead_len)
+    {
+        _aos_ws_client_sink(task, NULL, 0);
+        return;
+    }
+
+    if (ctx->config.readahead)
+    {
+        _aos_ws_client_readahead(task);
+        return;
+    }
+
+    bool new_frame = !ctx->rx_remaining;
     uint32_t data_len = 0;
     int32_t len = 0;
     do
     {
-        ESP_LOGD(_tag, "Reading transport");
+        ESP_LOGV(_tag, "Reading transport");
         // NOTE: This blocks until config.poll_timeout_ms if no data is received, and the task will be unresponsive in the meantime. Use an appropriate timeout value.
-        len = esp_transport_read(ctx->transport, ctx->buffer + data_len, ctx->config.buffer_size - data_len, ctx->config.poll_timeout_ms);
-        /**
-         * Websocket frame outline:
-         * 0                   1                   2                   3
-         * 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-         * +-+-+-+-+-------+-+-------------+-------------------------------+
-         * |F|R|R|R| opcode|M| Payload len |    Extended payload length    |
-         * |I|S|S|S|  (4)  |A|     (7)     |             (16/64)           |
-         * |N|V|V|V|       |S|             |   (if payload len==126/127)   |
-         * | |1|2|3|       |K|             |                               |
-         * +-+-+-+-+-------+-+-------------+ - - - - - - - - - - - - - - - +
-         * |     Extended payload length continued, if payload len == 127  |
-         * + - - - - - - - - - - - - - - - +-------------------------------+
-         * |                               |Masking-key, if MASK set to 1  |
-         * +-------------------------------+-------------------------------+
-         * | Masking-key (continued)       |          Payload Data         |
-         * +-------------------------------- - - - - - - - - - - - - - - - +
-         * :                     Payload Data continued ...                :
-         * + - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - +
-         * |                     Payload Data continued ...                |
-         * +---------------------------------------------------------------+
-         */
+        size_t read_len = ctx->config.buffer_size - data_len;
+        if (new_frame && !data_len)
+        {
+            // Read no more than the head of a frame that may go to the sink, the sink reads the rest directly
+            size_t head = _aos_ws_client_sink_head(task, ctx->sink_message ? WS_TRANSPORT_OPCODES_CONT : WS_TRANSPORT_OPCODES_BINARY);
+            read_len = head < read_len ? (head ? head : 1) : read_len;
+        }
+        _AOS_WS_CLIENT_PROFILE_START(read_stamp);
+        len = esp_transport_read(ctx->transport, ctx->buffer + data_len, read_len, ctx->lowpower_window ? 0 : ctx->config.poll_timeout_ms);
         if (len < 0)
         {
             ESP_LOGW(_tag, "Error while reading transport (errno:%d)", esp_transport_get_errno(ctx->transport));
             _aos_ws_client_onerror(task);
             return; // Break out of the loop
         }
+        if (len)
+        {
+            _AOS_WS_CLIENT_PROFILE_END(ctx, AOS_WS_CLIENT_STAGE_READ, read_stamp);
+            ctx->rx_stamp = esp_timer_get_time();
+            _AOS_WS_CLIENT_TRACE(ctx, AOS_WS_CLIENT_TRACE_READ, esp_transport_ws_get_read_opcode(ctx->transport), len);
+        }
         data_len += len;
-    } while (len && data_len < ctx->config.buffer_size && data_len < esp_transport_ws_get_read_payload_len(ctx->transport));
+        if (len && new_frame && data_len == len)
+        {
+            ctx->rx_payload_len = esp_transport_ws_get_read_payload_len(ctx->transport);
+            ctx->rx_remaining = ctx->rx_payload_len;
+        }
+        ctx->rx_remaining -= ctx->rx_remaining < len ? ctx->rx_remaining : len;
+    } while (len && data_len < ctx->config.buffer_size && ctx->rx_remaining && data_len < _aos_ws_client_sink_head(task, esp_transport_ws_get_read_opcode(ctx->transport)));
+    _AOS_WS_CLIENT_SIZING_FILL(ctx, data_len);
+    _AOS_WS_CLIENT_SIZING_FRAME(ctx, ctx->rx_payload_len);
 
-    ws_transport_opcodes_t opcode = esp_transport_ws_get_read_opcode(ctx->transport);
-    switch (opcode)
+    ctx->rx_opcode = esp_transport_ws_get_read_opcode(ctx->transport);
+    ctx->rx_fin = esp_transport_ws_get_fin_flag(ctx->transport);
+    _aos_ws_client_dispatch(task, new_frame, ctx->buffer, data_len);
+    _aos_ws_client_batch_flush(task);
+}
+
+static void _aos_ws_client_readahead(aos_task_t *task)
+{
+    ESP_LOGV(_tag, "%s", __FUNCTION__);
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+
+    // Keep unparsed bytes at the start of the buffer, then fill the rest with a single read
+    if (ctx->readahead_pos)
     {
-    case WS_TRANSPORT_OPCODES_CONT:
-    case WS_TRANSPORT_OPCODES_TEXT:
-    case WS_TRANSPORT_OPCODES_BINARY:
+        memmove(ctx->buffer, ctx->buffer + ctx->readahead_pos, ctx->readahead_len - ctx->readahead_pos);
+        ctx->readahead_len -= ctx->readahead_pos;
+        ctx->readahead_pos = 0;
+    }
+    // NOTE: This blocks until config.poll_timeout_ms if no data is received, and the task will be unresponsive in the meantime. Use an appropriate timeout value.
+    _AOS_WS_CLIENT_PROFILE_START(read_stamp);
+    int32_t len = esp_transport_read(ctx->parent_transport, ctx->buffer + ctx->readahead_len, ctx->config.buffer_size - ctx->readahead_len, ctx->lowpower_window ? 0 : ctx->config.poll_timeout_ms);
+    if (len < 0)
     {
-        ctx->config.on_data(ctx->buffer, data_len);
+        ESP_LOGW(_tag, "Error while reading transport (errno:%d)", esp_transport_get_errno(ctx->parent_transport));
+        _aos_ws_client_onerror(task);
+        return;
+    }
+    if (!len)
+    {
+        return;
+    }
+    ctx->rx_stamp = esp_timer_get_time();
+    _AOS_WS_CLIENT_PROFILE_END(ctx, AOS_WS_CLIENT_STAGE_READ, read_stamp);
+    _AOS_WS_CLIENT_TRACE(ctx, AOS_WS_CLIENT_TRACE_READ, ctx->rx_opcode, len);
+    ctx->readahead_len += len;
+    _AOS_WS_CLIENT_SIZING_FILL(ctx, ctx->readahead_len);
+
+    // Dispatch every complete frame in the buffer, and whatever is available of frames longer than the buffer
+    while (ctx->state == CONNECTED)
+    {
+        char *data = ctx->buffer + ctx->readahead_pos;
+        size_t data_len = ctx->readahead_len - ctx->readahead_pos;
+        if (!ctx->rx_remaining)
+        {
+            int header_len = _aos_ws_client_parse_header(task, data, data_len);
+            if (header_len < 0)
+            {
+                _aos_ws_client_onerror(task);
+                return;
+            }
+            if (!header_len)
+            {
+                break;
+            }
+            ctx->readahead_pos += header_len;
+            if (!ctx->rx_payload_len)
+            {
+                _aos_ws_client_dispatch(task, true, data + header_len, 0);
+                continue;
+            }
+            data += header_len;
+            data_len -= header_len;
+        }
+
+        bool new_frame = ctx->rx_remaining == ctx->rx_payload_len;
+        size_t chunk_len = data_len < ctx->rx_remaining ? data_len : ctx->rx_remaining;
+        if (!chunk_len || (chunk_len < ctx->rx_remaining && new_frame && ctx->rx_payload_len <= ctx->config.buffer_size))
+        {
+            // Frames fitting in the buffer are delivered whole
+            break;
+        }
+        ctx->readahead_pos += chunk_len;
+        ctx->rx_remaining -= chunk_len;
+        _aos_ws_client_dispatch(task, new_frame, data, chunk_len);
+    }
+    _aos_ws_client_batch_flush(task);
+}
+
+static int _aos_ws_client_parse_header(aos_task_t *task, const char *data, size_t data_len)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    const uint8_t *header = (const uint8_t *)data;
+
+    /**
+     * Websocket frame outline:
+     * 0                   1                   2                   3
+     * 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+     * +-+-+-+-+-------+-+-------------+-------------------------------+
+     * |F|R|R|R| opcode|M| Payload len |    Extended payload length    |
+     * |I|S|S|S|  (4)  |A|     (7)     |             (16/64)           |
+     * |N|V|V|V|       |S|             |   (if payload len==126/127)   |
+     * | |1|2|3|       |K|             |                               |
+     * +-+-+-+-+-------+-+-------------+ - - - - - - - - - - - - - - - +
+     * |     Extended payload length continued, if payload len == 127  |
+     * + - - - - - - - - - - - - - - - +-------------------------------+
+     * |                               |Masking-key, if MASK set to 1  |
+     * +-------------------------------+-------------------------------+
+     * | Masking-key (continued)       |          Payload Data         |
+     * +-------------------------------- - - - - - - - - - - - - - - - +
+     * :                     Payload Data continued ...                :
+     * + - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - +
+     * |                     Payload Data continued ...                |
+     * +---------------------------------------------------------------+
+     */
+    if (data_len < 2)
+    {
+        return 0;
+    }
+    ws_transport_opcodes_t opcode = header[0] & 0x0F;
+    bool control = opcode & 0x08;
+    size_t header_len = 2;
+    uint64_t payload_len = header[1] & 0x7F;
+    if (payload_len == 126)
+    {
+        header_len += 2;
+    }
+    else if (payload_len == 127)
+    {
+        header_len += 8;
+    }
+    if (data_len < header_len)
+    {
+        return 0;
+    }
+    if (header_len > 2)
+    {
+        payload_len = 0;
+        for (size_t i = 2; i < header_len; i++)
+        {
+            payload_len = payload_len << 8 | header[i];
+        }
+    }
+
+    // Servers never mask frames, we negotiate no extensions, and control frames are short and never fragmented
+    if ((header[0] & 0x70) || (header[1] & 0x80) || payload_len > SIZE_MAX || (control && (payload_len > 125 || !(header[0] & 0x80))))
+    {
+        ESP_LOGW(_tag, "Invalid frame header (header:%02x%02x)", header[0], header[1]);
+        return -1;
+    }
+
+    ctx->rx_opcode = opcode;
+    ctx->rx_fin = header[0] & 0x80;
+    ctx->rx_payload_len = payload_len;
+    ctx->rx_remaining = payload_len;
+    _AOS_WS_CLIENT_SIZING_FRAME(ctx, ctx->rx_payload_len);
+    return header_len;
+}
+
+static void _aos_ws_client_dispatch(aos_task_t *task, bool new_frame, char *data, uint32_t data_len)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+
+    if (ctx->session_slots && !_aos_ws_client_session_receive(task, new_frame, &data, &data_len))
+    {
+        return;
+    }
+
+    ws_transport_opcodes_t opcode = ctx->rx_opcode;
+    switch (opcode)
+    {
+    case WS_TRANSPORT_OPCODES_CONT:
+    case WS_TRANSPORT_OPCODES_TEXT:
+    case WS_TRANSPORT_OPCODES_BINARY:
+    {
+        if (_aos_ws_client_rpc_receive(task, new_frame, data, data_len))
+        {
+            break;
+        }
+        if (_aos_ws_client_route_receive(task, new_frame, data, data_len))
+        {
+            break;
+        }
+        // An empty final fragment still has to close the sink message
+        if (ctx->config.sink_acquire && ((opcode == WS_TRANSPORT_OPCODES_BINARY && (data_len || !ctx->rx_fin)) || (opcode == WS_TRANSPORT_OPCODES_CONT && ctx->sink_message)))
+        {
+            ctx->sink_message = true;
+            _aos_ws_client_sink(task, data, data_len);
+            break;
+        }
+        if (ctx->batch && new_frame && !ctx->rx_remaining)
+        {
+            _aos_ws_client_batch_add(task, data, data_len);
+            break;
+        }
+        _aos_ws_client_batch_flush(task);
+        _AOS_WS_CLIENT_TRACE(ctx, AOS_WS_CLIENT_TRACE_DISPATCH, opcode, data_len);
+        _AOS_WS_CLIENT_PROFILE_START(callback_stamp);
+        if (ctx->config.on_data_ex)
+        {
+            // Report positions within the application payload, without the session header
+            size_t header_len = ctx->session_rx_header ? _AOS_WS_CLIENT_SESSION_HEADER : 0;
+            aos_ws_client_rx_info_t info = {
+                .opcode = opcode,
+                .fin = ctx->rx_fin,
+                .frame_len = ctx->rx_payload_len - header_len,
+                .offset = ctx->rx_payload_len - ctx->rx_remaining - data_len - header_len,
+                .rx_us = ctx->rx_stamp};
+            ctx->config.on_data_ex(data, data_len, &info, ctx->config.on_data_ctx);
+        }
+        else
+        {
+            ctx->config.on_data(data, data_len);
+        }
+        _AOS_WS_CLIENT_PROFILE_END(ctx, AOS_WS_CLIENT_STAGE_CALLBACK, callback_stamp);
         break;
     }
     case WS_TRANSPORT_OPCODES_PING:
     {
         // Reply with a PONG message. Note that when PING messages are longer than config.buffer_len the PONG response will be truncated as well.
-        ESP_LOGD(_tag, "Received ping (%.*s)", ctx->config.buffer_size, ctx->buffer);
-        if (esp_transport_ws_send_raw(ctx->transport, WS_TRANSPORT_OPCODES_PONG | WS_TRANSPORT_OPCODES_FIN, ctx->buffer, data_len, ctx->config.send_timeout_ms) < 0)
+        ESP_LOGD(_tag, "Received ping (%.*s)", data_len, data);
+        _AOS_WS_CLIENT_TRACE(ctx, AOS_WS_CLIENT_TRACE_WRITE_START, WS_TRANSPORT_OPCODES_PONG, data_len);
+        _AOS_WS_CLIENT_PROFILE_START(send_stamp);
+        int err = esp_transport_ws_send_raw(ctx->transport, WS_TRANSPORT_OPCODES_PONG | WS_TRANSPORT_OPCODES_FIN, data, data_len, ctx->config.send_timeout_ms);
+        _AOS_WS_CLIENT_PROFILE_END(ctx, AOS_WS_CLIENT_STAGE_SEND, send_stamp);
+        _AOS_WS_CLIENT_TRACE(ctx, AOS_WS_CLIENT_TRACE_WRITE_END, WS_TRANSPORT_OPCODES_PONG, err < 0 ? 0 : data_len);
+        if (err < 0)
         {
             ESP_LOGW(_tag, "Error while replying to ping (errno:%d)", esp_transport_get_errno(ctx->transport));
             _aos_ws_client_onerror(task);
@@ -495,21 +1970,1495 @@ static void _aos_ws_client_poll_loop(aos_task_t *task)
     }
     case WS_TRANSPORT_OPCODES_CLOSE:
     {
-        _aos_ws_client_disconnect(task);
-        ctx->config.event_handler(AOS_WS_CLIENT_EVENT_DISCONNECTED, NULL);
-        break;
+        _aos_ws_client_disconnect(task);
+        _aos_ws_client_state_set(task, DISCONNECTED);
+        ctx->config.event_handler(AOS_WS_CLIENT_EVENT_DISCONNECTED, NULL);
+        break;
+    }
+    case WS_TRANSPORT_OPCODES_NONE:
+    {
+        break;
+    }
+    default:
+    {
+        // According to RFC6455 we should FAIL the websocket connection in this case
+        ESP_LOGW(_tag, "Unknown OPCODE (opcode:%d errno:%d)", opcode, esp_transport_get_errno(ctx->transport));
+        _aos_ws_client_onerror(task);
+    }
+    }
+}
+
+static void _aos_ws_client_sink(aos_task_t *task, const char *data, uint32_t data_len)
+{
+    ESP_LOGD(_tag, "%s", __FUNCTION__);
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+
+    // Move the frame head already read, then stream the rest of the frame directly into sink buffers
+    esp_transport_handle_t transport = ctx->config.readahead ? ctx->parent_transport : ctx->transport;
+    uint32_t data_offset = 0;
+    bool close = !data_len && !ctx->rx_remaining && ctx->rx_fin;
+    while (data_offset < data_len || ctx->rx_remaining || close)
+    {
+        close = false;
+        if (!ctx->sink_buffer)
+        {
+            ctx->sink_buffer = ctx->config.sink_acquire(&ctx->sink_buffer_len);
+            ctx->sink_buffer_fill = 0;
+            if (!ctx->sink_buffer || !ctx->sink_buffer_len)
+            {
+                ESP_LOGW(_tag, "Sink did not provide a buffer");
+                ctx->sink_buffer = NULL;
+                _aos_ws_client_onerror(task);
+                return;
+            }
+        }
+
+        size_t space = ctx->sink_buffer_len - ctx->sink_buffer_fill;
+        size_t chunk_len = 0;
+        if (data_offset < data_len)
+        {
+            chunk_len = data_len - data_offset < space ? data_len - data_offset : space;
+            memcpy((char *)ctx->sink_buffer + ctx->sink_buffer_fill, data + data_offset, chunk_len);
+            data_offset += chunk_len;
+        }
+        else if (ctx->rx_remaining)
+        {
+            _AOS_WS_CLIENT_PROFILE_START(read_stamp);
+            int32_t len = esp_transport_read(transport, (char *)ctx->sink_buffer + ctx->sink_buffer_fill, ctx->rx_remaining < space ? ctx->rx_remaining : space, ctx->config.poll_timeout_ms);
+            if (len < 0)
+            {
+                ESP_LOGW(_tag, "Error while reading transport (errno:%d)", esp_transport_get_errno(transport));
+                _aos_ws_client_onerror(task);
+                return;
+            }
+            if (!len)
+            {
+                // Nothing more for now, the next poll resumes the frame
+                return;
+            }
+            _AOS_WS_CLIENT_PROFILE_END(ctx, AOS_WS_CLIENT_STAGE_READ, read_stamp);
+            _AOS_WS_CLIENT_TRACE(ctx, AOS_WS_CLIENT_TRACE_READ, ctx->rx_opcode, len);
+            chunk_len = len;
+            ctx->rx_remaining -= ctx->rx_remaining < chunk_len ? ctx->rx_remaining : chunk_len;
+        }
+        ctx->sink_buffer_fill += chunk_len;
+
+        bool fin = data_offset >= data_len && !ctx->rx_remaining && ctx->rx_fin;
+        if (fin || ctx->sink_buffer_fill == ctx->sink_buffer_len)
+        {
+            void *sink_buffer = ctx->sink_buffer;
+            size_t sink_buffer_fill = ctx->sink_buffer_fill;
+            ctx->sink_buffer = NULL;
+            ctx->sink_buffer_fill = 0;
+            ctx->sink_message = !fin;
+            _AOS_WS_CLIENT_TRACE(ctx, AOS_WS_CLIENT_TRACE_DISPATCH, WS_TRANSPORT_OPCODES_BINARY, sink_buffer_fill);
+            _AOS_WS_CLIENT_PROFILE_START(callback_stamp);
+            ctx->config.sink_commit(sink_buffer, sink_buffer_fill, fin);
+            _AOS_WS_CLIENT_PROFILE_END(ctx, AOS_WS_CLIENT_STAGE_CALLBACK, callback_stamp);
+        }
+    }
+}
+
+static size_t _aos_ws_client_sink_head(aos_task_t *task, ws_transport_opcodes_t opcode)
+{
+    // Bytes of a frame to read through ctx->buffer before the rest can go to the sink, SIZE_MAX when it does not
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    if (!ctx->config.sink_acquire || ctx->session_slots)
+    {
+        return SIZE_MAX;
+    }
+    if (opcode == WS_TRANSPORT_OPCODES_CONT && ctx->sink_message)
+    {
+        return 0;
+    }
+    if (opcode != WS_TRANSPORT_OPCODES_BINARY)
+    {
+        return SIZE_MAX;
+    }
+    // Enough for the RPC correlation ID and the route key to be found
+    size_t rpc_len = ctx->rpc_pool ? ctx->config.rpc_id_offset + ctx->config.rpc_id_len : 0;
+    size_t route_len = ctx->route_table ? ctx->config.route_key_offset + ctx->config.route_key_len : 0;
+    return rpc_len > route_len ? rpc_len : route_len;
+}
+
+static void _aos_ws_client_rx_reset(aos_task_t *task)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    if (ctx->sink_buffer)
+    {
+        // Return the buffer of the aborted message to the application
+        void *sink_buffer = ctx->sink_buffer;
+        ctx->sink_buffer = NULL;
+        ctx->config.sink_commit(sink_buffer, 0, false);
+    }
+    ctx->sink_buffer_fill = 0;
+    ctx->sink_message = false;
+    ctx->route_rx = _AOS_WS_CLIENT_ROUTE_NONE;
+    ctx->rx_opcode = WS_TRANSPORT_OPCODES_NONE;
+    ctx->rx_fin = false;
+    ctx->rx_payload_len = 0;
+    ctx->rx_remaining = 0;
+    ctx->readahead_len = 0;
+    ctx->readahead_pos = 0;
+    ctx->batch_len = 0;
+    ctx->batch_bytes = 0;
+}
+
+static void _aos_ws_client_lanes_drain(aos_task_t *task)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    for (size_t lane = 0; lane < ctx->config.lanes_len && ctx->state == CONNECTED; lane++)
+    {
+        // Bounded, so that a busy producer cannot hold off reads
+        _aos_ws_client_lane_t *l = &ctx->lanes[lane];
+        for (uint32_t n = ctx->config.lanes[lane].depth; n && ctx->state == CONNECTED; n--)
+        {
+            // Stage the message so that producers are not held back by the write, a message still being copied in waits for the next poll
+            size_t data_len = 0;
+            ws_transport_opcodes_t opcode = WS_TRANSPORT_OPCODES_TEXT;
+            portENTER_CRITICAL(&ctx->lock);
+            _aos_ws_client_slot_t *slot = (_aos_ws_client_slot_t *)(l->slots + l->head * l->stride);
+            bool empty = !l->count || slot->state != _AOS_WS_CLIENT_SLOT_READY;
+            bool throttled = !empty && (ctx->rate_queue_count || !_aos_ws_client_rate_fits(task, slot->data_len));
+            if (!empty && !throttled)
+            {
+                data_len = slot->data_len;
+                opcode = slot->binary ? WS_TRANSPORT_OPCODES_BINARY : WS_TRANSPORT_OPCODES_TEXT;
+                slot->state = _AOS_WS_CLIENT_SLOT_READING;
+            }
+            portEXIT_CRITICAL(&ctx->lock);
+            if (!empty && !throttled)
+            {
+                memcpy(ctx->lane_tx, slot->data, data_len);
+                portENTER_CRITICAL(&ctx->lock);
+                slot->state = _AOS_WS_CLIENT_SLOT_READY;
+                l->head = (l->head + 1) % ctx->config.lanes[lane].depth;
+                l->count--;
+                portEXIT_CRITICAL(&ctx->lock);
+            }
+            if (throttled)
+            {
+                // Lower lanes wait as well, the time until the next lane write counts as throttle delay
+                if (!ctx->rate_blocked_since)
+                {
+                    ctx->rate_blocked_since = esp_timer_get_time();
+                    ctx->rate_held++;
+                }
+                return;
+            }
+            if (empty)
+            {
+                break;
+            }
+            _aos_ws_client_rate_consume(task, data_len);
+            if (ctx->rate_blocked_since)
+            {
+                ctx->rate_delay_us += esp_timer_get_time() - ctx->rate_blocked_since;
+                ctx->rate_blocked_since = 0;
+            }
+
+            _AOS_WS_CLIENT_TRACE(ctx, AOS_WS_CLIENT_TRACE_WRITE_START, opcode, data_len);
+            _AOS_WS_CLIENT_PROFILE_START(send_stamp);
+            int err = esp_transport_ws_send_raw(ctx->transport, opcode | WS_TRANSPORT_OPCODES_FIN, ctx->lane_tx, data_len, ctx->config.send_timeout_ms);
+            _AOS_WS_CLIENT_PROFILE_END(ctx, AOS_WS_CLIENT_STAGE_SEND, send_stamp);
+            _AOS_WS_CLIENT_TRACE(ctx, AOS_WS_CLIENT_TRACE_WRITE_END, opcode, err < 0 ? 0 : data_len);
+            if (err < 0)
+            {
+                ESP_LOGW(_tag, "Could not send queued data (errno:%d)", esp_transport_get_errno(ctx->transport));
+                _aos_ws_client_onerror(task);
+                return;
+            }
+            portENTER_CRITICAL(&ctx->lock);
+            l->stats.sent++;
+            portEXIT_CRITICAL(&ctx->lock);
+        }
+    }
+}
+
+static void _aos_ws_client_tx_drain(aos_task_t *task)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    for (uint32_t n = ctx->config.tx_frames; n && ctx->state == CONNECTED; n--)
+    {
+        // Frames are written in the order they were begun, a frame still being encoded holds back the ones after it
+        portENTER_CRITICAL(&ctx->lock);
+        _aos_ws_client_tx_frame_t frame = ctx->tx_count ? ctx->tx_frames[ctx->tx_head] : (_aos_ws_client_tx_frame_t){.state = _AOS_WS_CLIENT_TX_ENCODING};
+        bool throttled = frame.state == _AOS_WS_CLIENT_TX_READY && (ctx->rate_queue_count || !_aos_ws_client_rate_fits(task, frame.len));
+        uint32_t head = ctx->tx_head;
+        portEXIT_CRITICAL(&ctx->lock);
+        if (frame.state == _AOS_WS_CLIENT_TX_ENCODING)
+        {
+            break;
+        }
+        if (throttled)
+        {
+            if (!ctx->rate_blocked_since)
+            {
+                ctx->rate_blocked_since = esp_timer_get_time();
+                ctx->rate_held++;
+            }
+            return;
+        }
+
+        int err = 0;
+        if (frame.state == _AOS_WS_CLIENT_TX_READY)
+        {
+            _aos_ws_client_rate_consume(task, frame.len);
+            if (ctx->rate_blocked_since)
+            {
+                ctx->rate_delay_us += esp_timer_get_time() - ctx->rate_blocked_since;
+                ctx->rate_blocked_since = 0;
+            }
+
+            // Header and masked payload are already in place, written as they are
+            const uint8_t *data = ctx->tx_staging + head * ctx->tx_stride + _AOS_WS_CLIENT_TX_HEADER_MAX - frame.header_len;
+            _AOS_WS_CLIENT_TRACE(ctx, AOS_WS_CLIENT_TRACE_WRITE_START, WS_TRANSPORT_OPCODES_BINARY, frame.len);
+            _AOS_WS_CLIENT_PROFILE_START(send_stamp);
+            err = _aos_ws_client_tx_write(ctx, data, frame.header_len + frame.len);
+            _AOS_WS_CLIENT_PROFILE_END(ctx, AOS_WS_CLIENT_STAGE_SEND, send_stamp);
+            _AOS_WS_CLIENT_TRACE(ctx, AOS_WS_CLIENT_TRACE_WRITE_END, WS_TRANSPORT_OPCODES_BINARY, err < 0 ? 0 : frame.len);
+        }
+
+        portENTER_CRITICAL(&ctx->lock);
+        ctx->tx_frames[head].state = _AOS_WS_CLIENT_TX_FREE;
+        ctx->tx_head = (head + 1) % ctx->config.tx_frames;
+        ctx->tx_count--;
+        if (frame.state == _AOS_WS_CLIENT_TX_READY && err >= 0)
+        {
+            ctx->tx_encoded++;
+        }
+        portEXIT_CRITICAL(&ctx->lock);
+        if (err < 0)
+        {
+            ESP_LOGW(_tag, "Could not send encoded data (errno:%d)", esp_transport_get_errno(ctx->parent_transport));
+            _aos_ws_client_onerror(task);
+            return;
+        }
+    }
+}
+
+static int _aos_ws_client_tx_write(_aos_ws_client_ctx_t *ctx, const uint8_t *data, size_t data_len)
+{
+    // Bypass the websocket transport, which would write header and payload separately
+    while (data_len)
+    {
+        int len = esp_transport_write(ctx->parent_transport, (const char *)data, data_len, ctx->config.send_timeout_ms);
+        if (len <= 0)
+        {
+            return -1;
+        }
+        data += len;
+        data_len -= len;
+    }
+    return 0;
+}
+
+static void _aos_ws_client_encode_tagged(aos_ws_client_encoder_t *encoder, uint8_t tag, uint64_t value, size_t value_len)
+{
+    uint8_t *dst = aos_ws_client_encode_reserve(encoder, 1 + value_len);
+    if (!dst)
+    {
+        return;
+    }
+    dst[0] = tag;
+    for (size_t i = 0; i < value_len; i++)
+        dst[1 + i] = value >> (8 * (value_len - 1 - i));
+}
+
+static void _aos_ws_client_cbor_head(aos_ws_client_encoder_t *encoder, uint8_t major, uint64_t value)
+{
+    major <<= 5;
+    if (value < 24)
+        _aos_ws_client_encode_tagged(encoder, major | value, 0, 0);
+    else if (value <= UINT8_MAX)
+        _aos_ws_client_encode_tagged(encoder, major | 24, value, 1);
+    else if (value <= UINT16_MAX)
+        _aos_ws_client_encode_tagged(encoder, major | 25, value, 2);
+    else if (value <= UINT32_MAX)
+        _aos_ws_client_encode_tagged(encoder, major | 26, value, 4);
+    else
+        _aos_ws_client_encode_tagged(encoder, major | 27, value, 8);
+}
+
+static uint8_t _aos_ws_client_session_send(aos_task_t *task, bool binary, const void *data, size_t data_len)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    if (ctx->state != CONNECTED && ctx->state != RECONNECTING)
+    {
+        return 1;
+    }
+    if (data_len > ctx->config.session_slot_size || ctx->session_count == ctx->config.session_window)
+    {
+        ESP_LOGW(_tag, "Could not keep message for replay (data_len:%u unacked:%u)", data_len, ctx->session_count);
+        return 1;
+    }
+
+    // Once kept, the message is as good as sent: a write failure only delays it until the session resumes
+    uint32_t slot = (ctx->session_head + ctx->session_count) % ctx->config.session_window;
+    uint8_t *message = ctx->session_slots + slot * ctx->session_stride;
+    uint32_t seq = ++ctx->session_tx_seq;
+    message[0] = _AOS_WS_CLIENT_SESSION_DATA | (binary ? 0 : _AOS_WS_CLIENT_SESSION_TEXT);
+    message[1] = seq >> 24;
+    message[2] = seq >> 16;
+    message[3] = seq >> 8;
+    message[4] = seq;
+    memcpy(message + _AOS_WS_CLIENT_SESSION_HEADER, data, data_len);
+    ctx->session_lens[slot] = _AOS_WS_CLIENT_SESSION_HEADER + data_len;
+    ctx->session_count++;
+    if (ctx->state == CONNECTED && !ctx->session_resuming && _aos_ws_client_session_write(task, message, ctx->session_lens[slot]) < 0)
+    {
+        ESP_LOGW(_tag, "Could not send session data, kept for replay (errno:%d)", esp_transport_get_errno(ctx->transport));
+        _aos_ws_client_onerror(task);
+    }
+    return 0;
+}
+
+static int _aos_ws_client_session_write(aos_task_t *task, const uint8_t *data, size_t data_len)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    _AOS_WS_CLIENT_TRACE(ctx, AOS_WS_CLIENT_TRACE_WRITE_START, WS_TRANSPORT_OPCODES_BINARY, data_len);
+    _AOS_WS_CLIENT_PROFILE_START(send_stamp);
+    int err = esp_transport_ws_send_raw(ctx->transport, WS_TRANSPORT_OPCODES_BINARY | WS_TRANSPORT_OPCODES_FIN, (const char *)data, data_len, ctx->config.send_timeout_ms);
+    _AOS_WS_CLIENT_PROFILE_END(ctx, AOS_WS_CLIENT_STAGE_SEND, send_stamp);
+    _AOS_WS_CLIENT_TRACE(ctx, AOS_WS_CLIENT_TRACE_WRITE_END, WS_TRANSPORT_OPCODES_BINARY, err < 0 ? 0 : data_len);
+    return err;
+}
+
+static bool _aos_ws_client_session_receive(aos_task_t *task, bool new_frame, char **data, uint32_t *data_len)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    bool last = !ctx->rx_remaining && ctx->rx_fin;
+    if (new_frame)
+    {
+        ctx->session_rx_header = false;
+    }
+
+    // Session messages are binary, the header is at the start of the first frame
+    if (!new_frame || ctx->rx_opcode == WS_TRANSPORT_OPCODES_CONT)
+    {
+        bool skip = ctx->session_rx_skip;
+        if (last)
+            ctx->session_rx_skip = false;
+        return !skip;
+    }
+    if (ctx->rx_opcode != WS_TRANSPORT_OPCODES_BINARY)
+    {
+        return true;
+    }
+
+    const uint8_t *header = (const uint8_t *)*data;
+    if (*data_len < _AOS_WS_CLIENT_SESSION_HEADER)
+    {
+        ESP_LOGW(_tag, "Invalid session message (data_len:%u)", *data_len);
+        ctx->session_rx_skip = !last;
+        return false;
+    }
+    uint32_t seq = (uint32_t)header[1] << 24 | (uint32_t)header[2] << 16 | (uint32_t)header[3] << 8 | header[4];
+    switch (header[0] & ~_AOS_WS_CLIENT_SESSION_TEXT)
+    {
+    case _AOS_WS_CLIENT_SESSION_DATA:
+    {
+        // Replayed by the server after a resume, but already delivered
+        if ((int32_t)(seq - ctx->session_rx_seq) <= 0)
+        {
+            ctx->session_duplicates++;
+            ctx->session_rx_skip = !last;
+            return false;
+        }
+        ctx->session_rx_seq = seq;
+        ctx->session_rx_header = true;
+        ctx->rx_opcode = header[0] & _AOS_WS_CLIENT_SESSION_TEXT ? WS_TRANSPORT_OPCODES_TEXT : WS_TRANSPORT_OPCODES_BINARY;
+        *data += _AOS_WS_CLIENT_SESSION_HEADER;
+        *data_len -= _AOS_WS_CLIENT_SESSION_HEADER;
+        return true;
+    }
+    case _AOS_WS_CLIENT_SESSION_ACK:
+    {
+        _aos_ws_client_session_release(ctx, seq);
+        break;
+    }
+    case _AOS_WS_CLIENT_SESSION_RESUME:
+    {
+        // A server without our session starts over, a new connection was not a resume either
+        if (*data_len > _AOS_WS_CLIENT_SESSION_HEADER && header[5] & _AOS_WS_CLIENT_SESSION_NEW)
+        {
+            ctx->session_rx_seq = 0;
+            ctx->session_acked_rx_seq = 0;
+        }
+        _aos_ws_client_session_release(ctx, seq);
+        ctx->session_resuming = false;
+        for (uint32_t i = 0; i < ctx->session_count && ctx->state == CONNECTED; i++)
+        {
+            uint32_t slot = (ctx->session_head + i) % ctx->config.session_window;
+            if (_aos_ws_client_session_write(task, ctx->session_slots + slot * ctx->session_stride, ctx->session_lens[slot]) < 0)
+            {
+                ESP_LOGW(_tag, "Could not replay session data (errno:%d)", esp_transport_get_errno(ctx->transport));
+                _aos_ws_client_onerror(task);
+                break;
+            }
+            ctx->session_replayed++;
+        }
+        break;
+    }
+    default:
+    {
+        ESP_LOGW(_tag, "Unknown session message (type:%02x)", header[0]);
+        break;
+    }
+    }
+    ctx->session_rx_skip = !last;
+    return false;
+}
+
+static void _aos_ws_client_session_poll(aos_task_t *task)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    if (!ctx->session_slots)
+    {
+        return;
+    }
+
+    // Either tell the server where to resume from, or acknowledge what was received in the previous polls
+    uint8_t message[_AOS_WS_CLIENT_SESSION_HEADER + sizeof(ctx->session_id)];
+    size_t message_len = _AOS_WS_CLIENT_SESSION_HEADER;
+    if (ctx->session_resume)
+    {
+        message[0] = _AOS_WS_CLIENT_SESSION_RESUME;
+        memcpy(message + _AOS_WS_CLIENT_SESSION_HEADER, ctx->session_id, sizeof(ctx->session_id));
+        message_len += sizeof(ctx->session_id);
+    }
+    else if (ctx->session_rx_seq != ctx->session_acked_rx_seq)
+    {
+        message[0] = _AOS_WS_CLIENT_SESSION_ACK;
+    }
+    else
+    {
+        return;
+    }
+    uint32_t seq = ctx->session_rx_seq;
+    message[1] = seq >> 24;
+    message[2] = seq >> 16;
+    message[3] = seq >> 8;
+    message[4] = seq;
+    if (_aos_ws_client_session_write(task, message, message_len) < 0)
+    {
+        ESP_LOGW(_tag, "Could not send session control (errno:%d)", esp_transport_get_errno(ctx->transport));
+        _aos_ws_client_onerror(task);
+        return;
+    }
+    ctx->session_resume = false;
+    ctx->session_acked_rx_seq = seq;
+}
+
+static void _aos_ws_client_session_release(_aos_ws_client_ctx_t *ctx, uint32_t seq)
+{
+    // Sequence numbers of kept messages are consecutive, up to session_tx_seq
+    uint32_t oldest = ctx->session_tx_seq - ctx->session_count + 1;
+    if ((int32_t)(seq - oldest) < 0)
+    {
+        return;
+    }
+    uint32_t released = seq - oldest + 1 < ctx->session_count ? seq - oldest + 1 : ctx->session_count;
+    ctx->session_head = (ctx->session_head + released) % ctx->config.session_window;
+    ctx->session_count -= released;
+}
+
+static void _aos_ws_client_endpoint_update(aos_task_t *task, uint32_t index, bool connected, int64_t handshake_us)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    _aos_ws_client_endpoint_t *endpoint = &ctx->endpoints[index];
+    if (connected)
+    {
+        // Smoothed like TCP's SRTT, so that a single slow handshake does not reorder endpoints
+        uint32_t rtt_us = handshake_us < UINT32_MAX ? handshake_us : UINT32_MAX;
+        endpoint->stats.rtt_us = endpoint->stats.rtt_us ? endpoint->stats.rtt_us - endpoint->stats.rtt_us / 8 + rtt_us / 8 : rtt_us;
+        endpoint->stats.connections++;
+        endpoint->stats.streak = 0;
+        endpoint->stats.down = false;
+        if (index == ctx->endpoint)
+        {
+            ctx->endpoint_recheck_stamp = esp_timer_get_time();
+        }
+        return;
+    }
+
+    endpoint->stats.failures++;
+    endpoint->stats.streak++;
+    // A standby failing on the endpoint of the current connection does not make it down
+    if (ctx->endpoints_len > 1 && endpoint->stats.streak >= ctx->config.endpoint_failures && !(index == ctx->endpoint && ctx->state == CONNECTED))
+    {
+        endpoint->stats.down = true;
+        endpoint->down_stamp = esp_timer_get_time();
+        if (index == ctx->endpoint)
+        {
+            uint32_t next = _aos_ws_client_endpoint_rank(ctx);
+            ESP_LOGW(_tag, "Endpoint down, switching (endpoint:%u failures:%u next:%u)", ctx->endpoint, endpoint->stats.streak, next);
+            _aos_ws_client_endpoint_switch(ctx, next);
+        }
+    }
+}
+
+static uint32_t _aos_ws_client_endpoint_rank(_aos_ws_client_ctx_t *ctx)
+{
+    // Best reachable endpoint, or the one down for the longest time if none is
+    uint32_t best = ctx->endpoint;
+    for (uint32_t i = 0; i < ctx->endpoints_len; i++)
+    {
+        const _aos_ws_client_endpoint_t *endpoint = &ctx->endpoints[i];
+        const _aos_ws_client_endpoint_t *current = &ctx->endpoints[best];
+        if (current->stats.down != endpoint->stats.down)
+        {
+            best = current->stats.down ? i : best;
+        }
+        else if (endpoint->stats.down)
+        {
+            best = endpoint->down_stamp < current->down_stamp ? i : best;
+        }
+        else if (endpoint->stats.rtt_us < current->stats.rtt_us || (endpoint->stats.rtt_us == current->stats.rtt_us && i < best))
+        {
+            best = i;
+        }
+    }
+    return best;
+}
+
+static bool _aos_ws_client_endpoint_better(_aos_ws_client_ctx_t *ctx, uint32_t endpoint)
+{
+    // Leave some margin, handshake times are noisy
+    const aos_ws_client_endpoint_stats_t *stats = &ctx->endpoints[endpoint].stats;
+    const aos_ws_client_endpoint_stats_t *current = &ctx->endpoints[ctx->endpoint].stats;
+    return endpoint != ctx->endpoint && !stats->down && (!stats->rtt_us || (uint64_t)stats->rtt_us * 4 < (uint64_t)current->rtt_us * 3);
+}
+
+static void _aos_ws_client_endpoint_switch(_aos_ws_client_ctx_t *ctx, uint32_t endpoint)
+{
+    if (endpoint != ctx->endpoint)
+    {
+        ctx->endpoint = endpoint;
+        ctx->endpoint_switches++;
+    }
+}
+
+static void _aos_ws_client_endpoint_recheck(aos_task_t *task)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    if (ctx->endpoints_len < 2 || ctx->state != CONNECTED || ctx->worker_job != _AOS_WS_CLIENT_WORKER_IDLE || esp_timer_get_time() - ctx->endpoint_recheck_stamp < (int64_t)ctx->config.endpoint_recheck_ms * 1000)
+    {
+        return;
+    }
+    ctx->endpoint_recheck_stamp = esp_timer_get_time();
+
+    // Down endpoints are probed from the helper task, the ranking is revisited once it is done
+    uint32_t down = 0;
+    for (uint32_t i = 0; i < ctx->endpoints_len; i++)
+    {
+        down |= ctx->endpoints[i].stats.down ? 1U << i : 0;
+    }
+    if (down)
+    {
+        ctx->worker_reachable = down;
+        _aos_ws_client_worker_start(ctx, _AOS_WS_CLIENT_WORKER_PROBE);
+        return;
+    }
+    _aos_ws_client_endpoint_reconsider(task);
+}
+
+static void _aos_ws_client_endpoint_reconsider(aos_task_t *task)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    uint32_t best = _aos_ws_client_endpoint_rank(ctx);
+    if (ctx->state != CONNECTED || !_aos_ws_client_endpoint_better(ctx, best))
+    {
+        return;
+    }
+
+    // Through the standby, moved over to the better endpoint first
+    if (ctx->config.standby && ctx->standby_ready && ctx->standby_endpoint == best)
+    {
+        _aos_ws_client_standby_move(task);
+    }
+    else if (ctx->config.standby && ctx->standby_ready)
+    {
+        _aos_ws_client_standby_drop(ctx);
+        ctx->standby_due = esp_timer_get_time();
+    }
+    // Or through a connection built for the occasion, the current one is kept until it is up
+    else if (!ctx->config.standby && (ctx->standby_transport || _aos_ws_client_transport_alloc(ctx, &ctx->standby_parent_transport, &ctx->standby_transport)))
+    {
+        ESP_LOGI(_tag, "Connecting to a better endpoint (endpoint:%u rtt_us:%u next:%u rtt_us:%u)", ctx->endpoint, ctx->endpoints[ctx->endpoint].stats.rtt_us, best, ctx->endpoints[best].stats.rtt_us);
+        ctx->worker_endpoint = best;
+        ctx->worker_switch = true;
+        _aos_ws_client_worker_start(ctx, _AOS_WS_CLIENT_WORKER_CONNECT);
+    }
+}
+
+static bool _aos_ws_client_worker_start(_aos_ws_client_ctx_t *ctx, _aos_ws_client_worker_job_t job)
+{
+    ctx->worker_job = job;
+    ctx->worker_done = false;
+    TaskHandle_t worker = NULL;
+    if (xTaskCreate(_aos_ws_client_worker, "aos_ws_worker", ctx->config.stacksize, ctx, ctx->config.priority, &worker) != pdPASS)
+    {
+        ESP_LOGW(_tag, "Could not start helper task");
+        ctx->worker_job = _AOS_WS_CLIENT_WORKER_IDLE;
+        ctx->worker_switch = false;
+        return false;
+    }
+    return true;
+}
+
+static void _aos_ws_client_worker(void *args)
+{
+    // Only touches the standby transports and the worker fields until done, the client task leaves them alone
+    _aos_ws_client_ctx_t *ctx = args;
+    int64_t stamp = esp_timer_get_time();
+    if (ctx->worker_job == _AOS_WS_CLIENT_WORKER_PROBE)
+    {
+        // A plain TCP connection tells whether a down endpoint is back, without the memory cost of a handshake
+        for (uint32_t i = 0; i < ctx->endpoints_len; i++)
+        {
+            if (!(ctx->worker_reachable & 1U << i))
+            {
+                continue;
+            }
+            esp_transport_handle_t probe = esp_transport_tcp_init();
+            if (probe && esp_transport_connect(probe, ctx->endpoints[i].host, ctx->endpoints[i].port, ctx->config.send_timeout_ms) >= 0)
+            {
+                esp_transport_close(probe);
+            }
+            else
+            {
+                ctx->worker_reachable &= ~(1U << i);
+            }
+            esp_transport_destroy(probe);
+        }
+    }
+    else
+    {
+        ctx->worker_err = _aos_ws_client_transport_connect(ctx, ctx->standby_parent_transport, ctx->standby_transport, ctx->worker_endpoint);
+    }
+    ctx->worker_us = esp_timer_get_time() - stamp;
+
+    portENTER_CRITICAL(&ctx->lock);
+    ctx->worker_done = true;
+    portEXIT_CRITICAL(&ctx->lock);
+    vTaskDelete(NULL);
+}
+
+static void _aos_ws_client_worker_poll(aos_task_t *task)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    portENTER_CRITICAL(&ctx->lock);
+    bool done = ctx->worker_job != _AOS_WS_CLIENT_WORKER_IDLE && ctx->worker_done;
+    portEXIT_CRITICAL(&ctx->lock);
+    if (!done)
+    {
+        return;
+    }
+    _aos_ws_client_worker_job_t job = ctx->worker_job;
+    bool worker_switch = ctx->worker_switch;
+    ctx->worker_job = _AOS_WS_CLIENT_WORKER_IDLE;
+    ctx->worker_switch = false;
+
+    if (job == _AOS_WS_CLIENT_WORKER_PROBE)
+    {
+        for (uint32_t i = 0; i < ctx->endpoints_len; i++)
+        {
+            if (ctx->worker_reachable & 1U << i)
+            {
+                ESP_LOGI(_tag, "Endpoint reachable again (endpoint:%u)", i);
+                ctx->endpoints[i].stats.down = false;
+                ctx->endpoints[i].stats.streak = 0;
+            }
+        }
+        _aos_ws_client_endpoint_reconsider(task);
+        return;
+    }
+
+    uint32_t endpoint = ctx->worker_endpoint;
+    int64_t now = esp_timer_get_time();
+    _aos_ws_client_endpoint_update(task, endpoint, ctx->worker_err >= 0, ctx->worker_us);
+    if (ctx->worker_err < 0)
+    {
+        ESP_LOGW(_tag, "Could not connect %s (endpoint:%u errno:%d)", worker_switch ? "to the better endpoint" : "standby", endpoint, esp_transport_get_errno(ctx->standby_transport));
+        esp_transport_close(ctx->standby_transport);
+        ctx->standby_due = now + (int64_t)ctx->config.retry_interval_ms * 1000;
+        return;
+    }
+    if (ctx->state != CONNECTED)
+    {
+        esp_transport_close(ctx->standby_transport);
+        return;
+    }
+
+    ctx->standby_ready = true;
+    ctx->standby_endpoint = endpoint;
+    if (worker_switch)
+    {
+        _aos_ws_client_standby_move(task);
+        return;
+    }
+    ESP_LOGI(_tag, "Standby connected (endpoint:%u)", endpoint);
+    ctx->standby_ping_stamp = now;
+    ctx->standby_pong_stamp = now;
+    ctx->standby_builds++;
+}
+
+static void _aos_ws_client_worker_wait(_aos_ws_client_ctx_t *ctx)
+{
+    // For as long as the job in progress takes, like a connection attempt on the client task would
+    while (ctx->worker_job != _AOS_WS_CLIENT_WORKER_IDLE)
+    {
+        portENTER_CRITICAL(&ctx->lock);
+        bool done = ctx->worker_done;
+        portEXIT_CRITICAL(&ctx->lock);
+        if (done)
+        {
+            break;
+        }
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+
+    // What it brings is of no use anymore
+    if (ctx->worker_job == _AOS_WS_CLIENT_WORKER_CONNECT && ctx->worker_err >= 0)
+    {
+        esp_transport_close(ctx->standby_transport);
+    }
+    ctx->worker_job = _AOS_WS_CLIENT_WORKER_IDLE;
+    ctx->worker_switch = false;
+}
+
+static void _aos_ws_client_standby_poll(aos_task_t *task)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    if (!ctx->config.standby || ctx->state != CONNECTED)
+    {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    if (!ctx->standby_ready)
+    {
+        if (now >= ctx->standby_due && ctx->worker_job == _AOS_WS_CLIENT_WORKER_IDLE)
+        {
+            _aos_ws_client_standby_build(task);
+        }
+        return;
+    }
+
+    // Nothing is expected on the standby but control frames, drain them without waiting
+    char data[128];
+    for (int i = 0; i < 4 && esp_transport_poll_read(ctx->standby_transport, 0) > 0; i++)
+    {
+        int len = esp_transport_read(ctx->standby_transport, data, sizeof(data), 0);
+        ws_transport_opcodes_t opcode = esp_transport_ws_get_read_opcode(ctx->standby_transport);
+        if (len < 0 || opcode == WS_TRANSPORT_OPCODES_CLOSE)
+        {
+            ESP_LOGW(_tag, "Standby lost (endpoint:%u)", ctx->standby_endpoint);
+            _aos_ws_client_standby_drop(ctx);
+            return;
+        }
+        if (opcode == WS_TRANSPORT_OPCODES_PONG)
+        {
+            ctx->standby_pong_stamp = now;
+        }
+        else if (opcode == WS_TRANSPORT_OPCODES_PING && esp_transport_ws_send_raw(ctx->standby_transport, WS_TRANSPORT_OPCODES_PONG | WS_TRANSPORT_OPCODES_FIN, data, len, ctx->config.send_timeout_ms) < 0)
+        {
+            _aos_ws_client_standby_drop(ctx);
+            return;
+        }
+    }
+
+    // An empty PING now and then keeps middleboxes from dropping the idle connection
+    int64_t ping_us = (int64_t)ctx->config.standby_ping_ms * 1000;
+    if (now - ctx->standby_ping_stamp < ping_us)
+    {
+        return;
+    }
+    if (now - ctx->standby_pong_stamp > 2 * ping_us)
+    {
+        ESP_LOGW(_tag, "Standby not answering, rebuilding (endpoint:%u)", ctx->standby_endpoint);
+        _aos_ws_client_standby_drop(ctx);
+        return;
+    }
+    ctx->standby_ping_stamp = now;
+    if (esp_transport_ws_send_raw(ctx->standby_transport, WS_TRANSPORT_OPCODES_PING | WS_TRANSPORT_OPCODES_FIN, NULL, 0, ctx->config.send_timeout_ms) < 0)
+    {
+        ESP_LOGW(_tag, "Standby lost (endpoint:%u)", ctx->standby_endpoint);
+        _aos_ws_client_standby_drop(ctx);
+    }
+}
+
+static void _aos_ws_client_standby_build(aos_task_t *task)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    if (!ctx->standby_transport && !_aos_ws_client_transport_alloc(ctx, &ctx->standby_parent_transport, &ctx->standby_transport))
+    {
+        ESP_LOGW(_tag, "Could not allocate standby");
+        ctx->standby_due = esp_timer_get_time() + (int64_t)ctx->config.retry_interval_ms * 1000;
+        return;
+    }
+
+    // The handshake runs on the helper task, the standby is picked up once it is done
+    ctx->worker_endpoint = _aos_ws_client_standby_endpoint(ctx);
+    if (!_aos_ws_client_worker_start(ctx, _AOS_WS_CLIENT_WORKER_CONNECT))
+    {
+        ctx->standby_due = esp_timer_get_time() + (int64_t)ctx->config.retry_interval_ms * 1000;
+    }
+}
+
+static uint32_t _aos_ws_client_standby_endpoint(_aos_ws_client_ctx_t *ctx)
+{
+    // Another endpoint survives a server going away, an untried one is given a chance first
+    uint32_t best = ctx->endpoint;
+    for (uint32_t i = 0; i < ctx->endpoints_len; i++)
+    {
+        const aos_ws_client_endpoint_stats_t *stats = &ctx->endpoints[i].stats;
+        if (i == ctx->endpoint || stats->down)
+        {
+            continue;
+        }
+        if (best == ctx->endpoint || stats->rtt_us < ctx->endpoints[best].stats.rtt_us)
+        {
+            best = i;
+        }
+    }
+    return best;
+}
+
+static bool _aos_ws_client_standby_promote(aos_task_t *task)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    if (!ctx->standby_ready || ctx->state != CONNECTED)
+    {
+        return false;
+    }
+    int64_t stamp = esp_timer_get_time();
+    ESP_LOGW(_tag, "Switching over to the standby (endpoint:%u next:%u)", ctx->endpoint, ctx->standby_endpoint);
+
+    // Fail what belongs to the old connection, then close it without waiting for the server
+    _aos_ws_client_state_set(task, RECONNECTING);
+    _aos_ws_client_disconnect(task);
+    esp_transport_ws_send_raw(ctx->transport, WS_TRANSPORT_OPCODES_CLOSE | WS_TRANSPORT_OPCODES_FIN, NULL, 0, 0);
+    esp_transport_close(ctx->transport);
+
+    esp_transport_handle_t parent_transport = ctx->parent_transport;
+    esp_transport_handle_t transport = ctx->transport;
+    ctx->parent_transport = ctx->standby_parent_transport;
+    ctx->transport = ctx->standby_transport;
+    ctx->standby_parent_transport = parent_transport;
+    ctx->standby_transport = transport;
+    ctx->standby_ready = false;
+    _aos_ws_client_endpoint_switch(ctx, ctx->standby_endpoint);
+    ctx->standby_failovers++;
+
+    ctx->config.event_handler(AOS_WS_CLIENT_EVENT_RECONNECTING, NULL);
+    _aos_ws_client_state_set(task, CONNECTED);
+    ctx->standby_failover_us = esp_timer_get_time() - stamp;
+    ctx->config.event_handler(AOS_WS_CLIENT_EVENT_RECONNECTED, NULL);
+    ctx->poll_loop = aos_task_loop_set(task, _aos_ws_client_poll_loop, 1);
+    return true;
+}
+
+static void _aos_ws_client_standby_move(aos_task_t *task)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    ESP_LOGI(_tag, "Switching to a better endpoint (endpoint:%u next:%u)", ctx->endpoint, ctx->standby_endpoint);
+
+    // A planned switch: nothing failed, so no event is raised and held sends go out on the new connection.
+    // RPC responses would still come on the old one though, those requests fail so they can be sent again.
+    _aos_ws_client_rx_resume(task);
+    _aos_ws_client_batch_flush(task);
+    _aos_ws_client_rx_reset(task);
+    _aos_ws_client_rpc_fail_all(task, 3);
+    esp_transport_ws_send_raw(ctx->transport, WS_TRANSPORT_OPCODES_CLOSE | WS_TRANSPORT_OPCODES_FIN, NULL, 0, 0);
+    esp_transport_close(ctx->transport);
+
+    esp_transport_handle_t parent_transport = ctx->parent_transport;
+    esp_transport_handle_t transport = ctx->transport;
+    ctx->parent_transport = ctx->standby_parent_transport;
+    ctx->transport = ctx->standby_transport;
+    ctx->standby_parent_transport = parent_transport;
+    ctx->standby_transport = transport;
+    ctx->standby_ready = false;
+    _aos_ws_client_endpoint_switch(ctx, ctx->standby_endpoint);
+
+    // Sessions resume and the next standby is scheduled as on any new connection
+    _aos_ws_client_state_set(task, CONNECTED);
+}
+
+static void _aos_ws_client_standby_drop(_aos_ws_client_ctx_t *ctx)
+{
+    if (!ctx->standby_ready)
+    {
+        return;
+    }
+    esp_transport_close(ctx->standby_transport);
+    ctx->standby_ready = false;
+    ctx->standby_due = esp_timer_get_time() + (int64_t)ctx->config.retry_interval_ms * 1000;
+}
+
+static void _aos_ws_client_standby_free(_aos_ws_client_ctx_t *ctx)
+{
+    _aos_ws_client_standby_drop(ctx);
+    esp_transport_destroy(ctx->standby_transport);
+    esp_transport_destroy(ctx->standby_parent_transport);
+    ctx->standby_transport = NULL;
+    ctx->standby_parent_transport = NULL;
+}
+
+static bool _aos_ws_client_lowpower_poll(aos_task_t *task)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    if (!ctx->config.lowpower_window_ms || ctx->state != CONNECTED)
+    {
+        return false;
+    }
+    int64_t now = esp_timer_get_time();
+    if (!ctx->lowpower_awake_stamp)
+    {
+        // A wake window: one pass without waiting on reads, unless it brings traffic
+        _aos_ws_client_lowpower_wake(ctx, now);
+        ctx->lowpower_window = true;
+        aos_task_loop_unset(task, ctx->poll_loop);
+        ctx->poll_loop = aos_task_loop_set(task, _aos_ws_client_poll_loop, 1);
+        return false;
+    }
+
+    // Stay up while a response, a held send or the rest of a frame is expected
+    int64_t traffic = ctx->rx_stamp > ctx->lowpower_tx_stamp ? ctx->rx_stamp : ctx->lowpower_tx_stamp;
+    bool quiet = ctx->lowpower_window ? traffic < ctx->lowpower_awake_stamp : now - traffic >= (int64_t)ctx->config.lowpower_linger_ms * 1000;
+    bool expected = ctx->rpc_in_flight || ctx->rate_queue_count || ctx->rx_remaining || ctx->readahead_pos < ctx->readahead_len || ctx->session_resuming;
+    ctx->lowpower_window = false;
+    if (!quiet || expected)
+    {
+        return false;
+    }
+
+    // Windows fall on multiples of lowpower_window_ms, so that clients sharing the interval wake together
+    _aos_ws_client_lowpower_rest(ctx, now);
+    // In 64 bits: a 32-bit millisecond clock wraps after 49.7 days, which would shift the phase
+    uint32_t phase_ms = (uint32_t)(now / 1000 % ctx->config.lowpower_window_ms);
+    aos_task_loop_unset(task, ctx->poll_loop);
+    ctx->poll_loop = aos_task_loop_set(task, _aos_ws_client_poll_loop, ctx->config.lowpower_window_ms - phase_ms);
+    return true;
+}
+
+static void _aos_ws_client_lowpower_send(aos_task_t *task)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    if (!ctx->config.lowpower_window_ms || ctx->state != CONNECTED)
+    {
+        return;
+    }
+
+    // Direct sends are urgent: wake up now and linger for the response
+    int64_t now = esp_timer_get_time();
+    ctx->lowpower_tx_stamp = now;
+    ctx->lowpower_window = false;
+    if (!ctx->lowpower_awake_stamp)
+    {
+        _aos_ws_client_lowpower_wake(ctx, now);
+        aos_task_loop_unset(task, ctx->poll_loop);
+        ctx->poll_loop = aos_task_loop_set(task, _aos_ws_client_poll_loop, 1);
+    }
+}
+
+static void _aos_ws_client_lowpower_wake(_aos_ws_client_ctx_t *ctx, int64_t now)
+{
+    if (ctx->lowpower_awake_stamp)
+    {
+        return;
+    }
+    ctx->lowpower_awake_stamp = now;
+    ctx->lowpower_wakeups++;
+#if CONFIG_PM_ENABLE
+    if (ctx->lowpower_pm_lock)
+        esp_pm_lock_acquire(ctx->lowpower_pm_lock);
+#endif
+}
+
+static void _aos_ws_client_lowpower_rest(_aos_ws_client_ctx_t *ctx, int64_t now)
+{
+    if (!ctx->lowpower_awake_stamp)
+    {
+        return;
+    }
+    ctx->lowpower_active_us += now - ctx->lowpower_awake_stamp;
+    ctx->lowpower_awake_stamp = 0;
+#if CONFIG_PM_ENABLE
+    if (ctx->lowpower_pm_lock)
+        esp_pm_lock_release(ctx->lowpower_pm_lock);
+#endif
+}
+
+static void _aos_ws_client_rate_refill(aos_task_t *task)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    int64_t now = esp_timer_get_time();
+    int64_t elapsed_us = now - ctx->rate_stamp;
+    ctx->rate_stamp = now;
+
+    // Tokens are kept in millionths, so that refills are exact for any elapsed time
+    if (elapsed_us > 1000000000)
+    {
+        elapsed_us = 1000000000;
+    }
+    int64_t bytes_max = (int64_t)ctx->config.rate_burst_bytes * 1000000;
+    ctx->rate_bytes += elapsed_us * ctx->config.rate_bytes_per_s;
+    if (ctx->rate_bytes > bytes_max)
+    {
+        ctx->rate_bytes = bytes_max;
+    }
+    int64_t messages_max = (int64_t)ctx->config.rate_burst_messages * 1000000;
+    ctx->rate_messages += elapsed_us * ctx->config.rate_messages_per_s;
+    if (ctx->rate_messages > messages_max)
+    {
+        ctx->rate_messages = messages_max;
+    }
+}
+
+static bool _aos_ws_client_rate_fits(aos_task_t *task, size_t data_len)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    if (ctx->config.rate_bytes_per_s)
+    {
+        size_t needed = data_len < ctx->config.rate_burst_bytes ? data_len : ctx->config.rate_burst_bytes;
+        if (ctx->rate_bytes < (int64_t)needed * 1000000)
+        {
+            return false;
+        }
+    }
+    return !ctx->config.rate_messages_per_s || ctx->rate_messages >= 1000000;
+}
+
+static void _aos_ws_client_rate_consume(aos_task_t *task, size_t data_len)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    if (ctx->config.rate_bytes_per_s)
+    {
+        ctx->rate_bytes -= (int64_t)data_len * 1000000;
+    }
+    if (ctx->config.rate_messages_per_s)
+    {
+        ctx->rate_messages -= 1000000;
+    }
+}
+
+static bool _aos_ws_client_rate_hold(aos_task_t *task, uint32_t taskevt, aos_future_t *future, size_t data_len)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    if (!ctx->rate_queue || ctx->state != CONNECTED)
+    {
+        return false;
+    }
+
+    // Keep sends in order: nothing overtakes what is already held back
+    _aos_ws_client_rate_refill(task);
+    if (!ctx->rate_queue_count && _aos_ws_client_rate_fits(task, data_len))
+    {
+        _aos_ws_client_rate_consume(task, data_len);
+        return false;
+    }
+    if (ctx->rate_queue_count == ctx->config.rate_queue_size)
+    {
+        ESP_LOGW(_tag, "Rate limiter queue full (rate_queue_size:%u)", ctx->config.rate_queue_size);
+        _aos_ws_client_held_t held = {.future = future, .taskevt = taskevt};
+        _aos_ws_client_rate_fail(&held);
+        return true;
+    }
+    _aos_ws_client_held_t *held = &ctx->rate_queue[(ctx->rate_queue_head + ctx->rate_queue_count) % ctx->config.rate_queue_size];
+    held->future = future;
+    held->taskevt = taskevt;
+    held->since = esp_timer_get_time();
+    ctx->rate_queue_count++;
+    ctx->rate_held++;
+    return true;
+}
+
+static void _aos_ws_client_rate_release(aos_task_t *task)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    if (!ctx->rate_queue)
+    {
+        return;
+    }
+
+    // Also brings tokens up to date for lane writes
+    _aos_ws_client_rate_refill(task);
+    while (ctx->rate_queue_count && ctx->state == CONNECTED)
+    {
+        _aos_ws_client_held_t held = ctx->rate_queue[ctx->rate_queue_head];
+        size_t data_len = _aos_ws_client_rate_len(&held);
+        if (!_aos_ws_client_rate_fits(task, data_len))
+        {
+            break;
+        }
+        _aos_ws_client_rate_consume(task, data_len);
+        ctx->rate_queue_head = (ctx->rate_queue_head + 1) % ctx->config.rate_queue_size;
+        ctx->rate_queue_count--;
+        ctx->rate_delay_us += esp_timer_get_time() - held.since;
+        switch (held.taskevt)
+        {
+        case AOS_WS_CLIENT_TASKEVT_SEND_TEXT:
+            _aos_ws_client_write_text(task, held.future);
+            break;
+        case AOS_WS_CLIENT_TASKEVT_SEND_BINARY:
+            _aos_ws_client_write_binary(task, held.future);
+            break;
+        case AOS_WS_CLIENT_TASKEVT_RPC:
+            _aos_ws_client_write_rpc(task, held.future);
+            break;
+        }
+    }
+}
+
+static size_t _aos_ws_client_rate_len(_aos_ws_client_held_t *held)
+{
+    switch (held->taskevt)
+    {
+    case AOS_WS_CLIENT_TASKEVT_SEND_TEXT:
+        return strlen(((AOS_ARGS_T(aos_ws_client_send_text) *)aos_args_get(held->future))->in_data);
+    case AOS_WS_CLIENT_TASKEVT_SEND_BINARY:
+        return ((AOS_ARGS_T(aos_ws_client_send_binary) *)aos_args_get(held->future))->in_data_len;
+    case AOS_WS_CLIENT_TASKEVT_RPC:
+        return ((AOS_ARGS_T(aos_ws_client_rpc) *)aos_args_get(held->future))->in_data_len;
+    }
+    return 0;
+}
+
+static void _aos_ws_client_rate_fail(_aos_ws_client_held_t *held)
+{
+    switch (held->taskevt)
+    {
+    case AOS_WS_CLIENT_TASKEVT_SEND_TEXT:
+        ((AOS_ARGS_T(aos_ws_client_send_text) *)aos_args_get(held->future))->out_err = 1;
+        break;
+    case AOS_WS_CLIENT_TASKEVT_SEND_BINARY:
+        ((AOS_ARGS_T(aos_ws_client_send_binary) *)aos_args_get(held->future))->out_err = 1;
+        break;
+    case AOS_WS_CLIENT_TASKEVT_RPC:
+        ((AOS_ARGS_T(aos_ws_client_rpc) *)aos_args_get(held->future))->out_err = 1;
+        break;
+    }
+    aos_resolve(held->future);
+}
+
+static void _aos_ws_client_rate_fail_all(aos_task_t *task)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    while (ctx->rate_queue_count)
+    {
+        _aos_ws_client_held_t *held = &ctx->rate_queue[ctx->rate_queue_head];
+        ctx->rate_queue_head = (ctx->rate_queue_head + 1) % ctx->config.rate_queue_size;
+        ctx->rate_queue_count--;
+        ctx->rate_delay_us += esp_timer_get_time() - held->since;
+        _aos_ws_client_rate_fail(held);
+    }
+    if (ctx->rate_blocked_since)
+    {
+        ctx->rate_delay_us += esp_timer_get_time() - ctx->rate_blocked_since;
+        ctx->rate_blocked_since = 0;
+    }
+}
+
+static bool _aos_ws_client_rx_throttle(aos_task_t *task)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    if (!ctx->config.rx_backlog)
+    {
+        return false;
+    }
+
+    size_t backlog = ctx->config.rx_backlog();
+    if (!ctx->rx_paused)
+    {
+        if (backlog < ctx->config.rx_high_water)
+        {
+            return false;
+        }
+        ESP_LOGI(_tag, "Pausing reads (backlog:%u)", backlog);
+        ctx->rx_paused = true;
+        ctx->rx_paused_since = esp_timer_get_time();
+        ctx->rx_pauses++;
+        // No need to spin while paused, check back at the poll timeout pace
+        aos_task_loop_unset(task, ctx->poll_loop);
+        ctx->poll_loop = aos_task_loop_set(task, _aos_ws_client_poll_loop, ctx->config.poll_timeout_ms);
+        return true;
+    }
+    if (backlog > ctx->config.rx_low_water)
+    {
+        return true;
+    }
+    ESP_LOGI(_tag, "Resuming reads (backlog:%u)", backlog);
+    _aos_ws_client_rx_resume(task);
+    aos_task_loop_unset(task, ctx->poll_loop);
+    ctx->poll_loop = aos_task_loop_set(task, _aos_ws_client_poll_loop, 1);
+    return false;
+}
+
+static void _aos_ws_client_rx_resume(aos_task_t *task)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    if (!ctx->rx_paused)
+    {
+        return;
+    }
+    uint64_t paused_us = esp_timer_get_time() - ctx->rx_paused_since;
+    ctx->rx_paused = false;
+    ctx->rx_paused_us += paused_us;
+    if (paused_us > ctx->rx_paused_max_us)
+    {
+        ctx->rx_paused_max_us = paused_us;
+    }
+}
+
+static void _aos_ws_client_batch_add(aos_task_t *task, const char *data, uint32_t data_len)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    if (ctx->batch_len == ctx->config.batch_max_messages || ctx->batch_bytes + data_len > ctx->config.batch_max_bytes)
+    {
+        _aos_ws_client_batch_flush(task);
+    }
+    ctx->batch[ctx->batch_len++] = (aos_ws_client_message_t){
+        .data = data,
+        .data_len = data_len,
+        .opcode = ctx->rx_opcode,
+        .fin = ctx->rx_fin};
+    ctx->batch_bytes += data_len;
+}
+
+static void _aos_ws_client_batch_flush(aos_task_t *task)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    if (!ctx->batch_len)
+    {
+        return;
+    }
+    size_t batch_len = ctx->batch_len;
+    ctx->batch_len = 0;
+    ctx->batch_bytes = 0;
+    _AOS_WS_CLIENT_TRACE(ctx, AOS_WS_CLIENT_TRACE_DISPATCH, WS_TRANSPORT_OPCODES_NONE, batch_len);
+    _AOS_WS_CLIENT_PROFILE_START(callback_stamp);
+    ctx->config.on_data_batch(ctx->batch, batch_len);
+    _AOS_WS_CLIENT_PROFILE_END(ctx, AOS_WS_CLIENT_STAGE_CALLBACK, callback_stamp);
+}
+
+static uint32_t _aos_ws_client_rpc_now(void)
+{
+    return (uint32_t)(esp_timer_get_time() / 1000 / _AOS_WS_CLIENT_RPC_WHEEL_TICK_MS);
+}
+
+static uint32_t _aos_ws_client_rpc_hash(_aos_ws_client_ctx_t *ctx, uint64_t id)
+{
+    return (uint32_t)((id * 0x9E3779B97F4A7C15ULL) >> 32) & ctx->rpc_table_mask;
+}
+
+static uint32_t _aos_ws_client_rpc_find(_aos_ws_client_ctx_t *ctx, uint64_t id)
+{
+    for (uint32_t slot = _aos_ws_client_rpc_hash(ctx, id);; slot = (slot + 1) & ctx->rpc_table_mask)
+    {
+        if (ctx->rpc_table[slot] == _AOS_WS_CLIENT_RPC_NONE)
+            return _AOS_WS_CLIENT_RPC_NONE;
+        if (ctx->rpc_pool[ctx->rpc_table[slot]].id == id)
+            return slot;
+    }
+}
+
+static void _aos_ws_client_rpc_insert(_aos_ws_client_ctx_t *ctx, uint64_t id, aos_future_t *future, uint32_t timeout_ms)
+{
+    uint16_t index = ctx->rpc_free;
+    _aos_ws_client_rpc_t *rpc = &ctx->rpc_pool[index];
+    ctx->rpc_free = rpc->wheel_next;
+    ctx->rpc_in_flight++;
+    rpc->id = id;
+    rpc->future = future;
+    rpc->response_fill = 0;
+
+    uint32_t slot = _aos_ws_client_rpc_hash(ctx, id);
+    while (ctx->rpc_table[slot] != _AOS_WS_CLIENT_RPC_NONE)
+        slot = (slot + 1) & ctx->rpc_table_mask;
+    ctx->rpc_table[slot] = index;
+
+    // Round up, so that requests never expire early
+    rpc->deadline = _aos_ws_client_rpc_now() + (timeout_ms + _AOS_WS_CLIENT_RPC_WHEEL_TICK_MS - 1) / _AOS_WS_CLIENT_RPC_WHEEL_TICK_MS + 1;
+    uint16_t *head = &ctx->rpc_wheel[rpc->deadline % _AOS_WS_CLIENT_RPC_WHEEL_SLOTS];
+    rpc->wheel_prev = _AOS_WS_CLIENT_RPC_NONE;
+    rpc->wheel_next = *head;
+    if (*head != _AOS_WS_CLIENT_RPC_NONE)
+        ctx->rpc_pool[*head].wheel_prev = index;
+    *head = index;
+}
+
+static uint16_t _aos_ws_client_rpc_unlink(_aos_ws_client_ctx_t *ctx, uint32_t slot)
+{
+    uint16_t index = ctx->rpc_table[slot];
+    _aos_ws_client_rpc_t *rpc = &ctx->rpc_pool[index];
+
+    // Remove from its wheel slot
+    if (rpc->wheel_prev != _AOS_WS_CLIENT_RPC_NONE)
+        ctx->rpc_pool[rpc->wheel_prev].wheel_next = rpc->wheel_next;
+    else
+        ctx->rpc_wheel[rpc->deadline % _AOS_WS_CLIENT_RPC_WHEEL_SLOTS] = rpc->wheel_next;
+    if (rpc->wheel_next != _AOS_WS_CLIENT_RPC_NONE)
+        ctx->rpc_pool[rpc->wheel_next].wheel_prev = rpc->wheel_prev;
+
+    // Remove from the table, shifting back the entries of the same probe sequence
+    ctx->rpc_table[slot] = _AOS_WS_CLIENT_RPC_NONE;
+    for (uint32_t next = (slot + 1) & ctx->rpc_table_mask; ctx->rpc_table[next] != _AOS_WS_CLIENT_RPC_NONE; next = (next + 1) & ctx->rpc_table_mask)
+    {
+        uint32_t home = _aos_ws_client_rpc_hash(ctx, ctx->rpc_pool[ctx->rpc_table[next]].id);
+        if (((next - home) & ctx->rpc_table_mask) >= ((next - slot) & ctx->rpc_table_mask))
+        {
+            ctx->rpc_table[slot] = ctx->rpc_table[next];
+            ctx->rpc_table[next] = _AOS_WS_CLIENT_RPC_NONE;
+            slot = next;
+        }
+    }
+    return index;
+}
+
+static void _aos_ws_client_rpc_resolve(_aos_ws_client_ctx_t *ctx, uint16_t index, uint8_t err)
+{
+    _aos_ws_client_rpc_t *rpc = &ctx->rpc_pool[index];
+    AOS_ARGS_T(aos_ws_client_rpc) *args = aos_args_get(rpc->future);
+    args->out_err = err;
+    aos_resolve(rpc->future);
+    rpc->future = NULL;
+    rpc->wheel_next = ctx->rpc_free;
+    ctx->rpc_free = index;
+    ctx->rpc_in_flight--;
+}
+
+static bool _aos_ws_client_rpc_receive(aos_task_t *task, bool new_frame, const char *data, uint32_t data_len)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    uint16_t index = ctx->rpc_rx;
+    if (index == _AOS_WS_CLIENT_RPC_NONE)
+    {
+        // Only the head of a new frame can start a response
+        uint64_t id = 0;
+        if (!ctx->rpc_pool || !new_frame || ctx->rx_opcode == WS_TRANSPORT_OPCODES_CONT || data_len < ctx->config.rpc_id_offset + ctx->config.rpc_id_len)
+            return false;
+        memcpy(&id, data + ctx->config.rpc_id_offset, ctx->config.rpc_id_len);
+        uint32_t slot = _aos_ws_client_rpc_find(ctx, id);
+        if (slot == _AOS_WS_CLIENT_RPC_NONE)
+            return false;
+        index = _aos_ws_client_rpc_unlink(ctx, slot);
+    }
+
+    _aos_ws_client_rpc_t *rpc = &ctx->rpc_pool[index];
+    AOS_ARGS_T(aos_ws_client_rpc) *args = aos_args_get(rpc->future);
+    if (rpc->response_fill < args->in_response_size)
+    {
+        size_t copy_len = args->in_response_size - rpc->response_fill < data_len ? args->in_response_size - rpc->response_fill : data_len;
+        memcpy((char *)args->in_response + rpc->response_fill, data, copy_len);
+    }
+    rpc->response_fill += data_len;
+
+    // Responses longer than the receive buffer span several polls, fragmented ones several frames
+    bool complete = !ctx->rx_remaining && ctx->rx_fin;
+    ctx->rpc_rx = complete ? _AOS_WS_CLIENT_RPC_NONE : index;
+    if (complete)
+    {
+        _AOS_WS_CLIENT_TRACE(ctx, AOS_WS_CLIENT_TRACE_DISPATCH, ctx->rx_opcode, rpc->response_fill);
+        args->out_response_len = rpc->response_fill;
+        _aos_ws_client_rpc_resolve(ctx, index, 0);
+    }
+    return true;
+}
+
+static void _aos_ws_client_rpc_expire(aos_task_t *task)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    if (!ctx->rpc_pool)
+        return;
+
+    // Visit each wheel slot the clock went past, at most once per turn
+    uint32_t now = _aos_ws_client_rpc_now();
+    if (now - ctx->rpc_tick > _AOS_WS_CLIENT_RPC_WHEEL_SLOTS)
+        ctx->rpc_tick = now - _AOS_WS_CLIENT_RPC_WHEEL_SLOTS;
+    while (ctx->rpc_tick != now)
+    {
+        ctx->rpc_tick++;
+        uint16_t index = ctx->rpc_wheel[ctx->rpc_tick % _AOS_WS_CLIENT_RPC_WHEEL_SLOTS];
+        while (index != _AOS_WS_CLIENT_RPC_NONE)
+        {
+            _aos_ws_client_rpc_t *rpc = &ctx->rpc_pool[index];
+            uint16_t next = rpc->wheel_next;
+            if ((int32_t)(now - rpc->deadline) >= 0)
+            {
+                ESP_LOGW(_tag, "RPC request timed out");
+                _aos_ws_client_rpc_unlink(ctx, _aos_ws_client_rpc_find(ctx, rpc->id));
+                _aos_ws_client_rpc_resolve(ctx, index, 2);
+            }
+            index = next;
+        }
+    }
+}
+
+static void _aos_ws_client_rpc_fail_all(aos_task_t *task, uint8_t err)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    if (!ctx->rpc_pool)
+        return;
+
+    if (ctx->rpc_rx != _AOS_WS_CLIENT_RPC_NONE)
+    {
+        _aos_ws_client_rpc_resolve(ctx, ctx->rpc_rx, err);
+        ctx->rpc_rx = _AOS_WS_CLIENT_RPC_NONE;
     }
-    case WS_TRANSPORT_OPCODES_NONE:
+    for (uint32_t slot = 0; slot <= ctx->rpc_table_mask; slot++)
     {
-        break;
+        // Unlinking may shift another entry into this slot
+        while (ctx->rpc_table[slot] != _AOS_WS_CLIENT_RPC_NONE)
+            _aos_ws_client_rpc_resolve(ctx, _aos_ws_client_rpc_unlink(ctx, slot), err);
     }
-    default:
+}
+
+static uint32_t _aos_ws_client_route_hash(_aos_ws_client_ctx_t *ctx, const void *key)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < ctx->config.route_key_len; i++)
+        hash = (hash ^ ((const uint8_t *)key)[i]) * 16777619U;
+    return hash & ctx->route_table_mask;
+}
+
+static bool _aos_ws_client_route_receive(aos_task_t *task, bool new_frame, const char *data, uint32_t data_len)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    if (!ctx->route_table)
+        return false;
+
+    // The rest of a routed message follows its head, whether in the same frame or in continuation frames
+    ws_transport_opcodes_t opcode = ctx->rx_opcode;
+    if (new_frame && opcode != WS_TRANSPORT_OPCODES_CONT)
     {
-        // According to RFC6455 we should FAIL the websocket connection in this case
-        ESP_LOGW(_tag, "Unknown OPCODE (opcode:%d errno:%d)", opcode, esp_transport_get_errno(ctx->transport));
-        _aos_ws_client_onerror(task);
-    }
+        ctx->route_rx = _AOS_WS_CLIENT_ROUTE_NONE;
+        if (data_len >= ctx->config.route_key_offset + ctx->config.route_key_len)
+        {
+            const char *key = data + ctx->config.route_key_offset;
+            for (uint32_t slot = _aos_ws_client_route_hash(ctx, key); ctx->route_table[slot] != _AOS_WS_CLIENT_ROUTE_NONE; slot = (slot + 1) & ctx->route_table_mask)
+            {
+                if (!memcmp(ctx->config.routes[ctx->route_table[slot]].key, key, ctx->config.route_key_len))
+                {
+                    ctx->route_rx = ctx->route_table[slot];
+                    break;
+                }
+            }
+        }
     }
+    if (ctx->route_rx == _AOS_WS_CLIENT_ROUTE_NONE)
+        return false;
+
+    const aos_ws_client_route_t *route = &ctx->config.routes[ctx->route_rx];
+    if (!ctx->rx_remaining && ctx->rx_fin)
+        ctx->route_rx = _AOS_WS_CLIENT_ROUTE_NONE;
+    _AOS_WS_CLIENT_TRACE(ctx, AOS_WS_CLIENT_TRACE_DISPATCH, opcode, data_len);
+    _AOS_WS_CLIENT_PROFILE_START(callback_stamp);
+    route->on_data(data, data_len, route->user_ctx);
+    _AOS_WS_CLIENT_PROFILE_END(ctx, AOS_WS_CLIENT_STAGE_CALLBACK, callback_stamp);
+    return true;
 }
 
 static void _aos_ws_client_retry_loop(aos_task_t *task)
@@ -517,11 +3466,7 @@ static void _aos_ws_client_retry_loop(aos_task_t *task)
     ESP_LOGD(_tag, "%s", __FUNCTION__);
     _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
 
-    if (esp_transport_connect(
-            ctx->transport,
-            ctx->config.host,
-            ctx->config.port,
-            ctx->config.send_timeout_ms) < 0)
+    if (_aos_ws_client_connect(task) < 0)
     {
         ESP_LOGW(_tag, "Could not connect (errno:%d)", esp_transport_get_errno(ctx->transport));
         _aos_ws_client_onerror(task);
@@ -531,7 +3476,7 @@ static void _aos_ws_client_retry_loop(aos_task_t *task)
     ESP_LOGI(_tag, "Connected");
     aos_task_loop_unset(task, ctx->retry_loop);
     ctx->retry_loop = NULL;
-    ctx->state = CONNECTED;
+    _aos_ws_client_state_set(task, CONNECTED);
     if (ctx->reconnection_attempt)
     {
         ctx->reconnection_attempt = 0;
@@ -559,6 +3504,11 @@ static void _aos_ws_client_disconnect(aos_task_t *task)
     ctx->poll_loop = NULL;
     aos_task_loop_unset(task, ctx->retry_loop);
     ctx->retry_loop = NULL;
+    _aos_ws_client_rx_resume(task);
+    _aos_ws_client_batch_flush(task);
+    _aos_ws_client_rx_reset(task);
+    _aos_ws_client_rpc_fail_all(task, 1);
+    _aos_ws_client_rate_fail_all(task);
     switch (ctx->state)
     {
     case DISCONNECTED:
@@ -583,6 +3533,12 @@ static void _aos_ws_client_onerror(aos_task_t *task)
     ESP_LOGD(_tag, "%s", __FUNCTION__);
     _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
 
+    // Switch over to the standby if there is one, there is nothing to restore then
+    if (_aos_ws_client_standby_promote(task))
+    {
+        return;
+    }
+
     // Set a clean slate first
     _aos_ws_client_disconnect(task);
 
@@ -595,7 +3551,7 @@ static void _aos_ws_client_onerror(aos_task_t *task)
             // Yes, do not try anymore, resolve connect future
             ESP_LOGE(_tag, "Maximum connection attempts reached, giving up (attempts:%u)", ctx->config.connection_attempts);
             _aos_ws_client_disconnect(task);
-            ctx->state = DISCONNECTED;
+            _aos_ws_client_state_set(task, DISCONNECTED);
             AOS_ARGS_T(aos_ws_client_connect) *connect_args = aos_args_get(ctx->connect_future);
             connect_args->out_err = 1;
             aos_resolve(ctx->connect_future);
@@ -606,12 +3562,12 @@ static void _aos_ws_client_onerror(aos_task_t *task)
         ctx->connection_attempt++;
         ESP_LOGI(_tag, "New connection attempt in %ums (attempt:%u)", ctx->config.retry_interval_ms, ctx->connection_attempt);
         ctx->retry_loop = aos_task_loop_set(task, _aos_ws_client_retry_loop, ctx->config.retry_interval_ms);
-        ctx->state = CONNECTING;
+        _aos_ws_client_state_set(task, CONNECTING);
         return;
     }
 
     // We should try to restore the connection
-    ctx->state = RECONNECTING;
+    _aos_ws_client_state_set(task, RECONNECTING);
     if (!ctx->reconnection_attempt)
     {
         ctx->config.event_handler(AOS_WS_CLIENT_EVENT_RECONNECTING, NULL);
@@ -621,7 +3577,7 @@ static void _aos_ws_client_onerror(aos_task_t *task)
     {
         // Yes, do not try anymore and raise disconnected event
         ESP_LOGE(_tag, "Maximum reconnection attempts reached, giving up (attempts:%u)", ctx->config.reconnection_attempts);
-        ctx->state = DISCONNECTED;
+        _aos_ws_client_state_set(task, DISCONNECTED);
         ctx->config.event_handler(AOS_WS_CLIENT_EVENT_DISCONNECTED, NULL);
         return;
     }
@@ -630,3 +3586,522 @@ static void _aos_ws_client_onerror(aos_task_t *task)
     ESP_LOGI(_tag, "New reconnection attempt in %ums (attempt:%u)", ctx->config.retry_interval_ms, ctx->reconnection_attempt);
     ctx->retry_loop = aos_task_loop_set(task, _aos_ws_client_retry_loop, ctx->config.retry_interval_ms);
 }
+
+static bool _aos_ws_client_resources_alloc(_aos_ws_client_ctx_t *ctx)
+{
+    ESP_LOGD(_tag, "%s", __FUNCTION__);
+    esp_transport_handle_t parent_transport = NULL;
+    esp_transport_handle_t transport = NULL;
+    size_t free_size = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+
+    char *buffer = calloc(ctx->config.buffer_size, sizeof(char));
+    if (!buffer)
+        return false;
+    if (!_aos_ws_client_transport_alloc(ctx, &parent_transport, &transport))
+    {
+        free(buffer);
+        return false;
+    }
+
+    ctx->parent_transport = parent_transport;
+    ctx->transport = transport;
+    ctx->buffer = buffer;
+    // Approximate, other tasks may allocate meanwhile
+    size_t used_size = free_size - heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+    ctx->resources_size = used_size < free_size ? used_size : 0;
+    return true;
+}
+
+static bool _aos_ws_client_transport_alloc(_aos_ws_client_ctx_t *ctx, esp_transport_handle_t *out_parent_transport, esp_transport_handle_t *out_transport)
+{
+    esp_transport_handle_t parent_transport = NULL;
+    esp_transport_handle_t transport = NULL;
+
+    // Configure transports
+    switch (ctx->config.mode)
+    {
+    case AOS_WS_CLIENT_MODE_SECURE:
+    case AOS_WS_CLIENT_MODE_SECURE_TEST:
+    {
+        ESP_LOGD(_tag, "Setting up SSL transport (port:%u)", ctx->config.port);
+        parent_transport = esp_transport_ssl_init();
+        if (!parent_transport)
+            goto aos_ws_client_transport_alloc_err;
+
+        if (ctx->config.certs)
+        {
+            esp_transport_ssl_crt_bundle_attach(parent_transport, _aos_ws_client_certs_attach);
+        }
+        else if (ctx->config.server_cert_chain_pem)
+        {
+            esp_transport_ssl_set_cert_data(parent_transport, ctx->config.server_cert_chain_pem, strlen(ctx->config.server_cert_chain_pem));
+        }
+        else
+        {
+            esp_transport_ssl_enable_global_ca_store(parent_transport);
+        }
+
+        if (!ctx->config.certs && ctx->config.client_cert_chain_pem && ctx->config.client_key_pem)
+        {
+            esp_transport_ssl_set_client_cert_data(parent_transport, ctx->config.client_cert_chain_pem, strlen(ctx->config.client_cert_chain_pem));
+            esp_transport_ssl_set_client_key_data(parent_transport, ctx->config.client_key_pem, strlen(ctx->config.client_key_pem));
+        }
+
+        if (ctx->config.mode == AOS_WS_CLIENT_MODE_SECURE_TEST)
+        {
+            esp_transport_ssl_skip_common_name_check(parent_transport);
+        }
+
+        break;
+    }
+    case AOS_WS_CLIENT_MODE_INSECURE:
+    {
+        ESP_LOGD(_tag, "Setting up TCP transport (port:%u)", ctx->config.port);
+        parent_transport = esp_transport_tcp_init();
+        if (!parent_transport)
+            goto aos_ws_client_transport_alloc_err;
+
+        break;
+    }
+    default:
+        goto aos_ws_client_transport_alloc_err;
+    }
+
+    transport = esp_transport_ws_init(parent_transport);
+    if (!transport)
+        goto aos_ws_client_transport_alloc_err;
+
+    /**
+     * In the following configuration, we set propagate_control_frames to TRUE
+     * because while the esp_transport_ws implementation CAN handle
+     * disconnections, close frames, and others, it CANNOT notify a handler of
+     * such events, including DISCONNECTIONS!
+     * Thus we need to handle that stuff on our own.
+     */
+    esp_transport_ws_config_t ws_config = {
+        .ws_path = ctx->config.path,
+        .sub_protocol = ctx->config.subprotocol,
+        .user_agent = ctx->config.user_agent,
+        .headers = ctx->config.headers,
+        .propagate_control_frames = true};
+
+    if (esp_transport_ws_set_config(transport, &ws_config) != ESP_OK)
+        goto aos_ws_client_transport_alloc_err;
+
+    *out_parent_transport = parent_transport;
+    *out_transport = transport;
+    return true;
+
+aos_ws_client_transport_alloc_err:
+    esp_transport_destroy(transport);
+    esp_transport_destroy(parent_transport);
+    return false;
+}
+
+static int _aos_ws_client_connect(aos_task_t *task)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    size_t free_size = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+    int64_t stamp = esp_timer_get_time();
+    int err = _aos_ws_client_transport_connect(ctx, ctx->parent_transport, ctx->transport, ctx->endpoint);
+    _aos_ws_client_endpoint_update(task, ctx->endpoint, err >= 0, esp_timer_get_time() - stamp);
+    if (err >= 0)
+    {
+        // Approximate, other tasks may allocate meanwhile
+        size_t used_size = free_size - heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+        ctx->connection_size = used_size < free_size ? used_size : 0;
+        ESP_LOGD(_tag, "Connection size (size:%u)", ctx->connection_size);
+    }
+    return err;
+}
+
+static int _aos_ws_client_transport_connect(_aos_ws_client_ctx_t *ctx, esp_transport_handle_t parent_transport, esp_transport_handle_t transport, uint32_t endpoint_index)
+{
+    _aos_ws_client_endpoint_t *endpoint = &ctx->endpoints[endpoint_index];
+    if (ctx->endpoints_len > 1)
+    {
+        ESP_LOGI(_tag, "Connecting to endpoint (endpoint:%u host:%s port:%u)", endpoint_index, endpoint->host, endpoint->port);
+        esp_transport_ws_set_path(transport, endpoint->path);
+    }
+
+    // Keep-alive is set on the socket as it is created
+    if (ctx->keep_alive.keep_alive_enable && ctx->config.mode == AOS_WS_CLIENT_MODE_INSECURE)
+    {
+        esp_transport_tcp_set_keep_alive(parent_transport, &ctx->keep_alive);
+    }
+    else if (ctx->keep_alive.keep_alive_enable)
+    {
+        esp_transport_ssl_set_keep_alive(parent_transport, &ctx->keep_alive);
+    }
+
+    // The TLS setup hook takes no argument, let it find us by task while connecting
+    _aos_ws_client_connecting_t connecting = {
+        .ctx = ctx,
+        .task = xTaskGetCurrentTaskHandle(),
+        .certs_err = ESP_ERR_INVALID_STATE};
+    if (ctx->config.certs)
+    {
+        portENTER_CRITICAL(&_aos_ws_client_connecting_lock);
+        connecting.next = _aos_ws_client_connecting;
+        _aos_ws_client_connecting = &connecting;
+        portEXIT_CRITICAL(&_aos_ws_client_connecting_lock);
+    }
+
+    int err = esp_transport_connect(transport, endpoint->host, endpoint->port, ctx->config.send_timeout_ms);
+
+    if (ctx->config.certs)
+    {
+        portENTER_CRITICAL(&_aos_ws_client_connecting_lock);
+        _aos_ws_client_connecting_t **link = &_aos_ws_client_connecting;
+        while (*link != &connecting)
+            link = &(*link)->next;
+        *link = connecting.next;
+        portEXIT_CRITICAL(&_aos_ws_client_connecting_lock);
+
+        // Never keep a connection that was not set up with the shared certificates
+        if (err >= 0 && connecting.certs_err != ESP_OK)
+        {
+            ESP_LOGE(_tag, "Could not set up shared certificates (err:%d)", connecting.certs_err);
+            esp_transport_close(transport);
+            err = -1;
+        }
+    }
+    if (err >= 0)
+    {
+        _aos_ws_client_tuning_apply(ctx, parent_transport);
+    }
+    return err;
+}
+
+static void _aos_ws_client_tuning_apply(_aos_ws_client_ctx_t *ctx, esp_transport_handle_t parent_transport)
+{
+    int fd = esp_transport_get_socket(parent_transport);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    int value = ctx->config.tcp_nodelay == AOS_WS_CLIENT_OPTION_ENABLED;
+    if (ctx->config.tcp_nodelay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value)))
+    {
+        ESP_LOGD(_tag, "Socket option not supported (option:TCP_NODELAY errno:%d)", errno);
+    }
+
+    // Report what the stack actually uses
+    socklen_t value_len = sizeof(value);
+    ctx->socket_nodelay = !getsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, &value_len) && value;
+}
+
+static void _aos_ws_client_resources_free(_aos_ws_client_ctx_t *ctx)
+{
+    ESP_LOGD(_tag, "%s", __FUNCTION__);
+    esp_transport_destroy(ctx->transport);
+    esp_transport_destroy(ctx->parent_transport);
+    free(ctx->buffer);
+    ctx->transport = NULL;
+    ctx->parent_transport = NULL;
+    ctx->buffer = NULL;
+}
+
+static void _aos_ws_client_state_set(aos_task_t *task, _aos_ws_client_state_t state)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    _AOS_WS_CLIENT_TRACE(ctx, AOS_WS_CLIENT_TRACE_STATE, state, 0);
+    ctx->state = state;
+    if (state == CONNECTED)
+    {
+        // Leave the new connection some room before the standby handshake takes the task
+        ctx->standby_due = esp_timer_get_time() + (int64_t)ctx->config.standby_delay_ms * 1000;
+    }
+    if (ctx->config.lowpower_window_ms && state == CONNECTED)
+    {
+        // Lingers like after any traffic, the server usually has something to say first
+        int64_t now = esp_timer_get_time();
+        ctx->lowpower_stamp = ctx->lowpower_stamp ? ctx->lowpower_stamp : now;
+        ctx->lowpower_tx_stamp = now;
+        ctx->lowpower_window = false;
+        _aos_ws_client_lowpower_wake(ctx, now);
+    }
+    else if (ctx->config.lowpower_window_ms)
+    {
+        ctx->lowpower_window = false;
+        _aos_ws_client_lowpower_rest(ctx, esp_timer_get_time());
+    }
+    if (state == CONNECTED && ctx->session_slots)
+    {
+        // Held back until the server tells what it has seen
+        ctx->session_resume = true;
+        ctx->session_resuming = true;
+    }
+    if (state == DISCONNECTED)
+    {
+        _aos_ws_client_worker_wait(ctx);
+        _aos_ws_client_standby_drop(ctx);
+    }
+    if (state == DISCONNECTED && ctx->config.lazy_resources && ctx->transport)
+    {
+        ESP_LOGI(_tag, "Releasing resources (size:%u)", ctx->resources_size);
+        _aos_ws_client_resources_free(ctx);
+        _aos_ws_client_standby_free(ctx);
+    }
+}
+
+#if CONFIG_AOS_WS_CLIENT_TRACE
+static void _aos_ws_client_trace(_aos_ws_client_ctx_t *ctx, aos_ws_client_trace_event_t event, uint8_t opcode, size_t data_len)
+{
+    // Called from the client task and from senders: keep it short, no formatting
+    aos_ws_client_trace_entry_t entry = {
+        .timestamp_us = (uint32_t)esp_timer_get_time(),
+        .data_len = data_len < 0xFFFFFF ? data_len : 0xFFFFFF,
+        .event = event,
+        .opcode = opcode};
+    portENTER_CRITICAL(&ctx->lock);
+    ctx->trace[ctx->trace_head % CONFIG_AOS_WS_CLIENT_TRACE_ENTRIES] = entry;
+    ctx->trace_head++;
+    portEXIT_CRITICAL(&ctx->lock);
+}
+#endif
+
+size_t aos_ws_client_trace_dump(aos_task_t *task, aos_ws_client_trace_entry_t *out_entries, size_t max_entries)
+{
+#if CONFIG_AOS_WS_CLIENT_TRACE
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(task);
+    portENTER_CRITICAL(&ctx->lock);
+    size_t count = ctx->trace_head < CONFIG_AOS_WS_CLIENT_TRACE_ENTRIES ? ctx->trace_head : CONFIG_AOS_WS_CLIENT_TRACE_ENTRIES;
+    count = count < max_entries ? count : max_entries;
+    for (size_t i = 0; i < count; i++)
+    {
+        out_entries[i] = ctx->trace[(ctx->trace_head - count + i) % CONFIG_AOS_WS_CLIENT_TRACE_ENTRIES];
+    }
+    portEXIT_CRITICAL(&ctx->lock);
+    return count;
+#else
+    return 0;
+#endif
+}
+
+static aos_future_t *_aos_ws_client_send(aos_task_t *client, _aos_ws_client_taskevt_t taskevt, aos_future_t *future, size_t data_len)
+{
+    _aos_ws_client_ctx_t *ctx = aos_task_args_get(client);
+    _AOS_WS_CLIENT_TRACE(ctx, AOS_WS_CLIENT_TRACE_ENQUEUE, taskevt, data_len);
+    _AOS_WS_CLIENT_PROFILE_ENQUEUE(ctx);
+    _AOS_WS_CLIENT_SIZING_ENQUEUE(ctx);
+    return aos_task_send(client, taskevt, future);
+}
+
+#if CONFIG_AOS_WS_CLIENT_PROFILE
+static void _aos_ws_client_profile(_aos_ws_client_ctx_t *ctx, aos_ws_client_stage_t stage, uint32_t latency_us)
+{
+    aos_ws_client_stage_stats_t *stats = &ctx->stages[stage];
+    if (!stats->count || latency_us < stats->min_us)
+    {
+        stats->min_us = latency_us;
+    }
+    if (latency_us > stats->max_us)
+    {
+        stats->max_us = latency_us;
+    }
+    stats->sum_us += latency_us;
+    stats->count++;
+
+    unsigned int bucket = 0;
+    while (bucket < AOS_WS_CLIENT_STAGE_HISTOGRAM_BUCKETS - 1 && latency_us >= (1U << bucket))
+    {
+        bucket++;
+    }
+    stats->histogram[bucket]++;
+}
+
+static void _aos_ws_client_profile_enqueue(_aos_ws_client_ctx_t *ctx)
+{
+    // Requests are handled in order, so enqueue stamps are matched by their handlers as a FIFO
+    portENTER_CRITICAL(&ctx->lock);
+    if (ctx->queue_stamps_head - ctx->queue_stamps_tail < CONFIG_AOS_WS_CLIENT_PROFILE_QUEUE_STAMPS)
+    {
+        ctx->queue_stamps[ctx->queue_stamps_head % CONFIG_AOS_WS_CLIENT_PROFILE_QUEUE_STAMPS] = (uint32_t)esp_timer_get_time();
+        ctx->queue_stamps_head++;
+    }
+    portEXIT_CRITICAL(&ctx->lock);
+}
+
+static void _aos_ws_client_profile_dequeue(_aos_ws_client_ctx_t *ctx)
+{
+    uint32_t stamp = 0;
+    bool stamped = false;
+    portENTER_CRITICAL(&ctx->lock);
+    if (ctx->queue_stamps_head != ctx->queue_stamps_tail)
+    {
+        stamp = ctx->queue_stamps[ctx->queue_stamps_tail % CONFIG_AOS_WS_CLIENT_PROFILE_QUEUE_STAMPS];
+        ctx->queue_stamps_tail++;
+        stamped = true;
+    }
+    portEXIT_CRITICAL(&ctx->lock);
+    if (stamped)
+    {
+        _aos_ws_client_profile(ctx, AOS_WS_CLIENT_STAGE_QUEUE, (uint32_t)esp_timer_get_time() - stamp);
+    }
+}
+#endif
+
+#if CONFIG_AOS_WS_CLIENT_SIZING
+static void _aos_ws_client_sizing_enqueue(_aos_ws_client_ctx_t *ctx)
+{
+    // Counted before the send so that senders blocked on a full queue show up in the peak
+    portENTER_CRITICAL(&ctx->lock);
+    ctx->sizing_pending++;
+    if (ctx->sizing_pending > ctx->sizing_queue_peak)
+    {
+        ctx->sizing_queue_peak = ctx->sizing_pending;
+    }
+    portEXIT_CRITICAL(&ctx->lock);
+}
+
+static void _aos_ws_client_sizing_dequeue(_aos_ws_client_ctx_t *ctx)
+{
+    portENTER_CRITICAL(&ctx->lock);
+    if (ctx->sizing_pending)
+    {
+        ctx->sizing_pending--;
+    }
+    portEXIT_CRITICAL(&ctx->lock);
+    // The high-water mark covers the whole task lifetime, so sampling it from any handler is enough
+    ctx->sizing_stack_free_min = uxTaskGetStackHighWaterMark(NULL);
+}
+
+static void _aos_ws_client_sizing_get(_aos_ws_client_ctx_t *ctx, aos_ws_client_stats_t *stats)
+{
+    portENTER_CRITICAL(&ctx->lock);
+    stats->queue_peak = ctx->sizing_queue_peak;
+    portEXIT_CRITICAL(&ctx->lock);
+    stats->stack_free_min = ctx->sizing_stack_free_min;
+    stats->rx_fill_peak = ctx->sizing_rx_fill_peak;
+    stats->rx_frame_max = ctx->sizing_rx_frame_max;
+
+    // Keep the configured stack until a handler had the chance to sample the high-water mark
+    uint32_t used = ctx->config.stacksize - (stats->stack_free_min < ctx->config.stacksize ? stats->stack_free_min : 0);
+    stats->recommended_stacksize = stats->stack_free_min ? (used + used / 4 + 127) & ~127U : ctx->config.stacksize;
+    stats->recommended_queuesize = stats->queue_peak ? stats->queue_peak : 1;
+    size_t buffer_size = stats->rx_frame_max > stats->rx_fill_peak ? stats->rx_frame_max : stats->rx_fill_peak;
+    stats->recommended_buffer_size = buffer_size ? (buffer_size + 63) & ~(size_t)63 : ctx->config.buffer_size;
+}
+#endif
+
+#if CONFIG_AOS_WS_CLIENT_SHARED_CERTS
+static int _aos_ws_client_certs_rng(void *ctx, unsigned char *data, size_t data_len)
+{
+    esp_fill_random(data, data_len);
+    return 0;
+}
+#endif
+
+aos_ws_client_certs_t *aos_ws_client_certs_alloc(const char *server_cert_chain_pem, const char *client_cert_chain_pem, const char *client_key_pem)
+{
+    ESP_LOGD(_tag, "%s", __FUNCTION__);
+#if CONFIG_AOS_WS_CLIENT_SHARED_CERTS
+    aos_ws_client_certs_t *certs = calloc(1, sizeof(aos_ws_client_certs_t));
+    if (!certs)
+        return NULL;
+    certs->refs = 1;
+    mbedtls_x509_crt_init(&certs->server_chain);
+    mbedtls_x509_crt_init(&certs->client_chain);
+    mbedtls_pk_init(&certs->client_key);
+
+    // PEM parsing expects the terminating null character to be part of the length
+    int err = 0;
+    if (server_cert_chain_pem)
+    {
+        certs->server = true;
+        err = mbedtls_x509_crt_parse(&certs->server_chain, (const unsigned char *)server_cert_chain_pem, strlen(server_cert_chain_pem) + 1);
+        if (err)
+        {
+            ESP_LOGE(_tag, "Could not parse server certificate chain (err:-0x%x)", -err);
+            goto aos_ws_client_certs_alloc_err;
+        }
+    }
+    if (client_cert_chain_pem && client_key_pem)
+    {
+        certs->client = true;
+        err = mbedtls_x509_crt_parse(&certs->client_chain, (const unsigned char *)client_cert_chain_pem, strlen(client_cert_chain_pem) + 1);
+        if (err)
+        {
+            ESP_LOGE(_tag, "Could not parse client certificate chain (err:-0x%x)", -err);
+            goto aos_ws_client_certs_alloc_err;
+        }
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+        err = mbedtls_pk_parse_key(&certs->client_key, (const unsigned char *)client_key_pem, strlen(client_key_pem) + 1, NULL, 0, _aos_ws_client_certs_rng, NULL);
+#else
+        err = mbedtls_pk_parse_key(&certs->client_key, (const unsigned char *)client_key_pem, strlen(client_key_pem) + 1, NULL, 0);
+#endif
+        if (err)
+        {
+            ESP_LOGE(_tag, "Could not parse client key (err:-0x%x)", -err);
+            goto aos_ws_client_certs_alloc_err;
+        }
+    }
+    return certs;
+
+aos_ws_client_certs_alloc_err:
+    aos_ws_client_certs_free(certs);
+    return NULL;
+#else
+    ESP_LOGE(_tag, "Shared certificates are disabled (requires CONFIG_AOS_WS_CLIENT_SHARED_CERTS)");
+    return NULL;
+#endif
+}
+
+void aos_ws_client_certs_free(aos_ws_client_certs_t *certs)
+{
+    ESP_LOGD(_tag, "%s", __FUNCTION__);
+    if (!certs)
+        return;
+    portENTER_CRITICAL(&_aos_ws_client_connecting_lock);
+    uint32_t refs = --certs->refs;
+    portEXIT_CRITICAL(&_aos_ws_client_connecting_lock);
+    if (refs)
+        return;
+    mbedtls_x509_crt_free(&certs->server_chain);
+    mbedtls_x509_crt_free(&certs->client_chain);
+    mbedtls_pk_free(&certs->client_key);
+    free(certs);
+}
+
+static esp_err_t _aos_ws_client_certs_attach(void *conf)
+{
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    portENTER_CRITICAL(&_aos_ws_client_connecting_lock);
+    _aos_ws_client_connecting_t *connecting = _aos_ws_client_connecting;
+    while (connecting && connecting->task != task)
+        connecting = connecting->next;
+    portEXIT_CRITICAL(&_aos_ws_client_connecting_lock);
+    if (!connecting)
+    {
+        ESP_LOGE(_tag, "No shared certificates for this connection");
+        return ESP_FAIL;
+    }
+    _aos_ws_client_ctx_t *ctx = connecting->ctx;
+    aos_ws_client_certs_t *certs = ctx->config.certs;
+    connecting->certs_err = ESP_FAIL;
+
+    mbedtls_x509_crt *ca_chain = certs->server ? &certs->server_chain : esp_tls_get_global_ca_store();
+    if (!ca_chain)
+    {
+        ESP_LOGE(_tag, "No server certificates, nor global CA store");
+        return ESP_FAIL;
+    }
+    mbedtls_ssl_conf_ca_chain(conf, ca_chain, NULL);
+    if (certs->client && mbedtls_ssl_conf_own_cert(conf, &certs->client_chain, &certs->client_key))
+    {
+        ESP_LOGE(_tag, "Could not use client certificate");
+        return ESP_FAIL;
+    }
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+    // The hook runs on the connecting task, its context is not shared
+    if (ctx->tls_mfl_code && mbedtls_ssl_conf_max_frag_len(conf, ctx->tls_mfl_code))
+    {
+        ESP_LOGE(_tag, "Could not set TLS maximum fragment length");
+        return ESP_FAIL;
+    }
+#endif
+    connecting->certs_err = ESP_OK;
+    return ESP_OK;
+}
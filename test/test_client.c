@@ -5,19 +5,75 @@
 #include <unity_test_runner.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <freertos/queue.h>
 #include <esp_netif.h>
 #include <esp_tls.h>
+#include <esp_timer.h>
+#if CONFIG_HTTPD_WS_SUPPORT
+#include <esp_http_server.h>
+#include <lwip/sockets.h>
+#endif
 
 static bool _isinit = false;
 static const char *_test_ssid = "MY_SSID";
 static const char *_test_password = "MY_PASSWORD";
 static const char *_test_host = "ws.postman-echo.com";
+static const char *_test_lan_host = CONFIG_AOS_WS_CLIENT_TEST_LAN_HOST; // Host running the tools/ servers
+static const uint16_t _test_fault_port = 8765;       // Port of tools/aos_ws_faultlab.py on _test_lan_host
+static const uint16_t _test_session_port = 8766;     // Port of tools/aos_ws_session_server.py on _test_lan_host
+static const uint16_t _test_echo_port = 8767;        // Port of tools/aos_ws_echo_server.py on _test_lan_host
+static const uint16_t _test_conformance_port = 9001; // Port of tools/aos_ws_conformance.py (or an Autobahn fuzzingserver) on _test_lan_host
 extern const uint8_t server_root_cert_pem_start[] asm("_binary_postman_echo_com_pem_start");
 extern const uint8_t server_root_cert_pem_end[] asm("_binary_postman_echo_com_pem_end");
 
+static size_t _test_received = 0;
+
 static void test_ws_ondata(const void *data, size_t data_len)
 {
     printf("Received data: %.*s\n", data_len, (char *)data);
+    _test_received += data_len;
+}
+
+static aos_ws_client_rx_info_t _test_rx_info[2];
+static int64_t _test_rx_delay_us[2];
+static size_t _test_rx_infos = 0;
+
+static void test_ws_ondata_ex(const void *data, size_t data_len, const aos_ws_client_rx_info_t *info, void *user_ctx)
+{
+    printf("Received %s data: %.*s\n", info->opcode == 1 ? "text" : "binary", data_len, (char *)data);
+    TEST_ASSERT_EQUAL_PTR(&_test_rx_infos, user_ctx);
+    if (_test_rx_infos < 2)
+    {
+        _test_rx_delay_us[_test_rx_infos] = esp_timer_get_time() - info->rx_us;
+        _test_rx_info[_test_rx_infos] = *info;
+    }
+    _test_rx_infos++;
+}
+
+static size_t _test_batches = 0;
+
+static void test_ws_ondata_batch(const aos_ws_client_message_t *messages, size_t messages_len)
+{
+    printf("Received batch: %u messages\n", messages_len);
+    for (size_t i = 0; i < messages_len; i++)
+        test_ws_ondata(messages[i].data, messages[i].data_len);
+    _test_batches++;
+}
+
+static size_t _test_backlog = 0;
+static bool _test_backlog_consume = false;
+
+static void test_ws_ondata_backlog(const void *data, size_t data_len)
+{
+    test_ws_ondata(data, data_len);
+    if (!_test_backlog_consume)
+        _test_backlog += data_len;
+}
+
+static size_t test_ws_rx_backlog()
+{
+    return _test_backlog;
 }
 
 static void test_ws_eventhandler(aos_ws_client_event_t event, void *args)
@@ -42,6 +98,249 @@ static void test_ws_eventhandler(aos_ws_client_event_t event, void *args)
     }
 }
 
+static void test_lan_host_check()
+{
+    if (!_test_lan_host[0])
+        TEST_IGNORE_MESSAGE("Set CONFIG_AOS_WS_CLIENT_TEST_LAN_HOST to the host running the tools/ servers");
+}
+
+static aos_task_t *test_client_connect(aos_ws_client_config_t *config)
+{
+    aos_task_t *client = aos_ws_client_alloc(config);
+    TEST_ASSERT_NOT_NULL(client);
+
+    aos_future_t *start = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(start);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_start(client, start))));
+    aos_awaitable_free(start);
+
+    aos_future_t *connect = AOS_AWAITABLE_ALLOC_T(aos_ws_client_connect)(0);
+    TEST_ASSERT_NOT_NULL(connect);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_connect(client, connect))));
+    AOS_ARGS_T(aos_ws_client_connect) *connect_args = aos_args_get(connect);
+    TEST_ASSERT_EQUAL(0, connect_args->out_err);
+    aos_awaitable_free(connect);
+    return client;
+}
+
+static aos_ws_client_stats_t test_client_stats(aos_task_t *client)
+{
+    aos_future_t *stats = AOS_AWAITABLE_ALLOC_T(aos_ws_client_stats_get)((aos_ws_client_stats_t){0});
+    TEST_ASSERT_NOT_NULL(stats);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_stats_get(client, stats))));
+    AOS_ARGS_T(aos_ws_client_stats_get) *stats_args = aos_args_get(stats);
+    aos_ws_client_stats_t out_stats = stats_args->out_stats;
+    aos_awaitable_free(stats);
+    return out_stats;
+}
+
+static void test_client_free(aos_task_t *client)
+{
+    aos_future_t *disconnect = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(disconnect);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_disconnect(client, disconnect))));
+    aos_awaitable_free(disconnect);
+
+    aos_future_t *stop = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(stop);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_stop(client, stop))));
+    aos_awaitable_free(stop);
+
+    aos_ws_client_free(client);
+}
+
+static volatile bool _test_fault_end = false;
+static volatile int64_t _test_fault_detected_ms = 0;
+
+static void test_ws_ondata_fault(const void *data, size_t data_len)
+{
+    if (data_len == 3 && !memcmp(data, "end", 3))
+        _test_fault_end = true;
+}
+
+static void test_ws_eventhandler_fault(aos_ws_client_event_t event, void *args)
+{
+    if (event == AOS_WS_CLIENT_EVENT_RECONNECTING)
+        _test_fault_detected_ms = esp_timer_get_time() / 1000;
+    test_ws_eventhandler(event, args);
+}
+
+static volatile uint32_t _test_session_echoes = 0;
+static volatile uint32_t _test_session_misordered = 0;
+
+static void test_ws_ondata_session(const void *data, size_t data_len)
+{
+    char expected[16];
+    int expected_len = snprintf(expected, sizeof(expected), "msg %u", _test_session_echoes + 1);
+    if (data_len != expected_len || memcmp(data, expected, data_len))
+        _test_session_misordered++;
+    _test_session_echoes++;
+}
+
+static SemaphoreHandle_t _test_bench_echo = NULL;
+
+static void test_ws_ondata_bench(const void *data, size_t data_len)
+{
+    xSemaphoreGive(_test_bench_echo);
+}
+
+#if CONFIG_HTTPD_WS_SUPPORT
+static const uint16_t _test_loopback_port = 8768; // Port of the echo server run by the test itself, reached over loopback
+
+static esp_err_t test_loopback_echo(httpd_req_t *req)
+{
+    if (req->method == HTTP_GET)
+    {
+        // Like tools/aos_ws_echo_server.py, so that measured delays come from the client
+        int nodelay = 1;
+        setsockopt(httpd_req_to_sockfd(req), IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        return ESP_OK;
+    }
+
+    httpd_ws_frame_t frame = {0};
+    esp_err_t err = httpd_ws_recv_frame(req, &frame, 0);
+    if (err != ESP_OK || !frame.len)
+        return err;
+    frame.payload = malloc(frame.len);
+    if (!frame.payload)
+        return ESP_ERR_NO_MEM;
+    err = httpd_ws_recv_frame(req, &frame, frame.len);
+    if (err == ESP_OK)
+        err = httpd_ws_send_frame(req, &frame);
+    free(frame.payload);
+    return err;
+}
+
+static httpd_handle_t test_loopback_start(void)
+{
+    httpd_handle_t server = NULL;
+    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.server_port = _test_loopback_port;
+    httpd_uri_t uri = {
+        .uri = "/",
+        .method = HTTP_GET,
+        .handler = test_loopback_echo,
+        .is_websocket = true};
+    TEST_ASSERT_EQUAL(ESP_OK, httpd_start(&server, &config));
+    TEST_ASSERT_EQUAL(ESP_OK, httpd_register_uri_handler(server, &uri));
+    return server;
+}
+#endif
+
+typedef struct test_conformance_message_t
+{
+    uint8_t opcode;
+    size_t len;
+    char data[]; // NUL terminated, for aos_ws_client_send_text
+} test_conformance_message_t;
+
+static QueueHandle_t _test_conformance_queue = NULL;
+static test_conformance_message_t *_test_conformance_message = NULL;
+static volatile bool _test_conformance_closed = false;
+static volatile uint32_t _test_conformance_dropped = 0;
+
+static void test_ws_ondata_conformance(const void *data, size_t data_len, const aos_ws_client_rx_info_t *info, void *user_ctx)
+{
+    // Fragments and frames longer than the buffer come in parts, the whole message is echoed at once
+    if (info->opcode != 0 && info->offset == 0)
+    {
+        free(_test_conformance_message);
+        _test_conformance_message = calloc(1, sizeof(test_conformance_message_t) + 1);
+        if (_test_conformance_message)
+            _test_conformance_message->opcode = info->opcode;
+    }
+    if (!_test_conformance_message)
+    {
+        _test_conformance_dropped++;
+        return;
+    }
+    test_conformance_message_t *message = realloc(_test_conformance_message, sizeof(test_conformance_message_t) + _test_conformance_message->len + data_len + 1);
+    if (!message)
+    {
+        free(_test_conformance_message);
+        _test_conformance_message = NULL;
+        _test_conformance_dropped++;
+        return;
+    }
+    memcpy(message->data + message->len, data, data_len);
+    message->len += data_len;
+    message->data[message->len] = '\0';
+    _test_conformance_message = message;
+    if (info->fin && info->offset + data_len == info->frame_len)
+    {
+        // Never block here, the test task needs the client task to send the echoes
+        if (xQueueSend(_test_conformance_queue, &message, 0) != pdTRUE)
+        {
+            free(message);
+            _test_conformance_dropped++;
+        }
+        _test_conformance_message = NULL;
+    }
+}
+
+static void test_ws_eventhandler_conformance(aos_ws_client_event_t event, void *args)
+{
+    // Cases end with the server closing, reconnecting would run them again
+    if (event == AOS_WS_CLIENT_EVENT_DISCONNECTED || event == AOS_WS_CLIENT_EVENT_RECONNECTING)
+        _test_conformance_closed = true;
+}
+
+static uint32_t test_conformance_run(const char *path, char *out_text, size_t out_text_size)
+{
+    aos_ws_client_config_t config = {
+        .on_data_ex = test_ws_ondata_conformance,
+        .event_handler = test_ws_eventhandler_conformance,
+        .mode = AOS_WS_CLIENT_MODE_INSECURE,
+        .host = _test_lan_host,
+        .port = _test_conformance_port,
+        .path = path,
+        .buffer_size = 2048};
+    _test_conformance_closed = false;
+    int64_t begin = esp_timer_get_time();
+    aos_task_t *client = test_client_connect(&config);
+
+    // Echo every message until the server closes, or keep the first one when asked for it
+    test_conformance_message_t *message;
+    while (esp_timer_get_time() - begin < 30 * 1000000LL)
+    {
+        if (!xQueueReceive(_test_conformance_queue, &message, pdMS_TO_TICKS(100)))
+        {
+            if (_test_conformance_closed)
+                break;
+            continue;
+        }
+        if (out_text)
+        {
+            snprintf(out_text, out_text_size, "%.*s", message->len, message->data);
+            out_text = NULL;
+        }
+        else if (message->opcode == 1)
+        {
+            aos_future_t *send = AOS_AWAITABLE_ALLOC_T(aos_ws_client_send_text)(message->data, 0);
+            TEST_ASSERT_NOT_NULL(send);
+            TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_send_text(client, send))));
+            aos_awaitable_free(send);
+        }
+        else
+        {
+            aos_future_t *send = AOS_AWAITABLE_ALLOC_T(aos_ws_client_send_binary)(message->data, message->len, 0);
+            TEST_ASSERT_NOT_NULL(send);
+            TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_send_binary(client, send))));
+            aos_awaitable_free(send);
+        }
+        free(message);
+    }
+    uint32_t elapsed_ms = (esp_timer_get_time() - begin) / 1000;
+
+    test_client_free(client);
+
+    while (xQueueReceive(_test_conformance_queue, &message, 0))
+        free(message);
+    free(_test_conformance_message);
+    _test_conformance_message = NULL;
+    return elapsed_ms;
+}
+
 static void test_wifi_handler(aos_wifi_client_event_t event, void *args)
 {
     switch (event)
@@ -281,15 +580,38 @@ TEST_CASE("Connect/sendraw/disconnect", "[wsclient]")
     TEST_HEAP_STOP
 }
 
-TEST_CASE("Connect / wait for press / disconnect", "[wsclient]")
+static char _test_sink_buffer[4];
+static size_t _test_sink_received = 0;
+static bool _test_sink_fin = false;
+static size_t _test_sink_messages = 0;
+
+static void *test_ws_sink_acquire(size_t *out_len)
+{
+    *out_len = sizeof(_test_sink_buffer);
+    return _test_sink_buffer;
+}
+
+static void test_ws_sink_commit(void *data, size_t data_len, bool fin)
+{
+    printf("Sink commit: %.*s (fin:%u)\n", data_len, (char *)data, fin);
+    _test_sink_received += data_len;
+    _test_sink_fin = fin;
+    _test_sink_messages += fin;
+}
+
+TEST_CASE("Connect/sendraw sink/disconnect", "[wsclient]")
 {
     test_init();
 
     TEST_HEAP_START
 
+    _test_sink_received = 0;
+    _test_sink_fin = false;
     aos_ws_client_config_t config = {
         .on_data = test_ws_ondata,
         .event_handler = test_ws_eventhandler,
+        .sink_acquire = test_ws_sink_acquire,
+        .sink_commit = test_ws_sink_commit,
         .mode = AOS_WS_CLIENT_MODE_SECURE_TEST,
         .host = _test_host,
         .path = "/raw"};
@@ -308,9 +630,211 @@ TEST_CASE("Connect / wait for press / disconnect", "[wsclient]")
     TEST_ASSERT_EQUAL(0, connect_args->out_err);
     aos_awaitable_free(connect);
 
-    printf("Press q when satisfied\n");
-    while (fgetc(stdin) != 'q')
-        ;
+    char *data = strdup("Hello world");
+    TEST_ASSERT_NOT_NULL(data);
+    aos_future_t *send = AOS_AWAITABLE_ALLOC_T(aos_ws_client_send_binary)(data, strlen(data) + 1, 0);
+    TEST_ASSERT_NOT_NULL(send);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_send_binary(client, send))));
+    AOS_ARGS_T(aos_ws_client_send_binary) *send_args = aos_args_get(send);
+    TEST_ASSERT_EQUAL(0, send_args->out_err);
+    aos_awaitable_free(send);
+
+    // Wait for response
+    vTaskDelay(pdMS_TO_TICKS(300));
+    TEST_ASSERT_EQUAL(strlen(data) + 1, _test_sink_received);
+    TEST_ASSERT_TRUE(_test_sink_fin);
+    free(data);
+
+    aos_future_t *stop = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(stop);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_stop(client, stop))));
+    aos_awaitable_free(stop);
+
+    aos_ws_client_free(client);
+
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    TEST_HEAP_STOP
+}
+
+TEST_CASE("Connect/sendraw sink fragmented/disconnect", "[wsclient]")
+{
+    test_init();
+    test_lan_host_check();
+
+    TEST_HEAP_START
+
+    // Run tools/aos_ws_echo_server.py on _test_lan_host first, /fragmented splits every message and ends it with an empty final frame
+    _test_sink_received = 0;
+    _test_sink_fin = false;
+    _test_sink_messages = 0;
+    aos_ws_client_config_t config = {
+        .on_data = test_ws_ondata,
+        .event_handler = test_ws_eventhandler,
+        .sink_acquire = test_ws_sink_acquire,
+        .sink_commit = test_ws_sink_commit,
+        .mode = AOS_WS_CLIENT_MODE_INSECURE,
+        .host = _test_lan_host,
+        .port = _test_echo_port,
+        .path = "/fragmented"};
+    aos_task_t *client = aos_ws_client_alloc(&config);
+    TEST_ASSERT_NOT_NULL(client);
+
+    aos_future_t *start = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(start);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_start(client, start))));
+    aos_awaitable_free(start);
+
+    aos_future_t *connect = AOS_AWAITABLE_ALLOC_T(aos_ws_client_connect)(0);
+    TEST_ASSERT_NOT_NULL(connect);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_connect(client, connect))));
+    AOS_ARGS_T(aos_ws_client_connect) *connect_args = aos_args_get(connect);
+    TEST_ASSERT_EQUAL(0, connect_args->out_err);
+    aos_awaitable_free(connect);
+
+    // Two messages that do not fill a whole number of sink buffers, a missed close would carry over into the second
+    for (int i = 0; i < 2; i++)
+    {
+        char *data = strdup("Hello");
+        TEST_ASSERT_NOT_NULL(data);
+        aos_future_t *send = AOS_AWAITABLE_ALLOC_T(aos_ws_client_send_binary)(data, strlen(data) + 1, 0);
+        TEST_ASSERT_NOT_NULL(send);
+        TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_send_binary(client, send))));
+        AOS_ARGS_T(aos_ws_client_send_binary) *send_args = aos_args_get(send);
+        TEST_ASSERT_EQUAL(0, send_args->out_err);
+        aos_awaitable_free(send);
+        free(data);
+
+        // Wait for response
+        vTaskDelay(pdMS_TO_TICKS(300));
+        TEST_ASSERT_EQUAL(6 * (i + 1), _test_sink_received);
+        TEST_ASSERT_EQUAL(i + 1, _test_sink_messages);
+        TEST_ASSERT_TRUE(_test_sink_fin);
+    }
+
+    aos_future_t *stop = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(stop);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_stop(client, stop))));
+    aos_awaitable_free(stop);
+
+    aos_ws_client_free(client);
+
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    TEST_HEAP_STOP
+}
+
+TEST_CASE("Connect/rpc/disconnect", "[wsclient]")
+{
+    test_init();
+
+    TEST_HEAP_START
+
+    aos_ws_client_config_t config = {
+        .on_data = test_ws_ondata,
+        .event_handler = test_ws_eventhandler,
+        .rpc_id_offset = 0,
+        .rpc_id_len = 4,
+        .mode = AOS_WS_CLIENT_MODE_SECURE_TEST,
+        .host = _test_host,
+        .path = "/raw"};
+    aos_task_t *client = aos_ws_client_alloc(&config);
+    TEST_ASSERT_NOT_NULL(client);
+
+    aos_future_t *start = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(start);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_start(client, start))));
+    aos_awaitable_free(start);
+
+    aos_future_t *connect = AOS_AWAITABLE_ALLOC_T(aos_ws_client_connect)(0);
+    TEST_ASSERT_NOT_NULL(connect);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_connect(client, connect))));
+    AOS_ARGS_T(aos_ws_client_connect) *connect_args = aos_args_get(connect);
+    TEST_ASSERT_EQUAL(0, connect_args->out_err);
+    aos_awaitable_free(connect);
+
+    // The echo server replies with the same correlation ID, keep several requests in flight
+    char *data[3] = {strdup("0001 first"), strdup("0002 second"), strdup("0003 third")};
+    char response[3][16] = {0};
+    aos_future_t *rpc[3];
+    for (int i = 0; i < 3; i++)
+    {
+        TEST_ASSERT_NOT_NULL(data[i]);
+        rpc[i] = AOS_AWAITABLE_ALLOC_T(aos_ws_client_rpc)(data[i], strlen(data[i]), 0, response[i], sizeof(response[i]), 0, 0);
+        TEST_ASSERT_NOT_NULL(rpc[i]);
+        aos_ws_client_rpc(client, rpc[i]);
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        TEST_ASSERT_TRUE(aos_isresolved(aos_await(rpc[i])));
+        AOS_ARGS_T(aos_ws_client_rpc) *rpc_args = aos_args_get(rpc[i]);
+        TEST_ASSERT_EQUAL(0, rpc_args->out_err);
+        TEST_ASSERT_EQUAL(strlen(data[i]), rpc_args->out_response_len);
+        TEST_ASSERT_EQUAL_MEMORY(data[i], response[i], strlen(data[i]));
+        aos_awaitable_free(rpc[i]);
+        free(data[i]);
+    }
+
+    aos_future_t *stop = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(stop);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_stop(client, stop))));
+    aos_awaitable_free(stop);
+
+    aos_ws_client_free(client);
+
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    TEST_HEAP_STOP
+}
+
+TEST_CASE("Connect/rpc fragmented/disconnect", "[wsclient]")
+{
+    test_init();
+    test_lan_host_check();
+
+    TEST_HEAP_START
+
+    // Run tools/aos_ws_echo_server.py on _test_lan_host first, /fragmented splits every response over three frames
+    aos_ws_client_config_t config = {
+        .on_data = test_ws_ondata,
+        .event_handler = test_ws_eventhandler,
+        .rpc_id_offset = 0,
+        .rpc_id_len = 4,
+        .mode = AOS_WS_CLIENT_MODE_INSECURE,
+        .host = _test_lan_host,
+        .port = _test_echo_port,
+        .path = "/fragmented"};
+    aos_task_t *client = aos_ws_client_alloc(&config);
+    TEST_ASSERT_NOT_NULL(client);
+
+    aos_future_t *start = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(start);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_start(client, start))));
+    aos_awaitable_free(start);
+
+    aos_future_t *connect = AOS_AWAITABLE_ALLOC_T(aos_ws_client_connect)(0);
+    TEST_ASSERT_NOT_NULL(connect);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_connect(client, connect))));
+    AOS_ARGS_T(aos_ws_client_connect) *connect_args = aos_args_get(connect);
+    TEST_ASSERT_EQUAL(0, connect_args->out_err);
+    aos_awaitable_free(connect);
+
+    // The whole response resolves the request, no fragment reaches on_data
+    _test_received = 0;
+    char *data = strdup("0001 fragmented response");
+    TEST_ASSERT_NOT_NULL(data);
+    char response[32] = {0};
+    aos_future_t *rpc = AOS_AWAITABLE_ALLOC_T(aos_ws_client_rpc)(data, strlen(data), 0, response, sizeof(response), 0, 0);
+    TEST_ASSERT_NOT_NULL(rpc);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_rpc(client, rpc))));
+    AOS_ARGS_T(aos_ws_client_rpc) *rpc_args = aos_args_get(rpc);
+    TEST_ASSERT_EQUAL(0, rpc_args->out_err);
+    TEST_ASSERT_EQUAL(strlen(data), rpc_args->out_response_len);
+    TEST_ASSERT_EQUAL_MEMORY(data, response, strlen(data));
+    aos_awaitable_free(rpc);
+    free(data);
+    vTaskDelay(pdMS_TO_TICKS(300));
+    TEST_ASSERT_EQUAL(0, _test_received);
 
     aos_future_t *stop = aos_awaitable_alloc(0);
     TEST_ASSERT_NOT_NULL(stop);
@@ -323,3 +847,1410 @@ TEST_CASE("Connect / wait for press / disconnect", "[wsclient]")
 
     TEST_HEAP_STOP
 }
+
+static size_t _test_route_received[2] = {0};
+
+static void test_ws_onroute(const void *data, size_t data_len, void *user_ctx)
+{
+    printf("Routed data: %.*s\n", data_len, (char *)data);
+    _test_route_received[(size_t *)user_ctx - _test_route_received] += data_len;
+}
+
+TEST_CASE("Connect/sendtext routes/disconnect", "[wsclient]")
+{
+    test_init();
+
+    TEST_HEAP_START
+
+    _test_received = 0;
+    _test_route_received[0] = 0;
+    _test_route_received[1] = 0;
+    aos_ws_client_route_t routes[] = {
+        {.key = "t1", .on_data = test_ws_onroute, .user_ctx = &_test_route_received[0]},
+        {.key = "t2", .on_data = test_ws_onroute, .user_ctx = &_test_route_received[1]}};
+    aos_ws_client_config_t config = {
+        .on_data = test_ws_ondata,
+        .event_handler = test_ws_eventhandler,
+        .routes = routes,
+        .routes_len = 2,
+        .route_key_len = 2,
+        .mode = AOS_WS_CLIENT_MODE_SECURE_TEST,
+        .host = _test_host,
+        .path = "/raw"};
+    aos_task_t *client = aos_ws_client_alloc(&config);
+    TEST_ASSERT_NOT_NULL(client);
+
+    aos_future_t *start = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(start);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_start(client, start))));
+    aos_awaitable_free(start);
+
+    aos_future_t *connect = AOS_AWAITABLE_ALLOC_T(aos_ws_client_connect)(0);
+    TEST_ASSERT_NOT_NULL(connect);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_connect(client, connect))));
+    AOS_ARGS_T(aos_ws_client_connect) *connect_args = aos_args_get(connect);
+    TEST_ASSERT_EQUAL(0, connect_args->out_err);
+    aos_awaitable_free(connect);
+
+    // One echo per route, of different lengths, then one with an unknown key
+    static const char *messages[] = {"t1 route", "t2 other route", "t3 unrouted"};
+    for (size_t i = 0; i < sizeof(messages) / sizeof(messages[0]); i++)
+    {
+        char *data = strdup(messages[i]);
+        TEST_ASSERT_NOT_NULL(data);
+        aos_future_t *send = AOS_AWAITABLE_ALLOC_T(aos_ws_client_send_text)(data, 0);
+        TEST_ASSERT_NOT_NULL(send);
+        TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_send_text(client, send))));
+        AOS_ARGS_T(aos_ws_client_send_text) *send_args = aos_args_get(send);
+        TEST_ASSERT_EQUAL(0, send_args->out_err);
+        aos_awaitable_free(send);
+        free(data);
+    }
+
+    // Wait for responses
+    vTaskDelay(pdMS_TO_TICKS(300));
+    TEST_ASSERT_EQUAL(strlen(messages[0]), _test_route_received[0]);
+    TEST_ASSERT_EQUAL(strlen(messages[1]), _test_route_received[1]);
+    TEST_ASSERT_EQUAL(strlen(messages[2]), _test_received);
+
+    aos_future_t *stop = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(stop);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_stop(client, stop))));
+    aos_awaitable_free(stop);
+
+    aos_ws_client_free(client);
+
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    TEST_HEAP_STOP
+}
+
+TEST_CASE("Alloc duplicate routes", "[wsclient]")
+{
+    test_init();
+
+    TEST_HEAP_START
+
+    aos_ws_client_route_t routes[] = {
+        {.key = "t1", .on_data = test_ws_onroute, .user_ctx = &_test_route_received[0]},
+        {.key = "t1", .on_data = test_ws_onroute, .user_ctx = &_test_route_received[1]}};
+    aos_ws_client_config_t config = {
+        .on_data = test_ws_ondata,
+        .event_handler = test_ws_eventhandler,
+        .routes = routes,
+        .routes_len = 2,
+        .route_key_len = 2,
+        .host = _test_host};
+    TEST_ASSERT_NULL(aos_ws_client_alloc(&config));
+
+    TEST_HEAP_STOP
+}
+
+TEST_CASE("Connect/sendtext readahead/disconnect", "[wsclient]")
+{
+    test_init();
+
+    TEST_HEAP_START
+
+    _test_received = 0;
+    aos_ws_client_config_t config = {
+        .on_data = test_ws_ondata,
+        .event_handler = test_ws_eventhandler,
+        .readahead = true,
+        .mode = AOS_WS_CLIENT_MODE_SECURE_TEST,
+        .host = _test_host,
+        .path = "/raw"};
+    aos_task_t *client = aos_ws_client_alloc(&config);
+    TEST_ASSERT_NOT_NULL(client);
+
+    aos_future_t *start = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(start);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_start(client, start))));
+    aos_awaitable_free(start);
+
+    aos_future_t *connect = AOS_AWAITABLE_ALLOC_T(aos_ws_client_connect)(0);
+    TEST_ASSERT_NOT_NULL(connect);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_connect(client, connect))));
+    AOS_ARGS_T(aos_ws_client_connect) *connect_args = aos_args_get(connect);
+    TEST_ASSERT_EQUAL(0, connect_args->out_err);
+    aos_awaitable_free(connect);
+
+    // Several small messages in a row, echoed back as a burst
+    char *data = strdup("Hello world");
+    TEST_ASSERT_NOT_NULL(data);
+    for (int i = 0; i < 5; i++)
+    {
+        aos_future_t *send = AOS_AWAITABLE_ALLOC_T(aos_ws_client_send_text)(data, 0);
+        TEST_ASSERT_NOT_NULL(send);
+        TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_send_text(client, send))));
+        AOS_ARGS_T(aos_ws_client_send_text) *send_args = aos_args_get(send);
+        TEST_ASSERT_EQUAL(0, send_args->out_err);
+        aos_awaitable_free(send);
+    }
+
+    // Wait for response
+    vTaskDelay(pdMS_TO_TICKS(300));
+    TEST_ASSERT_EQUAL(5 * strlen(data), _test_received);
+    free(data);
+
+    aos_future_t *stop = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(stop);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_stop(client, stop))));
+    aos_awaitable_free(stop);
+
+    aos_ws_client_free(client);
+
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    TEST_HEAP_STOP
+}
+
+TEST_CASE("Connect/sendtext rx info/disconnect", "[wsclient]")
+{
+    test_init();
+
+    TEST_HEAP_START
+
+    _test_rx_infos = 0;
+    aos_ws_client_config_t config = {
+        .on_data_ex = test_ws_ondata_ex,
+        .on_data_ctx = &_test_rx_infos,
+        .event_handler = test_ws_eventhandler,
+        .mode = AOS_WS_CLIENT_MODE_SECURE_TEST,
+        .host = _test_host,
+        .path = "/raw"};
+    aos_task_t *client = aos_ws_client_alloc(&config);
+    TEST_ASSERT_NOT_NULL(client);
+
+    aos_future_t *start = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(start);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_start(client, start))));
+    aos_awaitable_free(start);
+
+    aos_future_t *connect = AOS_AWAITABLE_ALLOC_T(aos_ws_client_connect)(0);
+    TEST_ASSERT_NOT_NULL(connect);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_connect(client, connect))));
+    AOS_ARGS_T(aos_ws_client_connect) *connect_args = aos_args_get(connect);
+    TEST_ASSERT_EQUAL(0, connect_args->out_err);
+    aos_awaitable_free(connect);
+
+    // One text and one binary message, told apart by their opcode
+    char *data = strdup("Hello world");
+    TEST_ASSERT_NOT_NULL(data);
+    aos_future_t *send = AOS_AWAITABLE_ALLOC_T(aos_ws_client_send_text)(data, 0);
+    TEST_ASSERT_NOT_NULL(send);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_send_text(client, send))));
+    aos_awaitable_free(send);
+    vTaskDelay(pdMS_TO_TICKS(300));
+    send = AOS_AWAITABLE_ALLOC_T(aos_ws_client_send_binary)(data, 5, 0);
+    TEST_ASSERT_NOT_NULL(send);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_send_binary(client, send))));
+    aos_awaitable_free(send);
+
+    // Wait for response
+    vTaskDelay(pdMS_TO_TICKS(300));
+    TEST_ASSERT_EQUAL(2, _test_rx_infos);
+    TEST_ASSERT_EQUAL(1, _test_rx_info[0].opcode);
+    TEST_ASSERT_EQUAL(2, _test_rx_info[1].opcode);
+    TEST_ASSERT_TRUE(_test_rx_info[0].fin && _test_rx_info[1].fin);
+    TEST_ASSERT_EQUAL(strlen(data), _test_rx_info[0].frame_len);
+    TEST_ASSERT_EQUAL(5, _test_rx_info[1].frame_len);
+    TEST_ASSERT_EQUAL(0, _test_rx_info[1].offset);
+    printf("Read to callback: %lld us, %lld us\n", _test_rx_delay_us[0], _test_rx_delay_us[1]);
+    free(data);
+
+    aos_future_t *stop = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(stop);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_stop(client, stop))));
+    aos_awaitable_free(stop);
+
+    aos_ws_client_free(client);
+
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    TEST_HEAP_STOP
+}
+
+TEST_CASE("Connect/sendtext flow control/disconnect", "[wsclient]")
+{
+    test_init();
+
+    TEST_HEAP_START
+
+    _test_received = 0;
+    _test_backlog = 0;
+    _test_backlog_consume = false;
+    aos_ws_client_config_t config = {
+        .on_data = test_ws_ondata_backlog,
+        .event_handler = test_ws_eventhandler,
+        .rx_backlog = test_ws_rx_backlog,
+        .rx_high_water = 1,
+        .mode = AOS_WS_CLIENT_MODE_SECURE_TEST,
+        .host = _test_host,
+        .path = "/raw"};
+    aos_task_t *client = aos_ws_client_alloc(&config);
+    TEST_ASSERT_NOT_NULL(client);
+
+    aos_future_t *start = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(start);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_start(client, start))));
+    aos_awaitable_free(start);
+
+    aos_future_t *connect = AOS_AWAITABLE_ALLOC_T(aos_ws_client_connect)(0);
+    TEST_ASSERT_NOT_NULL(connect);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_connect(client, connect))));
+    AOS_ARGS_T(aos_ws_client_connect) *connect_args = aos_args_get(connect);
+    TEST_ASSERT_EQUAL(0, connect_args->out_err);
+    aos_awaitable_free(connect);
+
+    // Several small messages in a row, echoed back as a burst
+    char *data = strdup("Hello world");
+    TEST_ASSERT_NOT_NULL(data);
+    for (int i = 0; i < 5; i++)
+    {
+        aos_future_t *send = AOS_AWAITABLE_ALLOC_T(aos_ws_client_send_text)(data, 0);
+        TEST_ASSERT_NOT_NULL(send);
+        TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_send_text(client, send))));
+        AOS_ARGS_T(aos_ws_client_send_text) *send_args = aos_args_get(send);
+        TEST_ASSERT_EQUAL(0, send_args->out_err);
+        aos_awaitable_free(send);
+    }
+
+    // Only the first message is read until the backlog is consumed
+    vTaskDelay(pdMS_TO_TICKS(300));
+    TEST_ASSERT_EQUAL(strlen(data), _test_received);
+
+    aos_future_t *stats = AOS_AWAITABLE_ALLOC_T(aos_ws_client_stats_get)((aos_ws_client_stats_t){0});
+    TEST_ASSERT_NOT_NULL(stats);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_stats_get(client, stats))));
+    AOS_ARGS_T(aos_ws_client_stats_get) *stats_args = aos_args_get(stats);
+    TEST_ASSERT_TRUE(stats_args->out_stats.rx_paused);
+    TEST_ASSERT_EQUAL(1, stats_args->out_stats.rx_pauses);
+    aos_awaitable_free(stats);
+
+    // Consume everything from now on
+    _test_backlog = 0;
+    _test_backlog_consume = true;
+    vTaskDelay(pdMS_TO_TICKS(300));
+    TEST_ASSERT_EQUAL(5 * strlen(data), _test_received);
+    free(data);
+
+    aos_future_t *stop = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(stop);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_stop(client, stop))));
+    aos_awaitable_free(stop);
+
+    aos_ws_client_free(client);
+
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    TEST_HEAP_STOP
+}
+
+TEST_CASE("Connect/sendtext batch/disconnect", "[wsclient]")
+{
+    test_init();
+
+    TEST_HEAP_START
+
+    _test_received = 0;
+    _test_batches = 0;
+    aos_ws_client_config_t config = {
+        .on_data = test_ws_ondata,
+        .event_handler = test_ws_eventhandler,
+        .readahead = true,
+        .on_data_batch = test_ws_ondata_batch,
+        .batch_max_messages = 4,
+        .mode = AOS_WS_CLIENT_MODE_SECURE_TEST,
+        .host = _test_host,
+        .path = "/raw"};
+    aos_task_t *client = aos_ws_client_alloc(&config);
+    TEST_ASSERT_NOT_NULL(client);
+
+    aos_future_t *start = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(start);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_start(client, start))));
+    aos_awaitable_free(start);
+
+    aos_future_t *connect = AOS_AWAITABLE_ALLOC_T(aos_ws_client_connect)(0);
+    TEST_ASSERT_NOT_NULL(connect);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_connect(client, connect))));
+    AOS_ARGS_T(aos_ws_client_connect) *connect_args = aos_args_get(connect);
+    TEST_ASSERT_EQUAL(0, connect_args->out_err);
+    aos_awaitable_free(connect);
+
+    // Several small messages in a row, echoed back as a burst
+    char *data = strdup("Hello world");
+    TEST_ASSERT_NOT_NULL(data);
+    for (int i = 0; i < 5; i++)
+    {
+        aos_future_t *send = AOS_AWAITABLE_ALLOC_T(aos_ws_client_send_text)(data, 0);
+        TEST_ASSERT_NOT_NULL(send);
+        TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_send_text(client, send))));
+        AOS_ARGS_T(aos_ws_client_send_text) *send_args = aos_args_get(send);
+        TEST_ASSERT_EQUAL(0, send_args->out_err);
+        aos_awaitable_free(send);
+    }
+
+    // Wait for response
+    vTaskDelay(pdMS_TO_TICKS(300));
+    TEST_ASSERT_EQUAL(5 * strlen(data), _test_received);
+    TEST_ASSERT_GREATER_OR_EQUAL(2, _test_batches);
+    free(data);
+
+    aos_future_t *stop = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(stop);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_stop(client, stop))));
+    aos_awaitable_free(stop);
+
+    aos_ws_client_free(client);
+
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    TEST_HEAP_STOP
+}
+
+TEST_CASE("Connect/trysend/disconnect", "[wsclient]")
+{
+    test_init();
+
+    TEST_HEAP_START
+
+    _test_received = 0;
+    aos_ws_client_lane_t lanes[] = {
+        {.policy = AOS_WS_CLIENT_LANE_DROP_NEWEST, .depth = 2, .slot_size = 32},
+        {.policy = AOS_WS_CLIENT_LANE_COALESCE, .depth = 4, .slot_size = 32, .key_len = 5}};
+    aos_ws_client_config_t config = {
+        .on_data = test_ws_ondata,
+        .event_handler = test_ws_eventhandler,
+        .lanes = lanes,
+        .lanes_len = 2,
+        .mode = AOS_WS_CLIENT_MODE_SECURE_TEST,
+        .host = _test_host,
+        .path = "/raw"};
+    aos_task_t *client = aos_ws_client_alloc(&config);
+    TEST_ASSERT_NOT_NULL(client);
+
+    aos_future_t *start = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(start);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_start(client, start))));
+    aos_awaitable_free(start);
+
+    // Queued before connecting: messages with the same key are coalesced, the alarm overtakes the telemetry
+    TEST_ASSERT_EQUAL(0, aos_ws_client_try_send(client, 1, false, "temp=20", 7));
+    TEST_ASSERT_EQUAL(0, aos_ws_client_try_send(client, 1, false, "temp=21", 7));
+    TEST_ASSERT_EQUAL(0, aos_ws_client_try_send(client, 1, false, "hum=40", 6));
+    TEST_ASSERT_EQUAL(0, aos_ws_client_try_send(client, 0, false, "alarm", 5));
+
+    aos_future_t *connect = AOS_AWAITABLE_ALLOC_T(aos_ws_client_connect)(0);
+    TEST_ASSERT_NOT_NULL(connect);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_connect(client, connect))));
+    AOS_ARGS_T(aos_ws_client_connect) *connect_args = aos_args_get(connect);
+    TEST_ASSERT_EQUAL(0, connect_args->out_err);
+    aos_awaitable_free(connect);
+
+    // Wait for response
+    vTaskDelay(pdMS_TO_TICKS(300));
+    TEST_ASSERT_EQUAL(7 + 6 + 5, _test_received);
+
+    aos_future_t *stats = AOS_AWAITABLE_ALLOC_T(aos_ws_client_stats_get)((aos_ws_client_stats_t){0});
+    TEST_ASSERT_NOT_NULL(stats);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_stats_get(client, stats))));
+    AOS_ARGS_T(aos_ws_client_stats_get) *stats_args = aos_args_get(stats);
+    TEST_ASSERT_EQUAL(1, stats_args->out_stats.lanes[0].sent);
+    TEST_ASSERT_EQUAL(2, stats_args->out_stats.lanes[1].sent);
+    TEST_ASSERT_EQUAL(1, stats_args->out_stats.lanes[1].coalesced);
+    aos_awaitable_free(stats);
+
+    aos_future_t *stop = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(stop);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_stop(client, stop))));
+    aos_awaitable_free(stop);
+
+    aos_ws_client_free(client);
+
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    TEST_HEAP_STOP
+}
+
+TEST_CASE("Connect/sendtext rate limit/disconnect", "[wsclient]")
+{
+    test_init();
+
+    TEST_HEAP_START
+
+    _test_received = 0;
+    aos_ws_client_config_t config = {
+        .on_data = test_ws_ondata,
+        .event_handler = test_ws_eventhandler,
+        .rate_messages_per_s = 5,
+        .rate_burst_messages = 1,
+        .mode = AOS_WS_CLIENT_MODE_SECURE_TEST,
+        .host = _test_host,
+        .path = "/raw"};
+    aos_task_t *client = aos_ws_client_alloc(&config);
+    TEST_ASSERT_NOT_NULL(client);
+
+    aos_future_t *start = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(start);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_start(client, start))));
+    aos_awaitable_free(start);
+
+    aos_future_t *connect = AOS_AWAITABLE_ALLOC_T(aos_ws_client_connect)(0);
+    TEST_ASSERT_NOT_NULL(connect);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_connect(client, connect))));
+    AOS_ARGS_T(aos_ws_client_connect) *connect_args = aos_args_get(connect);
+    TEST_ASSERT_EQUAL(0, connect_args->out_err);
+    aos_awaitable_free(connect);
+
+    // One message every 200ms at most
+    int64_t begin = esp_timer_get_time();
+    char *data = strdup("Hello world");
+    TEST_ASSERT_NOT_NULL(data);
+    for (int i = 0; i < 5; i++)
+    {
+        aos_future_t *send = AOS_AWAITABLE_ALLOC_T(aos_ws_client_send_text)(data, 0);
+        TEST_ASSERT_NOT_NULL(send);
+        TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_send_text(client, send))));
+        AOS_ARGS_T(aos_ws_client_send_text) *send_args = aos_args_get(send);
+        TEST_ASSERT_EQUAL(0, send_args->out_err);
+        aos_awaitable_free(send);
+    }
+
+    TEST_ASSERT_GREATER_OR_EQUAL(800000, esp_timer_get_time() - begin);
+
+    aos_future_t *stats = AOS_AWAITABLE_ALLOC_T(aos_ws_client_stats_get)((aos_ws_client_stats_t){0});
+    TEST_ASSERT_NOT_NULL(stats);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_stats_get(client, stats))));
+    AOS_ARGS_T(aos_ws_client_stats_get) *stats_args = aos_args_get(stats);
+    TEST_ASSERT_EQUAL(4, stats_args->out_stats.rate_held);
+    TEST_ASSERT_GREATER_OR_EQUAL(700000, stats_args->out_stats.rate_delay_us);
+    aos_awaitable_free(stats);
+
+    // Wait for response
+    vTaskDelay(pdMS_TO_TICKS(300));
+    TEST_ASSERT_EQUAL(5 * strlen(data), _test_received);
+    free(data);
+
+    aos_future_t *stop = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(stop);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_stop(client, stop))));
+    aos_awaitable_free(stop);
+
+    aos_ws_client_free(client);
+
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    TEST_HEAP_STOP
+}
+
+TEST_CASE("Connect/disconnect lazy", "[wsclient]")
+{
+    test_init();
+
+    TEST_HEAP_START
+
+    aos_ws_client_config_t config = {
+        .on_data = test_ws_ondata,
+        .event_handler = test_ws_eventhandler,
+        .lazy_resources = true,
+        .mode = AOS_WS_CLIENT_MODE_SECURE_TEST,
+        .host = _test_host,
+        .path = "/raw"};
+    aos_task_t *client = aos_ws_client_alloc(&config);
+    TEST_ASSERT_NOT_NULL(client);
+
+    aos_future_t *start = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(start);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_start(client, start))));
+    aos_awaitable_free(start);
+
+    aos_future_t *connect = AOS_AWAITABLE_ALLOC_T(aos_ws_client_connect)(0);
+    TEST_ASSERT_NOT_NULL(connect);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_connect(client, connect))));
+    AOS_ARGS_T(aos_ws_client_connect) *connect_args = aos_args_get(connect);
+    TEST_ASSERT_EQUAL(0, connect_args->out_err);
+    aos_awaitable_free(connect);
+
+    aos_future_t *disconnect = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(disconnect);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_disconnect(client, disconnect))));
+    aos_awaitable_free(disconnect);
+
+    // Transports and buffer are released once disconnected
+    aos_future_t *stats = AOS_AWAITABLE_ALLOC_T(aos_ws_client_stats_get)((aos_ws_client_stats_t){0});
+    TEST_ASSERT_NOT_NULL(stats);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_stats_get(client, stats))));
+    AOS_ARGS_T(aos_ws_client_stats_get) *stats_args = aos_args_get(stats);
+    printf("Released while disconnected: %u bytes\n", stats_args->out_stats.resources_size);
+    TEST_ASSERT_FALSE(stats_args->out_stats.resources_allocated);
+    TEST_ASSERT_GREATER_THAN(CONFIG_AOS_WS_CLIENT_BUFFERSIZE_DEFAULT, stats_args->out_stats.resources_size);
+    aos_awaitable_free(stats);
+
+    aos_future_t *stop = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(stop);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_stop(client, stop))));
+    aos_awaitable_free(stop);
+
+    aos_ws_client_free(client);
+
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    TEST_HEAP_STOP
+}
+
+TEST_CASE("Connect/disconnect endpoints", "[wsclient]")
+{
+    test_init();
+
+    TEST_HEAP_START
+
+    // The first endpoint never resolves, the client moves on to the next one
+    aos_ws_client_endpoint_t endpoints[] = {
+        {.host = "unreachable.invalid"},
+        {.host = _test_host}};
+    aos_ws_client_config_t config = {
+        .on_data = test_ws_ondata,
+        .event_handler = test_ws_eventhandler,
+        .retry_interval_ms = 500,
+        .mode = AOS_WS_CLIENT_MODE_SECURE_TEST,
+        .path = "/raw",
+        .endpoints = endpoints,
+        .endpoints_len = 2};
+    aos_task_t *client = aos_ws_client_alloc(&config);
+    TEST_ASSERT_NOT_NULL(client);
+
+    aos_future_t *start = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(start);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_start(client, start))));
+    aos_awaitable_free(start);
+
+    aos_future_t *connect = AOS_AWAITABLE_ALLOC_T(aos_ws_client_connect)(0);
+    TEST_ASSERT_NOT_NULL(connect);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_connect(client, connect))));
+    AOS_ARGS_T(aos_ws_client_connect) *connect_args = aos_args_get(connect);
+    TEST_ASSERT_EQUAL(0, connect_args->out_err);
+    aos_awaitable_free(connect);
+
+    aos_future_t *stats = AOS_AWAITABLE_ALLOC_T(aos_ws_client_stats_get)((aos_ws_client_stats_t){0});
+    TEST_ASSERT_NOT_NULL(stats);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_stats_get(client, stats))));
+    AOS_ARGS_T(aos_ws_client_stats_get) *stats_args = aos_args_get(stats);
+    printf("Endpoint %u, handshake %u us\n", stats_args->out_stats.endpoint, stats_args->out_stats.endpoints[1].rtt_us);
+    TEST_ASSERT_EQUAL(1, stats_args->out_stats.endpoint);
+    TEST_ASSERT_EQUAL(1, stats_args->out_stats.endpoint_switches);
+    TEST_ASSERT_TRUE(stats_args->out_stats.endpoints[0].down);
+    TEST_ASSERT_EQUAL(2, stats_args->out_stats.endpoints[0].failures);
+    TEST_ASSERT_EQUAL(1, stats_args->out_stats.endpoints[1].connections);
+    TEST_ASSERT_GREATER_THAN(0, stats_args->out_stats.endpoints[1].rtt_us);
+    aos_awaitable_free(stats);
+
+    aos_future_t *disconnect = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(disconnect);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_disconnect(client, disconnect))));
+    aos_awaitable_free(disconnect);
+
+    aos_future_t *stop = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(stop);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_stop(client, stop))));
+    aos_awaitable_free(stop);
+
+    aos_ws_client_free(client);
+
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    TEST_HEAP_STOP
+}
+
+TEST_CASE("Connect/sendtext max fragment length/disconnect", "[wsclient]")
+{
+    test_init();
+
+    TEST_HEAP_START
+
+    // Same exchange with full size records, then 1KB records if the server agrees
+    static const uint16_t lengths[] = {0, 1024};
+    size_t connection_size[2] = {0};
+    for (int i = 0; i < 2; i++)
+    {
+        aos_ws_client_config_t config = {
+            .on_data = test_ws_ondata,
+            .event_handler = test_ws_eventhandler,
+            .server_cert_chain_pem = (const char *)server_root_cert_pem_start,
+            .mode = AOS_WS_CLIENT_MODE_SECURE_TEST,
+            .host = _test_host,
+            .path = "/raw",
+            .tls_max_fragment_len = lengths[i]};
+        aos_task_t *client = aos_ws_client_alloc(&config);
+        TEST_ASSERT_NOT_NULL(client);
+
+        aos_future_t *start = aos_awaitable_alloc(0);
+        TEST_ASSERT_NOT_NULL(start);
+        TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_start(client, start))));
+        aos_awaitable_free(start);
+
+        aos_future_t *connect = AOS_AWAITABLE_ALLOC_T(aos_ws_client_connect)(0);
+        TEST_ASSERT_NOT_NULL(connect);
+        TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_connect(client, connect))));
+        AOS_ARGS_T(aos_ws_client_connect) *connect_args = aos_args_get(connect);
+        TEST_ASSERT_EQUAL(0, connect_args->out_err);
+        aos_awaitable_free(connect);
+
+        aos_future_t *send = AOS_AWAITABLE_ALLOC_T(aos_ws_client_send_text)("Hello, fragments!", 0);
+        TEST_ASSERT_NOT_NULL(send);
+        TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_send_text(client, send))));
+        AOS_ARGS_T(aos_ws_client_send_text) *send_args = aos_args_get(send);
+        TEST_ASSERT_EQUAL(0, send_args->out_err);
+        aos_awaitable_free(send);
+
+        vTaskDelay(pdMS_TO_TICKS(1000));
+
+        aos_future_t *stats = AOS_AWAITABLE_ALLOC_T(aos_ws_client_stats_get)((aos_ws_client_stats_t){0});
+        TEST_ASSERT_NOT_NULL(stats);
+        TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_stats_get(client, stats))));
+        AOS_ARGS_T(aos_ws_client_stats_get) *stats_args = aos_args_get(stats);
+        connection_size[i] = stats_args->out_stats.connection_size;
+        TEST_ASSERT_GREATER_THAN(0, connection_size[i]);
+        aos_awaitable_free(stats);
+
+        aos_future_t *disconnect = aos_awaitable_alloc(0);
+        TEST_ASSERT_NOT_NULL(disconnect);
+        TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_disconnect(client, disconnect))));
+        aos_awaitable_free(disconnect);
+
+        aos_future_t *stop = aos_awaitable_alloc(0);
+        TEST_ASSERT_NOT_NULL(stop);
+        TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_stop(client, stop))));
+        aos_awaitable_free(stop);
+
+        aos_ws_client_free(client);
+    }
+    printf("Connection size: %u bytes with 16KB records, %u bytes with 1KB records\n", connection_size[0], connection_size[1]);
+
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    TEST_HEAP_STOP
+}
+
+TEST_CASE("Connect shared certs benchmark", "[wsclient]")
+{
+    test_init();
+
+    TEST_HEAP_START
+
+    // Parsing is what shared certs save on each connect, the handshake and its verification are the same
+    int64_t parse_us = esp_timer_get_time();
+    aos_ws_client_certs_t *certs = aos_ws_client_certs_alloc((const char *)server_root_cert_pem_start, NULL, NULL);
+    parse_us = esp_timer_get_time() - parse_us;
+    TEST_ASSERT_NOT_NULL(certs);
+
+    // Same connections, with the PEM chain parsed into each connection first, then parsed once and shared
+    size_t connect_heap[2] = {0};
+    for (int shared = 0; shared < 2; shared++)
+    {
+        aos_ws_client_config_t config = {
+            .on_data = test_ws_ondata,
+            .event_handler = test_ws_eventhandler,
+            .server_cert_chain_pem = shared ? NULL : (const char *)server_root_cert_pem_start,
+            .certs = shared ? certs : NULL,
+            .mode = AOS_WS_CLIENT_MODE_SECURE_TEST,
+            .host = _test_host,
+            .path = "/raw"};
+        aos_task_t *client = aos_ws_client_alloc(&config);
+        TEST_ASSERT_NOT_NULL(client);
+
+        aos_future_t *start = aos_awaitable_alloc(0);
+        TEST_ASSERT_NOT_NULL(start);
+        TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_start(client, start))));
+        aos_awaitable_free(start);
+
+        for (int i = 0; i < 3; i++)
+        {
+            aos_future_t *connect = AOS_AWAITABLE_ALLOC_T(aos_ws_client_connect)(0);
+            TEST_ASSERT_NOT_NULL(connect);
+            size_t free_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+            TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_connect(client, connect))));
+            connect_heap[shared] += free_before - heap_caps_get_free_size(MALLOC_CAP_8BIT);
+            AOS_ARGS_T(aos_ws_client_connect) *connect_args = aos_args_get(connect);
+            TEST_ASSERT_EQUAL(0, connect_args->out_err);
+            aos_awaitable_free(connect);
+
+            aos_future_t *disconnect = aos_awaitable_alloc(0);
+            TEST_ASSERT_NOT_NULL(disconnect);
+            TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_disconnect(client, disconnect))));
+            aos_awaitable_free(disconnect);
+        }
+
+        aos_future_t *stop = aos_awaitable_alloc(0);
+        TEST_ASSERT_NOT_NULL(stop);
+        TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_stop(client, stop))));
+        aos_awaitable_free(stop);
+
+        aos_ws_client_free(client);
+    }
+    aos_ws_client_certs_free(certs);
+    printf("Parse time saved per connect: %lld us\n", parse_us);
+    printf("Average connection heap: %u bytes with PEM, %u bytes with shared certs\n", connect_heap[0] / 3, connect_heap[1] / 3);
+    TEST_ASSERT_LESS_THAN(connect_heap[0], connect_heap[1]);
+
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    TEST_HEAP_STOP
+}
+
+TEST_CASE("Connect/encode in place/disconnect", "[wsclient]")
+{
+    test_init();
+
+    TEST_HEAP_START
+
+    aos_ws_client_config_t config = {
+        .on_data = test_ws_ondata,
+        .event_handler = test_ws_eventhandler,
+        .tx_frames = 2,
+        .tx_frame_size = 64,
+        .mode = AOS_WS_CLIENT_MODE_SECURE_TEST,
+        .host = _test_host,
+        .path = "/raw"};
+    aos_task_t *client = aos_ws_client_alloc(&config);
+    TEST_ASSERT_NOT_NULL(client);
+
+    aos_future_t *start = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(start);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_start(client, start))));
+    aos_awaitable_free(start);
+
+    aos_future_t *connect = AOS_AWAITABLE_ALLOC_T(aos_ws_client_connect)(0);
+    TEST_ASSERT_NOT_NULL(connect);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_connect(client, connect))));
+    AOS_ARGS_T(aos_ws_client_connect) *connect_args = aos_args_get(connect);
+    TEST_ASSERT_EQUAL(0, connect_args->out_err);
+    aos_awaitable_free(connect);
+
+    // One CBOR and one MessagePack message, then one that does not fit
+    aos_ws_client_encoder_t encoder;
+    TEST_ASSERT_EQUAL(0, aos_ws_client_encode_begin(client, &encoder));
+    aos_ws_client_cbor_map(&encoder, 2);
+    aos_ws_client_cbor_text(&encoder, "temp", 4);
+    aos_ws_client_cbor_float(&encoder, 21.5f);
+    aos_ws_client_cbor_text(&encoder, "uptime", 6);
+    aos_ws_client_cbor_uint(&encoder, esp_timer_get_time() / 1000);
+    TEST_ASSERT_EQUAL(0, aos_ws_client_encode_end(&encoder));
+
+    TEST_ASSERT_EQUAL(0, aos_ws_client_encode_begin(client, &encoder));
+    aos_ws_client_msgpack_array(&encoder, 3);
+    aos_ws_client_msgpack_int(&encoder, -40);
+    aos_ws_client_msgpack_str(&encoder, "ok", 2);
+    aos_ws_client_msgpack_bool(&encoder, true);
+    TEST_ASSERT_EQUAL(0, aos_ws_client_encode_end(&encoder));
+
+    // Wait for both frames to be written and echoed
+    vTaskDelay(pdMS_TO_TICKS(300));
+
+    TEST_ASSERT_EQUAL(0, aos_ws_client_encode_begin(client, &encoder));
+    TEST_ASSERT_NULL(aos_ws_client_encode_reserve(&encoder, 65));
+    TEST_ASSERT_NOT_EQUAL(0, aos_ws_client_encode_end(&encoder));
+
+    aos_future_t *stats = AOS_AWAITABLE_ALLOC_T(aos_ws_client_stats_get)((aos_ws_client_stats_t){0});
+    TEST_ASSERT_NOT_NULL(stats);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_stats_get(client, stats))));
+    AOS_ARGS_T(aos_ws_client_stats_get) *stats_args = aos_args_get(stats);
+    TEST_ASSERT_EQUAL(2, stats_args->out_stats.tx_encoded);
+    TEST_ASSERT_EQUAL(0, stats_args->out_stats.tx_refused);
+    aos_awaitable_free(stats);
+
+    aos_future_t *stop = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(stop);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_stop(client, stop))));
+    aos_awaitable_free(stop);
+
+    aos_ws_client_free(client);
+
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    TEST_HEAP_STOP
+}
+
+#if CONFIG_AOS_WS_CLIENT_SIZING
+TEST_CASE("Connect/sendtext sizing/disconnect", "[wsclient]")
+{
+    test_init();
+
+    TEST_HEAP_START
+
+    aos_ws_client_config_t config = {
+        .on_data = test_ws_ondata,
+        .event_handler = test_ws_eventhandler,
+        .mode = AOS_WS_CLIENT_MODE_SECURE_TEST,
+        .host = _test_host,
+        .path = "/raw"};
+    aos_task_t *client = aos_ws_client_alloc(&config);
+    TEST_ASSERT_NOT_NULL(client);
+
+    aos_future_t *start = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(start);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_start(client, start))));
+    aos_awaitable_free(start);
+
+    aos_future_t *connect = AOS_AWAITABLE_ALLOC_T(aos_ws_client_connect)(0);
+    TEST_ASSERT_NOT_NULL(connect);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_connect(client, connect))));
+    AOS_ARGS_T(aos_ws_client_connect) *connect_args = aos_args_get(connect);
+    TEST_ASSERT_EQUAL(0, connect_args->out_err);
+    aos_awaitable_free(connect);
+
+    char *data = strdup("Hello world");
+    TEST_ASSERT_NOT_NULL(data);
+    aos_future_t *send = AOS_AWAITABLE_ALLOC_T(aos_ws_client_send_text)(data, 0);
+    TEST_ASSERT_NOT_NULL(send);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_send_text(client, send))));
+    AOS_ARGS_T(aos_ws_client_send_text) *send_args = aos_args_get(send);
+    TEST_ASSERT_EQUAL(0, send_args->out_err);
+    aos_awaitable_free(send);
+    free(data);
+
+    // Wait for response
+    vTaskDelay(pdMS_TO_TICKS(300));
+
+    aos_future_t *stats = AOS_AWAITABLE_ALLOC_T(aos_ws_client_stats_get)((aos_ws_client_stats_t){0});
+    TEST_ASSERT_NOT_NULL(stats);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_stats_get(client, stats))));
+    AOS_ARGS_T(aos_ws_client_stats_get) *stats_args = aos_args_get(stats);
+    aos_ws_client_stats_t *out = &stats_args->out_stats;
+    printf("Stack free: %u, queue peak: %u, rx fill peak: %u, rx frame max: %u\n", out->stack_free_min, out->queue_peak, out->rx_fill_peak, out->rx_frame_max);
+    printf("Recommended stacksize: %u, queuesize: %u, buffer_size: %u\n", out->recommended_stacksize, out->recommended_queuesize, out->recommended_buffer_size);
+    TEST_ASSERT_GREATER_THAN(0, out->stack_free_min);
+    TEST_ASSERT_GREATER_OR_EQUAL(1, out->queue_peak);
+    TEST_ASSERT_EQUAL(strlen("Hello world"), out->rx_frame_max);
+    TEST_ASSERT_LESS_OR_EQUAL(CONFIG_AOS_WS_CLIENT_TASK_STACKSIZE_DEFAULT + CONFIG_AOS_WS_CLIENT_TASK_STACKSIZE_DEFAULT / 4 + 128, out->recommended_stacksize);
+    TEST_ASSERT_GREATER_OR_EQUAL(out->rx_frame_max, out->recommended_buffer_size);
+    aos_awaitable_free(stats);
+
+    aos_future_t *stop = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(stop);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_stop(client, stop))));
+    aos_awaitable_free(stop);
+
+    aos_ws_client_free(client);
+
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    TEST_HEAP_STOP
+}
+#endif
+
+#if CONFIG_AOS_WS_CLIENT_PROFILE
+TEST_CASE("Connect/sendtext profile/disconnect", "[wsclient]")
+{
+    test_init();
+
+    TEST_HEAP_START
+
+    aos_ws_client_config_t config = {
+        .on_data = test_ws_ondata,
+        .event_handler = test_ws_eventhandler,
+        .mode = AOS_WS_CLIENT_MODE_SECURE_TEST,
+        .host = _test_host,
+        .path = "/raw"};
+    aos_task_t *client = aos_ws_client_alloc(&config);
+    TEST_ASSERT_NOT_NULL(client);
+
+    aos_future_t *start = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(start);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_start(client, start))));
+    aos_awaitable_free(start);
+
+    aos_future_t *connect = AOS_AWAITABLE_ALLOC_T(aos_ws_client_connect)(0);
+    TEST_ASSERT_NOT_NULL(connect);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_connect(client, connect))));
+    AOS_ARGS_T(aos_ws_client_connect) *connect_args = aos_args_get(connect);
+    TEST_ASSERT_EQUAL(0, connect_args->out_err);
+    aos_awaitable_free(connect);
+
+    char *data = strdup("Hello world");
+    TEST_ASSERT_NOT_NULL(data);
+    aos_future_t *send = AOS_AWAITABLE_ALLOC_T(aos_ws_client_send_text)(data, 0);
+    TEST_ASSERT_NOT_NULL(send);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_send_text(client, send))));
+    AOS_ARGS_T(aos_ws_client_send_text) *send_args = aos_args_get(send);
+    TEST_ASSERT_EQUAL(0, send_args->out_err);
+    aos_awaitable_free(send);
+    free(data);
+
+    // Wait for response
+    vTaskDelay(pdMS_TO_TICKS(300));
+
+    // Every stage ran at least once for the echo
+    aos_future_t *stats = AOS_AWAITABLE_ALLOC_T(aos_ws_client_stats_get)((aos_ws_client_stats_t){0});
+    TEST_ASSERT_NOT_NULL(stats);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_stats_get(client, stats))));
+    AOS_ARGS_T(aos_ws_client_stats_get) *stats_args = aos_args_get(stats);
+    for (aos_ws_client_stage_t stage = 0; stage < AOS_WS_CLIENT_STAGE_MAX; stage++)
+    {
+        aos_ws_client_stage_stats_t *stage_stats = &stats_args->out_stats.stages[stage];
+        printf("Stage %u: count %u, min %u us, max %u us\n", stage, stage_stats->count, stage_stats->min_us, stage_stats->max_us);
+        TEST_ASSERT_GREATER_THAN(0, stage_stats->count);
+        TEST_ASSERT_LESS_OR_EQUAL(stage_stats->max_us, stage_stats->min_us);
+        uint32_t samples = 0;
+        for (size_t i = 0; i < AOS_WS_CLIENT_STAGE_HISTOGRAM_BUCKETS; i++)
+        {
+            samples += stage_stats->histogram[i];
+        }
+        TEST_ASSERT_EQUAL(stage_stats->count, samples);
+    }
+    aos_awaitable_free(stats);
+
+    aos_future_t *stop = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(stop);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_stop(client, stop))));
+    aos_awaitable_free(stop);
+
+    aos_ws_client_free(client);
+
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    TEST_HEAP_STOP
+}
+#endif
+
+#if CONFIG_AOS_WS_CLIENT_TRACE
+TEST_CASE("Connect/sendtext trace/disconnect", "[wsclient]")
+{
+    test_init();
+
+    TEST_HEAP_START
+
+    aos_ws_client_config_t config = {
+        .on_data = test_ws_ondata,
+        .event_handler = test_ws_eventhandler,
+        .mode = AOS_WS_CLIENT_MODE_SECURE_TEST,
+        .host = _test_host,
+        .path = "/raw"};
+    aos_task_t *client = aos_ws_client_alloc(&config);
+    TEST_ASSERT_NOT_NULL(client);
+
+    aos_future_t *start = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(start);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_start(client, start))));
+    aos_awaitable_free(start);
+
+    aos_future_t *connect = AOS_AWAITABLE_ALLOC_T(aos_ws_client_connect)(0);
+    TEST_ASSERT_NOT_NULL(connect);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_connect(client, connect))));
+    AOS_ARGS_T(aos_ws_client_connect) *connect_args = aos_args_get(connect);
+    TEST_ASSERT_EQUAL(0, connect_args->out_err);
+    aos_awaitable_free(connect);
+
+    char *data = strdup("Hello world");
+    TEST_ASSERT_NOT_NULL(data);
+    aos_future_t *send = AOS_AWAITABLE_ALLOC_T(aos_ws_client_send_text)(data, 0);
+    TEST_ASSERT_NOT_NULL(send);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_send_text(client, send))));
+    AOS_ARGS_T(aos_ws_client_send_text) *send_args = aos_args_get(send);
+    TEST_ASSERT_EQUAL(0, send_args->out_err);
+    aos_awaitable_free(send);
+    free(data);
+
+    // Wait for response
+    vTaskDelay(pdMS_TO_TICKS(300));
+
+    // The send is the last request enqueued, its echo must follow in order
+    static aos_ws_client_trace_entry_t entries[CONFIG_AOS_WS_CLIENT_TRACE_ENTRIES];
+    size_t entries_len = aos_ws_client_trace_dump(client, entries, CONFIG_AOS_WS_CLIENT_TRACE_ENTRIES);
+    size_t i = entries_len;
+    while (i && entries[i - 1].event != AOS_WS_CLIENT_TRACE_ENQUEUE)
+    {
+        i--;
+    }
+    TEST_ASSERT_GREATER_THAN(0, i);
+    i--;
+    static const aos_ws_client_trace_event_t expected[] = {AOS_WS_CLIENT_TRACE_ENQUEUE, AOS_WS_CLIENT_TRACE_WRITE_START, AOS_WS_CLIENT_TRACE_WRITE_END, AOS_WS_CLIENT_TRACE_READ, AOS_WS_CLIENT_TRACE_DISPATCH};
+    uint32_t timestamp_us = entries[i].timestamp_us;
+    for (size_t e = 0; e < sizeof(expected) / sizeof(expected[0]); e++)
+    {
+        while (i < entries_len && entries[i].event != expected[e])
+        {
+            i++;
+        }
+        TEST_ASSERT_LESS_THAN(entries_len, i);
+        TEST_ASSERT_GREATER_OR_EQUAL(0, (int32_t)(entries[i].timestamp_us - timestamp_us));
+        if (e)
+        {
+            // Empty reads are not traced
+            TEST_ASSERT_NOT_EQUAL(0, entries[i].data_len);
+        }
+        timestamp_us = entries[i].timestamp_us;
+    }
+    TEST_ASSERT_EQUAL(1, entries[i].opcode);
+    TEST_ASSERT_EQUAL(strlen("Hello world"), entries[i].data_len);
+
+    aos_future_t *stop = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(stop);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_stop(client, stop))));
+    aos_awaitable_free(stop);
+
+    aos_ws_client_free(client);
+
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    TEST_HEAP_STOP
+}
+#endif
+
+TEST_CASE("Connect / wait for press / disconnect", "[wsclient]")
+{
+    test_init();
+
+    TEST_HEAP_START
+
+    aos_ws_client_config_t config = {
+        .on_data = test_ws_ondata,
+        .event_handler = test_ws_eventhandler,
+        .mode = AOS_WS_CLIENT_MODE_SECURE_TEST,
+        .host = _test_host,
+        .path = "/raw"};
+    aos_task_t *client = aos_ws_client_alloc(&config);
+    TEST_ASSERT_NOT_NULL(client);
+
+    aos_future_t *start = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(start);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_start(client, start))));
+    aos_awaitable_free(start);
+
+    aos_future_t *connect = AOS_AWAITABLE_ALLOC_T(aos_ws_client_connect)(0);
+    TEST_ASSERT_NOT_NULL(connect);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_connect(client, connect))));
+    AOS_ARGS_T(aos_ws_client_connect) *connect_args = aos_args_get(connect);
+    TEST_ASSERT_EQUAL(0, connect_args->out_err);
+    aos_awaitable_free(connect);
+
+    printf("Press q when satisfied\n");
+    while (fgetc(stdin) != 'q')
+        ;
+
+    aos_future_t *stop = aos_awaitable_alloc(0);
+    TEST_ASSERT_NOT_NULL(stop);
+    TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_task_stop(client, stop))));
+    aos_awaitable_free(stop);
+
+    aos_ws_client_free(client);
+
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    TEST_HEAP_STOP
+}
+
+TEST_CASE("Fault injection", "[wsclient][fault]")
+{
+    test_init();
+    test_lan_host_check();
+
+    TEST_HEAP_START
+
+    // Run tools/aos_ws_faultlab.py on _test_lan_host first, it ends the test once all scenarios are done
+    aos_ws_client_config_t config = {
+        .on_data = test_ws_ondata_fault,
+        .event_handler = test_ws_eventhandler_fault,
+        .retry_interval_ms = 500,
+        .mode = AOS_WS_CLIENT_MODE_INSECURE,
+        .host = _test_lan_host,
+        .port = _test_fault_port,
+        .path = "/raw"};
+    aos_task_t *client = test_client_connect(&config);
+
+    // Numbered messages every 50ms, with what the harness needs to measure recovery
+    _test_fault_end = false;
+    _test_fault_detected_ms = 0;
+    uint32_t seq = 0;
+    uint32_t failed = 0;
+    int64_t begin = esp_timer_get_time();
+    while (!_test_fault_end && esp_timer_get_time() - begin < 15 * 60 * 1000000LL)
+    {
+        char data[80];
+        snprintf(data, sizeof(data), "seq %u %lld %u %u %lld", ++seq, esp_timer_get_time() / 1000, failed, heap_caps_get_free_size(MALLOC_CAP_8BIT), _test_fault_detected_ms);
+        aos_future_t *send = AOS_AWAITABLE_ALLOC_T(aos_ws_client_send_text)(data, 0);
+        TEST_ASSERT_NOT_NULL(send);
+        TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_send_text(client, send))));
+        AOS_ARGS_T(aos_ws_client_send_text) *send_args = aos_args_get(send);
+        if (send_args->out_err)
+            failed++;
+        aos_awaitable_free(send);
+        vTaskDelay(pdMS_TO_TICKS(50));
+    }
+    printf("Sent %u messages, %u failed\n", seq, failed);
+    TEST_ASSERT_TRUE(_test_fault_end);
+
+    test_client_free(client);
+
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    TEST_HEAP_STOP
+}
+
+static aos_ws_client_stats_t test_session_run(aos_ws_client_config_t *config)
+{
+    aos_task_t *client = test_client_connect(config);
+
+    // Every message is echoed exactly once and in order, even though the server drops the connection
+    _test_session_echoes = 0;
+    _test_session_misordered = 0;
+    for (uint32_t i = 1; i <= 50; i++)
+    {
+        char data[16];
+        snprintf(data, sizeof(data), "msg %u", i);
+        aos_future_t *send = AOS_AWAITABLE_ALLOC_T(aos_ws_client_send_text)(data, 0);
+        TEST_ASSERT_NOT_NULL(send);
+        TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_send_text(client, send))));
+        AOS_ARGS_T(aos_ws_client_send_text) *send_args = aos_args_get(send);
+        TEST_ASSERT_EQUAL(0, send_args->out_err);
+        aos_awaitable_free(send);
+        vTaskDelay(pdMS_TO_TICKS(50));
+    }
+    int64_t begin = esp_timer_get_time();
+    while (_test_session_echoes < 50 && esp_timer_get_time() - begin < 30 * 1000000LL)
+        vTaskDelay(pdMS_TO_TICKS(100));
+    vTaskDelay(pdMS_TO_TICKS(500));
+    TEST_ASSERT_EQUAL(50, _test_session_echoes);
+    TEST_ASSERT_EQUAL(0, _test_session_misordered);
+
+    aos_ws_client_stats_t stats = test_client_stats(client);
+    TEST_ASSERT_EQUAL(0, stats.session_unacked);
+
+    test_client_free(client);
+    return stats;
+}
+
+TEST_CASE("Session resume", "[wsclient][session]")
+{
+    test_init();
+    test_lan_host_check();
+
+    TEST_HEAP_START
+
+    // Run tools/aos_ws_session_server.py --drop-every 20 on _test_lan_host first
+    aos_ws_client_config_t config = {
+        .on_data = test_ws_ondata_session,
+        .event_handler = test_ws_eventhandler,
+        .retry_interval_ms = 500,
+        .mode = AOS_WS_CLIENT_MODE_INSECURE,
+        .host = _test_lan_host,
+        .port = _test_session_port,
+        .session_window = 64,
+        .session_slot_size = 32};
+    aos_ws_client_stats_t stats = test_session_run(&config);
+    printf("Replayed %u, duplicates %u\n", stats.session_replayed, stats.session_duplicates);
+    TEST_ASSERT_TRUE(stats.session_replayed > 0);
+
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    TEST_HEAP_STOP
+}
+
+TEST_CASE("Session resume standby", "[wsclient][session]")
+{
+    test_init();
+    test_lan_host_check();
+
+    TEST_HEAP_START
+
+    // Same as above, but the drops are taken over by the standby instead of a reconnection
+    aos_ws_client_config_t config = {
+        .on_data = test_ws_ondata_session,
+        .event_handler = test_ws_eventhandler,
+        .retry_interval_ms = 500,
+        .mode = AOS_WS_CLIENT_MODE_INSECURE,
+        .host = _test_lan_host,
+        .port = _test_session_port,
+        .session_window = 64,
+        .session_slot_size = 32,
+        .standby = true,
+        .standby_delay_ms = 100};
+    aos_ws_client_stats_t stats = test_session_run(&config);
+    printf("Failovers %u, last %uus, standby builds %u\n", stats.standby_failovers, stats.standby_failover_us, stats.standby_builds);
+    TEST_ASSERT_TRUE(stats.standby_failovers > 0);
+
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    TEST_HEAP_STOP
+}
+
+#if CONFIG_HTTPD_WS_SUPPORT
+TEST_CASE("Tuning presets benchmark", "[wsclient][bench]")
+{
+    test_init();
+
+    TEST_HEAP_START
+
+    // Against an echo server on the device itself (requires CONFIG_LWIP_NETIF_LOOPBACK), no network in the way
+    httpd_handle_t server = test_loopback_start();
+    static const char *names[] = {"none", "interactive", "bulk", "low-power"};
+    static uint8_t bulk[1024];
+    uint32_t rtt_us[AOS_WS_CLIENT_TUNING_LOW_POWER + 1];
+    _test_bench_echo = xSemaphoreCreateCounting(100, 0);
+    TEST_ASSERT_NOT_NULL(_test_bench_echo);
+    printf("%-12s %-10s %-10s %-10s\n", "preset", "rtt_us", "kB/s", "nodelay");
+    for (aos_ws_client_tuning_t tuning = AOS_WS_CLIENT_TUNING_NONE; tuning <= AOS_WS_CLIENT_TUNING_LOW_POWER; tuning++)
+    {
+        aos_ws_client_config_t config = {
+            .on_data = test_ws_ondata_bench,
+            .event_handler = test_ws_eventhandler,
+            .mode = AOS_WS_CLIENT_MODE_INSECURE,
+            .host = "127.0.0.1",
+            .port = _test_loopback_port,
+            .buffer_size = 2048,
+            .queuesize = 8,
+            .tuning = tuning};
+        aos_task_t *client = test_client_connect(&config);
+
+        // Round trips of small frames, where Nagle's algorithm holds back the payload behind the header
+        int64_t begin = esp_timer_get_time();
+        for (uint32_t i = 0; i < 50; i++)
+        {
+            aos_future_t *send = AOS_AWAITABLE_ALLOC_T(aos_ws_client_send_text)("0123456789abcdef", 0);
+            TEST_ASSERT_NOT_NULL(send);
+            TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_send_text(client, send))));
+            aos_awaitable_free(send);
+            TEST_ASSERT_TRUE(xSemaphoreTake(_test_bench_echo, pdMS_TO_TICKS(5000)));
+        }
+        rtt_us[tuning] = (esp_timer_get_time() - begin) / 50;
+
+        // Back to back large frames, echoes counted as they come back
+        begin = esp_timer_get_time();
+        uint32_t echoes = 0;
+        for (uint32_t i = 0; i < 100; i++)
+        {
+            aos_future_t *send = AOS_AWAITABLE_ALLOC_T(aos_ws_client_send_binary)(bulk, sizeof(bulk), 0);
+            TEST_ASSERT_NOT_NULL(send);
+            TEST_ASSERT_TRUE(aos_isresolved(aos_await(aos_ws_client_send_binary(client, send))));
+            aos_awaitable_free(send);
+            while (xSemaphoreTake(_test_bench_echo, 0))
+                echoes++;
+        }
+        while (echoes < 100 && xSemaphoreTake(_test_bench_echo, pdMS_TO_TICKS(5000)))
+            echoes++;
+        TEST_ASSERT_EQUAL(100, echoes);
+        uint32_t rate = 2 * 100 * sizeof(bulk) * 1000LL / (esp_timer_get_time() - begin);
+
+        aos_ws_client_stats_t stats = test_client_stats(client);
+        TEST_ASSERT_EQUAL(tuning == AOS_WS_CLIENT_TUNING_INTERACTIVE, stats.socket_nodelay);
+        printf("%-12s %-10u %-10u %-10d\n", names[tuning], rtt_us[tuning], rate, stats.socket_nodelay);
+
+        test_client_free(client);
+    }
+    vSemaphoreDelete(_test_bench_echo);
+    _test_bench_echo = NULL;
+    httpd_stop(server);
+
+    // What the presets are documented to do
+    TEST_ASSERT_LESS_THAN(rtt_us[AOS_WS_CLIENT_TUNING_NONE], rtt_us[AOS_WS_CLIENT_TUNING_INTERACTIVE]);
+    TEST_ASSERT_LESS_THAN(rtt_us[AOS_WS_CLIENT_TUNING_BULK], rtt_us[AOS_WS_CLIENT_TUNING_INTERACTIVE]);
+
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    TEST_HEAP_STOP
+}
+#endif
+
+TEST_CASE("Low-power benchmark", "[wsclient][bench]")
+{
+    test_init();
+    test_lan_host_check();
+
+    TEST_HEAP_START
+
+    // Run tools/aos_ws_echo_server.py on _test_lan_host first
+    static const aos_ws_client_lane_t lanes[] = {{.policy = AOS_WS_CLIENT_LANE_DROP_OLDEST, .depth = 8, .slot_size = 32}};
+    _test_bench_echo = xSemaphoreCreateCounting(100, 0);
+    TEST_ASSERT_NOT_NULL(_test_bench_echo);
+    aos_ws_client_config_t config = {
+        .on_data = test_ws_ondata_bench,
+        .event_handler = test_ws_eventhandler,
+        .mode = AOS_WS_CLIENT_MODE_INSECURE,
+        .host = _test_lan_host,
+        .port = _test_echo_port,
+        .lanes = lanes,
+        .lanes_len = 1,
+        .lowpower_window_ms = 2000};
+    aos_task_t *client = test_client_connect(&config);
+
+    // Telemetry every 500ms through a lane, written four at a time in wake windows
+    int64_t begin = esp_timer_get_time();
+    uint32_t echoes = 0;
+    for (uint32_t i = 0; i < 40; i++)
+    {
+        char data[16];
+        snprintf(data, sizeof(data), "sample %u", i);
+        TEST_ASSERT_EQUAL(0, aos_ws_client_try_send(client, 0, false, data, strlen(data)));
+        vTaskDelay(pdMS_TO_TICKS(500));
+        while (xSemaphoreTake(_test_bench_echo, 0))
+            echoes++;
+    }
+    while (echoes < 40 && xSemaphoreTake(_test_bench_echo, pdMS_TO_TICKS(5000)))
+        echoes++;
+    TEST_ASSERT_EQUAL(40, echoes);
+    uint64_t elapsed_us = esp_timer_get_time() - begin;
+
+    aos_ws_client_stats_t stats = test_client_stats(client);
+    printf("Wakeups %u (%u/h), awake %llums of %llums, %llums per message\n", stats.lowpower_wakeups, stats.lowpower_wakeups_per_hour,
+           stats.lowpower_active_us / 1000, elapsed_us / 1000, stats.lowpower_active_us / 1000 / echoes);
+    TEST_ASSERT_TRUE(stats.lowpower_active_us < elapsed_us / 2);
+
+    test_client_free(client);
+    vSemaphoreDelete(_test_bench_echo);
+    _test_bench_echo = NULL;
+
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    TEST_HEAP_STOP
+}
+
+TEST_CASE("Conformance suite", "[wsclient][conformance]")
+{
+    test_init();
+    test_lan_host_check();
+
+    TEST_HEAP_START
+
+    // Run tools/aos_ws_conformance.py (or an Autobahn fuzzingserver) on _test_lan_host first
+    _test_conformance_queue = xQueueCreate(256, sizeof(test_conformance_message_t *));
+    TEST_ASSERT_NOT_NULL(_test_conformance_queue);
+    _test_conformance_dropped = 0;
+
+    char text[64] = {0};
+    test_conformance_run("/getCaseCount", text, sizeof(text));
+    uint32_t cases = atoi(text);
+    TEST_ASSERT_TRUE(cases > 0);
+
+    char path[64];
+    uint32_t failed = 0;
+    uint32_t total_ms = 0;
+    printf("%-6s %-12s %-10s\n", "case", "behavior", "ms");
+    for (uint32_t i = 1; i <= cases; i++)
+    {
+        snprintf(path, sizeof(path), "/runCase?case=%u&agent=aos_ws_client", i);
+        uint32_t elapsed_ms = test_conformance_run(path, NULL, 0);
+        total_ms += elapsed_ms;
+
+        snprintf(path, sizeof(path), "/getCaseStatus?case=%u&agent=aos_ws_client", i);
+        text[0] = '\0';
+        test_conformance_run(path, text, sizeof(text));
+        char *behavior = strstr(text, "\"behavior\"");
+        behavior = behavior ? strchr(behavior + 10, '"') : NULL;
+        int behavior_len = behavior ? strcspn(behavior + 1, "\"") : 0;
+        printf("%-6u %-12.*s %-10u\n", i, behavior_len, behavior ? behavior + 1 : "", elapsed_ms);
+        if (!behavior || !strncmp(behavior + 1, "FAILED", 6))
+            failed++;
+    }
+    printf("%u cases, %u failed, %u dropped messages, %u ms\n", cases, failed, _test_conformance_dropped, total_ms);
+    test_conformance_run("/updateReports?agent=aos_ws_client", NULL, 0);
+    TEST_ASSERT_EQUAL(0, failed);
+    TEST_ASSERT_EQUAL(0, _test_conformance_dropped);
+
+    vQueueDelete(_test_conformance_queue);
+    _test_conformance_queue = NULL;
+
+    vTaskDelay(pdMS_TO_TICKS(10));
+
+    TEST_HEAP_STOP
+}
@@ -0,0 +1,353 @@
+#!/usr/bin/env python3
+"""
+Conformance and performance suite for the AOS Websocket client.
+
+A local stand-in for the Autobahn testsuite fuzzing server, speaking the same
+URL scheme so that the "Conformance suite" test case (test/test_client.c, tag
+[conformance]) runs against either of them, on the host set in
+CONFIG_AOS_WS_CLIENT_TEST_LAN_HOST:
+
+    /getCaseCount                 sends the number of cases as a text message
+    /runCase?case=N&agent=A       runs case N, the client echoes every message
+    /getCaseStatus?case=N&agent=A sends {"behavior": "..."} as a text message
+    /updateReports?agent=A        prints the report (and exits with --once)
+
+Cases are grouped like the Autobahn ones:
+
+    1.x  framing     text and binary messages across the payload length encodings
+    2.x  pings       pings with and without payload, unsolicited pongs
+    5.x  fragments   fragmented messages, with control frames between fragments
+    6.x  UTF-8       multi-byte characters split across fragments, invalid text
+    7.x  close       close codes and reasons, frames sent after the close frame
+    9.x  throughput  large and many messages, the timing is the result
+
+Each case is graded OK, NON-STRICT (invalid input accepted instead of failing
+the connection) or FAILED, and so is the closing handshake. Timings are taken
+from the first frame sent to the last expected echo (traffic_ms) and from the
+handshake to the closed connection (duration_ms). With --baseline, cases whose
+traffic time grew by more than --max-slowdown against a previous --json report
+are flagged, so that conformance and throughput regressions show up together.
+
+The real thing runs with:
+
+    docker run -it --rm -v $PWD:/config -p 9001:9001 crossbario/autobahn-testsuite \\
+        wstest -m fuzzingserver -s /config/fuzzingserver.json
+
+excluding the cases that do not fit the device memory (9.1.2 and up, 256 KiB
+messages and more) and the compression ones (12.* and 13.*).
+
+Usage:
+    aos_ws_conformance.py [--port 9001] [--cases 1.*,5.*] [--max-payload 65536]
+    aos_ws_conformance.py --once --json report.json --baseline previous.json --max-slowdown 0.5
+"""
+import argparse
+import asyncio
+import fnmatch
+import json
+import struct
+import sys
+import time
+import urllib.parse
+
+from aos_ws_faultlab import OPCODE_BINARY, OPCODE_CLOSE, OPCODE_PING, OPCODE_PONG, OPCODE_TEXT, ws_accept, ws_frame, ws_read_frame
+
+OPCODE_CONT = 0x0
+
+
+def now_ms():
+    return time.monotonic() * 1000
+
+
+def close_payload(code, reason=b""):
+    return struct.pack(">H", code) + reason
+
+
+def fragments(opcode, payload, size, between=None):
+    """Split a message into frames of up to size bytes, with optional control frames between them."""
+    chunks = [payload[i:i + size] for i in range(0, len(payload), size)] or [b""]
+    frames = []
+    for i, chunk in enumerate(chunks):
+        if i and between:
+            frames.append(between)
+        frames.append((OPCODE_CONT if i else opcode, chunk, i == len(chunks) - 1))
+    return frames
+
+
+class Case:
+    def __init__(self, case_id, description, send, expect=None, invalid=False, close=None, after_close=(),
+                 close_codes=(None, 1000)):
+        self.id = case_id
+        self.description = description
+        self.send = send                 # (opcode, payload, fin) frames
+        self.expect = expect if expect is not None else [(f[0], f[1]) for f in send if f[0] in (OPCODE_TEXT, OPCODE_BINARY)]
+        self.invalid = invalid           # the client should fail the connection instead of echoing
+        self.close = close if close is not None else close_payload(1000)
+        self.after_close = after_close   # frames sent after the close frame, never to be answered
+        self.close_codes = close_codes   # close codes accepted in reply, None being an empty close frame
+
+
+def catalog(max_payload):
+    cases = []
+    lengths = [n for n in (0, 125, 126, 127, 128, 65535, 65536) if n <= max_payload]
+    for i, n in enumerate(lengths):
+        cases.append(Case("1.1.%d" % (i + 1), "text message of %d bytes" % n, [(OPCODE_TEXT, b"*" * n, True)]))
+    for i, n in enumerate(lengths):
+        cases.append(Case("1.2.%d" % (i + 1), "binary message of %d bytes" % n, [(OPCODE_BINARY, bytes(range(256)) * (n // 256) + bytes(n % 256), True)]))
+
+    cases += [
+        Case("2.1", "ping without payload", [(OPCODE_PING, b"", True)], [(OPCODE_PONG, b"")]),
+        Case("2.2", "ping with text payload", [(OPCODE_PING, b"Hello, world!", True)], [(OPCODE_PONG, b"Hello, world!")]),
+        Case("2.3", "ping with 125 bytes binary payload", [(OPCODE_PING, bytes(range(125)), True)], [(OPCODE_PONG, bytes(range(125)))]),
+        Case("2.4", "10 pings in a row", [(OPCODE_PING, b"ping %d" % i, True) for i in range(10)],
+             [(OPCODE_PONG, b"ping %d" % i) for i in range(10)]),
+        Case("2.5", "unsolicited pong, then a text message", [(OPCODE_PONG, b"unsolicited", True), (OPCODE_TEXT, b"after pong", True)]),
+    ]
+
+    text = b"fragmented text message"
+    cases += [
+        Case("5.1", "text message in 2 fragments", fragments(OPCODE_TEXT, text, 12), [(OPCODE_TEXT, text)]),
+        Case("5.2", "binary message in 2 fragments", fragments(OPCODE_BINARY, bytes(range(24)), 12), [(OPCODE_BINARY, bytes(range(24)))]),
+        Case("5.3", "text message in 1 byte fragments", fragments(OPCODE_TEXT, text, 1), [(OPCODE_TEXT, text)]),
+        Case("5.4", "ping between fragments", fragments(OPCODE_TEXT, text, 12, (OPCODE_PING, b"between", True)),
+             [(OPCODE_PONG, b"between"), (OPCODE_TEXT, text)]),
+        Case("5.5", "pong between fragments", fragments(OPCODE_TEXT, text, 12, (OPCODE_PONG, b"between", True)), [(OPCODE_TEXT, text)]),
+        Case("5.6", "ping between every 1 byte fragment", fragments(OPCODE_TEXT, text, 1, (OPCODE_PING, b"", True)),
+             [(OPCODE_PONG, b"")] * (len(text) - 1) + [(OPCODE_TEXT, text)]),
+        Case("5.7", "empty first and last fragments",
+             [(OPCODE_TEXT, b"", False), (OPCODE_CONT, text, False), (OPCODE_CONT, b"", True)], [(OPCODE_TEXT, text)]),
+        Case("5.8", "two fragmented messages back to back",
+             fragments(OPCODE_TEXT, text, 8) + fragments(OPCODE_BINARY, bytes(range(24)), 8),
+             [(OPCODE_TEXT, text), (OPCODE_BINARY, bytes(range(24)))]),
+    ]
+
+    utf8 = "κόσμε é€\U0001f600".encode()
+    cases += [
+        Case("6.1", "valid multi-byte UTF-8 text", [(OPCODE_TEXT, utf8, True)]),
+        Case("6.2", "multi-byte character split across fragments", fragments(OPCODE_TEXT, utf8, 3), [(OPCODE_TEXT, utf8)]),
+        Case("6.3", "valid UTF-8 in 1 byte fragments", fragments(OPCODE_TEXT, utf8, 1), [(OPCODE_TEXT, utf8)]),
+        Case("6.4", "invalid UTF-8 (encoded surrogate)", [(OPCODE_TEXT, "κόσμε".encode() + b"\xed\xa0\x80edited", True)], invalid=True),
+        Case("6.5", "invalid UTF-8 (lone continuation byte)", [(OPCODE_TEXT, b"abc\x80def", True)], invalid=True),
+        Case("6.6", "invalid UTF-8 (overlong encoding)", [(OPCODE_TEXT, b"\xc0\xaf", True)], invalid=True),
+    ]
+
+    cases += [
+        Case("7.1", "close with code 1000", [], close=close_payload(1000)),
+        Case("7.2", "close with code 1000 and reason", [], close=close_payload(1000, b"normal closure")),
+        Case("7.3", "close without payload", [], close=b""),
+        Case("7.4", "text message after the close frame", [], after_close=[(OPCODE_TEXT, b"after close", True)]),
+        Case("7.5", "ping after the close frame", [], after_close=[(OPCODE_PING, b"after close", True)]),
+        Case("7.6", "close with invalid code 999", [], close=close_payload(999), close_codes=(1002,)),
+        Case("7.7", "close with reserved code 1005", [], close=close_payload(1005), close_codes=(1002,)),
+    ]
+
+    size = min(65536, max_payload)
+    cases += [
+        Case("9.1", "text message of %d bytes" % size, [(OPCODE_TEXT, b"*" * size, True)]),
+        Case("9.2", "binary message of %d bytes" % size, [(OPCODE_BINARY, bytes(size), True)]),
+        Case("9.3", "binary message of %d bytes in 1024 byte fragments" % size, fragments(OPCODE_BINARY, bytes(size), 1024),
+             [(OPCODE_BINARY, bytes(size))]),
+        Case("9.4", "binary message of %d bytes in 64 byte fragments" % size, fragments(OPCODE_BINARY, bytes(size), 64),
+             [(OPCODE_BINARY, bytes(size))]),
+        Case("9.5", "100 binary messages of 512 bytes", [(OPCODE_BINARY, bytes([i]) * 512, True) for i in range(100)]),
+        Case("9.6", "200 text messages of 16 bytes", [(OPCODE_TEXT, b"%016d" % i, True) for i in range(200)]),
+    ]
+    return cases
+
+
+class Suite:
+    def __init__(self, args):
+        self.args = args
+        self.cases = [c for c in catalog(args.max_payload)
+                      if not args.cases or any(fnmatch.fnmatch(c.id, p) for p in args.cases.split(","))]
+        self.results = {}  # agent -> case id -> result
+        self.done = asyncio.Event()
+
+    async def handle(self, reader, writer):
+        try:
+            path = await ws_accept(reader, writer)
+            if path is None:
+                return
+            url = urllib.parse.urlparse(path)
+            query = dict(urllib.parse.parse_qsl(url.query))
+            agent = query.get("agent", "unknown")
+            if url.path == "/getCaseCount":
+                await self.reply(reader, writer, str(len(self.cases)).encode())
+            elif url.path == "/runCase":
+                index = int(query.get("case", 0)) - 1
+                if 0 <= index < len(self.cases):
+                    case = self.cases[index]
+                    result = self.results.setdefault(agent, {})[case.id] = {}
+                    await self.run(case, result, reader, writer)
+                    print("%-8s %-11s %-11s %8.1f ms  %s" % (case.id, result["behavior"], result["behaviorClose"],
+                                                             result["traffic_ms"], case.description))
+            elif url.path == "/getCaseStatus":
+                index = int(query.get("case", 0)) - 1
+                result = self.results.get(agent, {}).get(self.cases[index].id) if 0 <= index < len(self.cases) else None
+                # The client may ask before the case connection is fully closed on this side
+                deadline = now_ms() + self.args.timeout_s * 1000
+                while result is not None and "duration_ms" not in result and now_ms() < deadline:
+                    await asyncio.sleep(0.01)
+                await self.reply(reader, writer, json.dumps({"behavior": result.get("behavior", "FAILED") if result is not None else "UNKNOWN"}).encode())
+            elif url.path == "/updateReports":
+                await self.reply(reader, writer, None)
+                self.done.set()
+            else:
+                await self.reply(reader, writer, None)
+        except (asyncio.IncompleteReadError, ConnectionError, asyncio.CancelledError, ValueError):
+            pass
+        finally:
+            writer.close()
+
+    async def reply(self, reader, writer, text):
+        if text is not None:
+            writer.write(ws_frame(OPCODE_TEXT, text))
+        await self.closing(reader, writer, close_payload(1000))
+
+    async def receive(self, reader, timeout_s):
+        """Read one message or control frame from the client, reassembling fragments."""
+        opcode = None
+        payload = b""
+        while True:
+            fin, frame_opcode, frame_payload = await asyncio.wait_for(ws_read_frame(reader), timeout_s)
+            if frame_opcode & 0x8:
+                return frame_opcode, frame_payload
+            if frame_opcode != OPCODE_CONT:
+                opcode = frame_opcode
+                payload = b""
+            payload += frame_payload
+            if fin:
+                return opcode, payload
+
+    async def closing(self, reader, writer, close, after_close=()):
+        """Send a close frame and wait for the client one, returns (closed, code, extra frames received)."""
+        writer.write(ws_frame(OPCODE_CLOSE, close))
+        for opcode, payload, fin in after_close:
+            writer.write(ws_frame(opcode, payload, fin))
+        await writer.drain()
+        extra = 0
+        try:
+            while True:
+                opcode, payload = await self.receive(reader, self.args.timeout_s)
+                if opcode == OPCODE_CLOSE:
+                    code = struct.unpack(">H", payload[:2])[0] if len(payload) >= 2 else None
+                    return True, code, extra
+                extra += 1
+        except (asyncio.TimeoutError, asyncio.IncompleteReadError, ConnectionError):
+            return False, None, extra
+
+    async def run(self, case, result, reader, writer):
+        begin = now_ms()
+        for opcode, payload, fin in case.send:
+            writer.write(ws_frame(opcode, payload, fin))
+        await writer.drain()
+
+        received = []
+        failed_connection = False
+        close = case.close
+        try:
+            while len(received) < len(case.expect):
+                opcode, payload = await self.receive(reader, self.args.timeout_s)
+                if opcode == OPCODE_CLOSE:
+                    # Client side close, answer it and skip our own closing handshake
+                    failed_connection = True
+                    writer.write(ws_frame(OPCODE_CLOSE, payload[:2]))
+                    await writer.drain()
+                    break
+                received.append((opcode, payload))
+        except (asyncio.TimeoutError, asyncio.IncompleteReadError, ConnectionError):
+            failed_connection = True
+        traffic_ms = now_ms() - begin
+
+        if case.invalid:
+            behavior = "OK" if failed_connection else "NON-STRICT"
+        else:
+            behavior = "OK" if received == case.expect else "FAILED"
+
+        result.update({"behavior": behavior, "behaviorClose": "OK", "remoteCloseCode": None,
+                       "description": case.description, "traffic_ms": round(traffic_ms, 1),
+                       "bytes": sum(len(p) for o, p in case.expect if o in (OPCODE_TEXT, OPCODE_BINARY))})
+        if not failed_connection:
+            closed, code, extra = await self.closing(reader, writer, close, case.after_close)
+            result["remoteCloseCode"] = code
+            if not closed or extra:
+                result["behaviorClose"] = "FAILED"
+                if case.send == []:
+                    result["behavior"] = "FAILED"
+            elif code not in case.close_codes:
+                result["behaviorClose"] = "NON-STRICT"
+                if case.send == [] and result["behavior"] == "OK":
+                    result["behavior"] = "NON-STRICT"
+        # The client closes the TCP connection once the closing handshake is done
+        try:
+            await asyncio.wait_for(reader.read(), self.args.timeout_s)
+        except (asyncio.TimeoutError, ConnectionError):
+            result["behaviorClose"] = "FAILED"
+        result["duration_ms"] = round(now_ms() - begin, 1)
+        if result["bytes"] and traffic_ms > 0:
+            result["kBps"] = round(2 * result["bytes"] / traffic_ms, 1)
+
+    async def main(self):
+        server = await asyncio.start_server(self.handle, self.args.host, self.args.port)
+        print("listening on %s:%d, %d cases" % (self.args.host, self.args.port, len(self.cases)))
+        async with server:
+            while True:
+                await self.done.wait()
+                self.done.clear()
+                failed = self.report()
+                if self.args.once:
+                    return 1 if failed else 0
+
+    def report(self):
+        baseline = {}
+        if self.args.baseline:
+            with open(self.args.baseline) as f:
+                baseline = json.load(f)
+        failed = False
+        print("%-14s %-8s %-11s %-11s %-10s %-10s %-10s %-10s" % ("agent", "case", "behavior", "close", "traffic_ms",
+                                                                 "total_ms", "kB/s", "baseline"))
+        for agent, results in self.results.items():
+            for case in self.cases:
+                result = results.get(case.id)
+                if not result or "duration_ms" not in result:
+                    continue
+                previous = baseline.get(agent, {}).get(case.id)
+                slower = ""
+                if previous and previous.get("traffic_ms"):
+                    ratio = result["traffic_ms"] / previous["traffic_ms"]
+                    slower = "%+.0f%%" % ((ratio - 1) * 100)
+                    # Short cases are dominated by the network, only the longer ones are compared
+                    if previous["traffic_ms"] >= self.args.min_compare_ms and ratio > 1 + self.args.max_slowdown:
+                        slower += " SLOWER"
+                        failed = True
+                if "FAILED" in (result["behavior"], result["behaviorClose"]):
+                    failed = True
+                print("%-14s %-8s %-11s %-11s %-10s %-10s %-10s %-10s" % (agent, case.id, result["behavior"], result["behaviorClose"],
+                                                                         result["traffic_ms"], result["duration_ms"],
+                                                                         result.get("kBps", "-"), slower or "-"))
+        if self.args.json:
+            with open(self.args.json, "w") as f:
+                json.dump(self.results, f, indent=2)
+        return failed
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", default="0.0.0.0", help="listen address")
+    parser.add_argument("--port", type=int, default=9001, help="listen port")
+    parser.add_argument("--cases", help="comma separated case patterns, like 1.*,5.4")
+    parser.add_argument("--max-payload", type=int, default=65536, help="largest message sent to the device")
+    parser.add_argument("--timeout-s", type=float, default=10, help="give up waiting for an echo after this")
+    parser.add_argument("--once", action="store_true", help="exit after the first report, non-zero on failures")
+    parser.add_argument("--json", help="also write the report to this file")
+    parser.add_argument("--baseline", help="previous --json report to compare timings against")
+    parser.add_argument("--max-slowdown", type=float, default=0.5, help="fail if a case is slower than baseline by this ratio")
+    parser.add_argument("--min-compare-ms", type=float, default=50, help="only compare cases taking at least this long")
+    args = parser.parse_args()
+    try:
+        return asyncio.run(Suite(args).main())
+    except KeyboardInterrupt:
+        return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+"""
+Plain Websocket echo server for the AOS Websocket client benchmarks.
+
+Echoes every text and binary message back as a single frame, answers pings
+and close frames, and sets TCP_NODELAY on its own side so that measured
+delays come from the device. Run it on a host on the same network as the
+device, set CONFIG_AOS_WS_CLIENT_TEST_LAN_HOST to that host's address, then
+run the "Low-power benchmark" test case (test/test_client.c, tag [bench])
+against it.
+
+Connections on the /fragmented path get every message back split over a
+non-final data frame and a non-final continuation frame, followed by an
+empty final continuation frame, as used by the "Connect/sendraw sink
+fragmented/disconnect" and "Connect/rpc fragmented/disconnect" test cases.
+
+Usage:
+    aos_ws_echo_server.py [--port 8767]
+"""
+import argparse
+import asyncio
+import socket
+import sys
+
+from aos_ws_faultlab import OPCODE_CLOSE, OPCODE_CONT, OPCODE_PING, OPCODE_PONG, ws_accept, ws_frame, ws_read_frame
+
+
+async def handle(reader, writer):
+    peer = writer.get_extra_info("peername")
+    sock = writer.get_extra_info("socket")
+    if sock is not None:
+        sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    messages = 0
+    try:
+        path = await ws_accept(reader, writer)
+        if path is None:
+            return
+        fragmented = path == "/fragmented"
+        opcode = None
+        payload = b""
+        while True:
+            fin, frame_opcode, frame_payload = await ws_read_frame(reader)
+            if frame_opcode == OPCODE_CLOSE:
+                writer.write(ws_frame(OPCODE_CLOSE, frame_payload[:2]))
+                await writer.drain()
+                return
+            if frame_opcode == OPCODE_PING:
+                writer.write(ws_frame(OPCODE_PONG, frame_payload))
+                continue
+            if frame_opcode == OPCODE_PONG:
+                continue
+            if frame_opcode:
+                opcode = frame_opcode
+                payload = b""
+            payload += frame_payload
+            if fin:
+                if fragmented:
+                    half = len(payload) // 2
+                    writer.write(ws_frame(opcode, payload[:half], fin=False) + ws_frame(OPCODE_CONT, payload[half:], fin=False) + ws_frame(OPCODE_CONT, b""))
+                else:
+                    writer.write(ws_frame(opcode, payload))
+                await writer.drain()
+                messages += 1
+    except (asyncio.IncompleteReadError, ConnectionError, asyncio.CancelledError):
+        pass
+    finally:
+        print("%s:%d echoed %d messages" % (peer[0], peer[1], messages))
+        writer.close()
+
+
+async def serve(args):
+    server = await asyncio.start_server(handle, args.host, args.port)
+    print("listening on %s:%d" % (args.host, args.port))
+    async with server:
+        await server.serve_forever()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", default="0.0.0.0", help="listen address")
+    parser.add_argument("--port", type=int, default=8767, help="listen port")
+    args = parser.parse_args()
+    try:
+        asyncio.run(serve(args))
+    except KeyboardInterrupt:
+        pass
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
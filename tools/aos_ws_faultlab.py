@@ -0,0 +1,380 @@
+#!/usr/bin/env python3
+"""
+Network fault injection harness for the AOS Websocket client.
+
+Runs a local Websocket echo server behind a TCP proxy, and injects faults
+through the proxy while a device runs the "Fault injection" test case
+(test/test_client.c, tag [fault]) against it, with
+CONFIG_AOS_WS_CLIENT_TEST_LAN_HOST set to this host. The device sends a numbered
+text message every 50ms, which carries its send time, failed send count,
+free heap and the time it last detected a connection loss:
+
+    seq <n> <t_ms> <failed> <free_heap> <detected_ms>
+
+Scenarios run one after the other on the same client:
+
+    latency    every chunk is delayed by --latency-ms, both ways
+    bandwidth  both directions are capped to --rate bytes/s
+    reset      the connection is reset (RST) by the proxy
+    halfopen   the connection silently stops passing data, both ways
+    stall      the connection is reset, then the next --stalls connections
+               are accepted but never get a handshake response
+
+For each scenario the report gives the time to detect (device side, mapped
+onto the host clock), the time to reconnect (new handshake on the server),
+messages lost without the device being told, duplicated messages, the
+longest gap between delivered messages and the peak heap use on the device.
+Thresholds make the run fail, for regression testing.
+
+Usage:
+    aos_ws_faultlab.py [--port 8765] [--scenarios reset,halfopen]
+    aos_ws_faultlab.py --json report.json --max-reconnect-ms 5000 --max-lost 0
+"""
+import argparse
+import asyncio
+import base64
+import hashlib
+import json
+import socket
+import struct
+import sys
+import time
+
+GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+OPCODE_CONT = 0x0
+OPCODE_TEXT = 0x1
+OPCODE_BINARY = 0x2
+OPCODE_CLOSE = 0x8
+OPCODE_PING = 0x9
+OPCODE_PONG = 0xA
+
+
+def now_ms():
+    return time.monotonic() * 1000
+
+
+async def ws_accept(reader, writer):
+    """Read a handshake request and answer it, returns the request path or None."""
+    request = await reader.readuntil(b"\r\n\r\n")
+    lines = request.decode("latin-1").split("\r\n")
+    headers = {}
+    for line in lines[1:]:
+        if ":" in line:
+            name, value = line.split(":", 1)
+            headers[name.strip().lower()] = value.strip()
+    key = headers.get("sec-websocket-key")
+    if not key:
+        writer.write(b"HTTP/1.1 400 Bad Request\r\n\r\n")
+        return None
+    accept = base64.b64encode(hashlib.sha1((key + GUID).encode()).digest()).decode()
+    writer.write(("HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                  "Sec-WebSocket-Accept: %s\r\n\r\n" % accept).encode())
+    await writer.drain()
+    return lines[0].split(" ")[1] if len(lines[0].split(" ")) > 1 else "/"
+
+
+async def ws_read_frame(reader):
+    """Read one frame, returns (fin, opcode, payload) with the payload unmasked."""
+    head = await reader.readexactly(2)
+    fin = bool(head[0] & 0x80)
+    opcode = head[0] & 0x0F
+    length = head[1] & 0x7F
+    if length == 126:
+        length = struct.unpack(">H", await reader.readexactly(2))[0]
+    elif length == 127:
+        length = struct.unpack(">Q", await reader.readexactly(8))[0]
+    mask = await reader.readexactly(4) if head[1] & 0x80 else None
+    payload = bytearray(await reader.readexactly(length))
+    if mask:
+        for i in range(length):
+            payload[i] ^= mask[i & 3]
+    return fin, opcode, bytes(payload)
+
+
+def ws_frame(opcode, payload, fin=True):
+    """Build an unmasked (server) frame."""
+    head = bytes([(0x80 if fin else 0) | opcode])
+    if len(payload) < 126:
+        head += bytes([len(payload)])
+    elif len(payload) <= 0xFFFF:
+        head += bytes([126]) + struct.pack(">H", len(payload))
+    else:
+        head += bytes([127]) + struct.pack(">Q", len(payload))
+    return head + payload
+
+
+def abort_with_reset(writer):
+    """Close with a RST instead of a FIN."""
+    sock = writer.get_extra_info("socket")
+    if sock is not None:
+        try:
+            sock.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack("ii", 1, 0))
+        except OSError:
+            pass
+    writer.transport.abort()
+
+
+class Scenario:
+    def __init__(self, name, kind, **fault):
+        self.name = name
+        self.kind = kind  # "degrade" keeps the connection, "drop" expects a reconnection
+        self.fault = fault
+        self.fault_at = None
+        self.handshakes = []
+        self.accepts = []
+        self.messages = []  # (arrival_ms, seq, t_ms, failed, free_heap, detected_ms)
+
+    def report(self, offset_ms, seq_before, failed_before, free_before):
+        seqs = [m[1] for m in self.messages]
+        after = [m for m in self.messages if m[1] > seq_before]
+        last = max(seqs) if seqs else seq_before
+        failed = (max(m[3] for m in self.messages) if self.messages else failed_before) - failed_before
+        missing = len(set(range(seq_before + 1, last + 1)) - set(seqs))
+        arrivals = [m[0] for m in after]
+        gaps = [b - a for a, b in zip(arrivals, arrivals[1:])]
+        result = {
+            "scenario": self.name,
+            "delivered": len(after),
+            "lost": max(missing - failed, 0),
+            "failed_sends": failed,
+            "duplicated": len(seqs) - len(set(seqs)),
+            "max_gap_ms": round(max(gaps)) if gaps else None,
+            "peak_heap_bytes": max(free_before - min(m[4] for m in self.messages), 0) if self.messages else None,
+            "detect_ms": None,
+            "reconnect_ms": None,
+        }
+        if self.kind == "drop":
+            detected = [m[5] for m in self.messages if m[5] and m[5] + offset_ms >= self.fault_at - 1]
+            if detected:
+                result["detect_ms"] = round(min(detected) + offset_ms - self.fault_at)
+            elif self.accepts:
+                # Older firmware without the detection stamp, the first reconnection attempt is the next best thing
+                result["detect_ms"] = round(self.accepts[0] - self.fault_at)
+            if self.handshakes:
+                result["reconnect_ms"] = round(self.handshakes[-1] - self.fault_at)
+        return result
+
+
+class Lab:
+    def __init__(self, args):
+        self.args = args
+        self.server_port = None
+        self.links = []
+        self.client = None  # Writer of the current Websocket session
+        self.connected = asyncio.Event()
+        self.scenario = None
+        self.stalls = 0
+        self.offset_ms = None
+        self.last = (0, 0, 0)  # seq, failed, free_heap of the latest message
+
+    # Server side: echo, and record the device messages
+    async def serve(self, reader, writer):
+        try:
+            path = await ws_accept(reader, writer)
+            if path is None:
+                writer.close()
+                return
+            if self.scenario:
+                self.scenario.handshakes.append(now_ms())
+            self.client = writer
+            self.connected.set()
+            while True:
+                fin, opcode, payload = await ws_read_frame(reader)
+                if opcode == OPCODE_CLOSE:
+                    writer.write(ws_frame(OPCODE_CLOSE, payload[:2]))
+                    await writer.drain()
+                    break
+                if opcode == OPCODE_PING:
+                    writer.write(ws_frame(OPCODE_PONG, payload))
+                elif opcode in (OPCODE_TEXT, OPCODE_BINARY):
+                    self.record(payload)
+                    writer.write(ws_frame(opcode, payload))
+                await writer.drain()
+        except (asyncio.IncompleteReadError, ConnectionError, asyncio.LimitOverrunError, asyncio.CancelledError):
+            pass
+        finally:
+            if self.client is writer:
+                self.client = None
+                self.connected.clear()
+            writer.close()
+
+    def record(self, payload):
+        fields = payload.decode("latin-1").split()
+        if len(fields) != 6 or fields[0] != "seq":
+            return
+        arrival = now_ms()
+        seq, t_ms, failed, free_heap, detected_ms = (int(f) for f in fields[1:])
+        # Clock offset from the least delayed message, before any fault
+        if self.scenario is None or self.scenario.fault_at is None:
+            offset = arrival - t_ms
+            self.offset_ms = offset if self.offset_ms is None else min(self.offset_ms, offset)
+        self.last = (seq, failed, free_heap)
+        if self.scenario and self.scenario.fault_at is not None:
+            self.scenario.messages.append((arrival, seq, t_ms, failed, free_heap, detected_ms))
+
+    # Proxy side: forward both ways through the fault in place
+    async def proxy(self, client_reader, client_writer):
+        if self.scenario and self.scenario.fault_at is not None:
+            self.scenario.accepts.append(now_ms())
+        if self.stalls:
+            # Accept the connection, but never answer the handshake
+            self.stalls -= 1
+            await asyncio.sleep(self.args.stall_s)
+            abort_with_reset(client_writer)
+            return
+        try:
+            server_reader, server_writer = await asyncio.open_connection("127.0.0.1", self.server_port)
+        except OSError:
+            abort_with_reset(client_writer)
+            return
+        link = {"frozen": False, "writers": (client_writer, server_writer)}
+        self.links.append(link)
+        try:
+            await asyncio.gather(self.pump(link, client_reader, server_writer), self.pump(link, server_reader, client_writer),
+                                 return_exceptions=True)
+        except asyncio.CancelledError:
+            pass
+        self.links.remove(link)
+        for writer in link["writers"]:
+            writer.close()
+
+    async def pump(self, link, reader, writer):
+        queue = asyncio.Queue()
+
+        async def deliver():
+            while True:
+                due, data = await queue.get()
+                if data is None:
+                    return
+                delay = due - now_ms()
+                if delay > 0:
+                    await asyncio.sleep(delay / 1000)
+                writer.write(data)
+                await writer.drain()
+                rate = self.fault("rate")
+                if rate:
+                    await asyncio.sleep(len(data) / rate)
+
+        sender = asyncio.ensure_future(deliver())
+        try:
+            while True:
+                # A half-open link neither reads nor writes, so that the device sees nothing but silence
+                while link["frozen"]:
+                    await asyncio.sleep(0.05)
+                data = await reader.read(4096)
+                if not data or link["frozen"]:
+                    break
+                queue.put_nowait((now_ms() + (self.fault("latency_ms") or 0), data))
+        finally:
+            queue.put_nowait((0, None))
+            await asyncio.gather(sender, return_exceptions=True)
+
+    def fault(self, name):
+        return self.scenario.fault.get(name) if self.scenario and self.scenario.fault_at is not None else None
+
+    async def run_scenario(self, scenario):
+        await asyncio.wait_for(self.connected.wait(), self.args.timeout_s)
+        await asyncio.sleep(self.args.warmup_s)
+        seq_before, failed_before, free_before = self.last
+        self.scenario = scenario
+        scenario.fault_at = now_ms()
+        if scenario.name in ("reset", "stall"):
+            self.stalls = scenario.fault.get("stalls", 0)
+            for link in list(self.links):
+                abort_with_reset(link["writers"][0])
+        elif scenario.name == "halfopen":
+            for link in self.links:
+                link["frozen"] = True
+
+        if scenario.kind == "degrade":
+            await asyncio.sleep(self.args.degrade_s)
+        else:
+            # Done once the device is back and messages flow again on the new connection
+            deadline = now_ms() + self.args.timeout_s * 1000
+            while now_ms() < deadline and not (scenario.handshakes and scenario.messages and
+                                               scenario.messages[-1][0] > scenario.handshakes[-1]):
+                await asyncio.sleep(0.05)
+        # Drop leftovers (half-open links) and let late messages in before settling the numbers
+        for link in list(self.links):
+            if link["frozen"]:
+                link["frozen"] = False
+                abort_with_reset(link["writers"][0])
+        self.stalls = 0
+        fault, scenario.fault = scenario.fault, {}
+        await asyncio.sleep(self.args.settle_s)
+        scenario.fault = fault
+        self.scenario = None
+        return scenario.report(self.offset_ms or 0, seq_before, failed_before, free_before)
+
+    async def main(self):
+        server = await asyncio.start_server(self.serve, "127.0.0.1", 0)
+        self.server_port = server.sockets[0].getsockname()[1]
+        proxy = await asyncio.start_server(self.proxy, self.args.host, self.args.port)
+        print("Waiting for the device on %s:%d" % (self.args.host, self.args.port), file=sys.stderr)
+
+        catalog = {
+            "latency": Scenario("latency", "degrade", latency_ms=self.args.latency_ms),
+            "bandwidth": Scenario("bandwidth", "degrade", rate=self.args.rate),
+            "reset": Scenario("reset", "drop"),
+            "halfopen": Scenario("halfopen", "drop"),
+            "stall": Scenario("stall", "drop", stalls=self.args.stalls),
+        }
+        results = []
+        for name in self.args.scenarios.split(","):
+            print("Running %s" % name, file=sys.stderr)
+            results.append(await self.run_scenario(catalog[name]))
+
+        # Let the device test end
+        if self.client:
+            self.client.write(ws_frame(OPCODE_TEXT, b"end"))
+            await self.client.drain()
+        await asyncio.sleep(1)
+        proxy.close()
+        server.close()
+        return results
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", default="0.0.0.0", help="proxy listen address")
+    parser.add_argument("--port", type=int, default=8765, help="proxy listen port")
+    parser.add_argument("--scenarios", default="latency,bandwidth,reset,halfopen,stall", help="comma separated scenarios")
+    parser.add_argument("--latency-ms", type=int, default=300, help="added latency per chunk")
+    parser.add_argument("--rate", type=int, default=2000, help="bandwidth cap in bytes/s")
+    parser.add_argument("--stalls", type=int, default=2, help="stalled handshakes after the reset")
+    parser.add_argument("--stall-s", type=float, default=10, help="how long each stalled handshake is held")
+    parser.add_argument("--warmup-s", type=float, default=3, help="steady traffic before each fault")
+    parser.add_argument("--degrade-s", type=float, default=5, help="duration of latency and bandwidth faults")
+    parser.add_argument("--settle-s", type=float, default=2, help="steady traffic after each scenario")
+    parser.add_argument("--timeout-s", type=float, default=90, help="give up waiting for the device after this")
+    parser.add_argument("--json", help="also write the report to this file")
+    parser.add_argument("--max-reconnect-ms", type=int, help="fail if any reconnection takes longer")
+    parser.add_argument("--max-lost", type=int, help="fail if any scenario silently loses more messages")
+    args = parser.parse_args()
+
+    results = asyncio.run(Lab(args).main())
+
+    columns = ("scenario", "detect_ms", "reconnect_ms", "delivered", "lost", "failed_sends", "duplicated",
+               "max_gap_ms", "peak_heap_bytes")
+    print(" ".join("%-15s" % c for c in columns))
+    for result in results:
+        print(" ".join("%-15s" % ("-" if result[c] is None else result[c]) for c in columns))
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(results, f, indent=2)
+
+    failed = False
+    for result in results:
+        if result["duplicated"]:
+            failed = True
+        if args.max_lost is not None and result["lost"] > args.max_lost:
+            failed = True
+        if args.max_reconnect_ms is not None and result["reconnect_ms"] is not None and result["reconnect_ms"] > args.max_reconnect_ms:
+            failed = True
+        if args.max_reconnect_ms is not None and result["scenario"] in ("reset", "halfopen", "stall") and result["reconnect_ms"] is None:
+            failed = True
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,185 @@
+#!/usr/bin/env python3
+"""
+Reference session server for the AOS Websocket client.
+
+Speaks the framing used by the client when config.session_window is set, and
+echoes every data message back through the session. Session messages are
+binary Websocket messages starting with a type byte and a big-endian 32-bit
+sequence number:
+
+    0x01 DATA    seq, payload (type | 0x80 when the payload is text)
+    0x02 ACK     last sequence number received, cumulative
+    0x03 RESUME  from the client: last server sequence number received,
+                 followed by an 8-byte session ID
+                 from the server: last client sequence number received,
+                 followed by a flags byte (0x01: new session)
+
+Sessions are kept across connections by ID, each with up to --window sent
+messages awaiting an acknowledgement. On RESUME, the server answers with what
+it has received so far and replays whatever the client has not seen. Data
+already received is dropped and counted as duplicated.
+
+With --drop-every N the connection is reset after every N-th new message, once
+its echo has been queued but before it is written, so that both sides have to
+replay. Run the "Session resume" and "Session resume standby" test cases
+(test/test_client.c, tag [session]) against it, with
+CONFIG_AOS_WS_CLIENT_TEST_LAN_HOST pointing at this host. With --expect N the
+server exits once a session has received N messages, with a non-zero status if
+any was missing.
+
+Usage:
+    aos_ws_session_server.py [--port 8766] [--drop-every 20] [--expect 50]
+"""
+import argparse
+import asyncio
+import collections
+import struct
+import sys
+
+from aos_ws_faultlab import OPCODE_BINARY, OPCODE_CLOSE, OPCODE_PING, OPCODE_PONG, abort_with_reset, ws_accept, ws_frame, ws_read_frame
+
+SESSION_DATA = 0x01
+SESSION_ACK = 0x02
+SESSION_RESUME = 0x03
+SESSION_TEXT = 0x80
+SESSION_NEW = 0x01
+
+
+class Session:
+    def __init__(self, window):
+        self.rx_seq = 0
+        self.tx_seq = 0
+        self.sent = collections.deque(maxlen=window)
+        self.received = 0
+        self.duplicated = 0
+        self.missing = 0
+        self.replayed = 0
+
+    def release(self, seq):
+        while self.sent and self.sent[0][0] <= seq:
+            self.sent.popleft()
+
+
+class Server:
+    def __init__(self, args):
+        self.args = args
+        self.sessions = {}
+        self.accepted = 0
+        self.done = asyncio.Event()
+        self.failed = False
+
+    async def handle(self, reader, writer):
+        try:
+            if await ws_accept(reader, writer) is None:
+                writer.close()
+                return
+            self.accepted += 1
+            await self.serve(reader, writer)
+        except (asyncio.IncompleteReadError, ConnectionError, asyncio.CancelledError):
+            pass
+        finally:
+            writer.close()
+
+    async def serve(self, reader, writer):
+        session = None
+        while True:
+            fin, opcode, payload = await ws_read_frame(reader)
+            if opcode == OPCODE_CLOSE:
+                writer.write(ws_frame(OPCODE_CLOSE, payload[:2]))
+                await writer.drain()
+                return
+            if opcode == OPCODE_PING:
+                writer.write(ws_frame(OPCODE_PONG, payload))
+                continue
+            if opcode != OPCODE_BINARY or len(payload) < 5:
+                print("ignored frame (opcode:%d len:%d)" % (opcode, len(payload)))
+                continue
+            kind = payload[0] & ~SESSION_TEXT
+            seq = struct.unpack(">I", payload[1:5])[0]
+
+            if kind == SESSION_RESUME:
+                session_id = payload[5:13].hex()
+                new = session_id not in self.sessions
+                if new:
+                    self.sessions[session_id] = Session(self.args.window)
+                session = self.sessions[session_id]
+                session.release(seq)
+                print("%s session %s, client saw %d, server saw %d, replaying %d" %
+                      ("new" if new else "resumed", session_id, seq, session.rx_seq, len(session.sent)))
+                writer.write(ws_frame(OPCODE_BINARY, bytes([SESSION_RESUME]) + struct.pack(">I", session.rx_seq) +
+                                      bytes([SESSION_NEW if new else 0])))
+                for message in session.sent:
+                    writer.write(ws_frame(OPCODE_BINARY, message[1]))
+                    session.replayed += 1
+                await writer.drain()
+            elif session is None:
+                print("data before resume, closing")
+                return
+            elif kind == SESSION_ACK:
+                session.release(seq)
+            elif kind == SESSION_DATA:
+                if seq <= session.rx_seq:
+                    session.duplicated += 1
+                    continue
+                if seq != session.rx_seq + 1:
+                    print("missing %d messages before %d" % (seq - session.rx_seq - 1, seq))
+                    session.missing += seq - session.rx_seq - 1
+                session.rx_seq = seq
+                session.received += 1
+
+                # Keep the echo before anything is written, a dropped connection replays it
+                session.tx_seq += 1
+                echo = bytes([SESSION_DATA | (payload[0] & SESSION_TEXT)]) + struct.pack(">I", session.tx_seq) + payload[5:]
+                if len(session.sent) == session.sent.maxlen:
+                    print("window full, oldest echo lost")
+                session.sent.append((session.tx_seq, echo))
+                if self.args.expect and session.received >= self.args.expect:
+                    self.report()
+                    self.failed = bool(session.missing)
+                    self.done.set()
+                if self.args.drop_every and session.received % self.args.drop_every == 0:
+                    print("dropping connection after %d" % seq)
+                    abort_with_reset(writer)
+                    return
+                writer.write(ws_frame(OPCODE_BINARY, bytes([SESSION_ACK]) + struct.pack(">I", seq)) +
+                             ws_frame(OPCODE_BINARY, echo))
+                await writer.drain()
+            else:
+                print("unknown session message (type:%02x)" % payload[0])
+
+    def report(self):
+        print("%-18s %-10s %-10s %-10s %-10s %-10s" % ("session", "received", "duplicated", "missing", "replayed", "unacked"))
+        for session_id, session in self.sessions.items():
+            print("%-18s %-10d %-10d %-10d %-10d %-10d" % (session_id, session.received, session.duplicated,
+                                                           session.missing, session.replayed, len(session.sent)))
+        print("%d connections" % self.accepted)
+
+    async def main(self):
+        server = await asyncio.start_server(self.handle, self.args.host, self.args.port)
+        print("listening on %s:%d" % (self.args.host, self.args.port))
+        async with server:
+            try:
+                await self.done.wait()
+                # Let the last echoes and acknowledgements through
+                await asyncio.sleep(1)
+            except asyncio.CancelledError:
+                self.report()
+        return 1 if self.failed else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", default="0.0.0.0", help="listen address")
+    parser.add_argument("--port", type=int, default=8766, help="listen port")
+    parser.add_argument("--window", type=int, default=64, help="sent messages kept per session until acknowledged")
+    parser.add_argument("--drop-every", type=int, default=0, help="reset the connection after every N messages")
+    parser.add_argument("--expect", type=int, default=0, help="exit once a session received N messages")
+    args = parser.parse_args()
+    try:
+        return asyncio.run(Server(args).main())
+    except KeyboardInterrupt:
+        return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+"""
+Decode an AOS Websocket client trace ring dump (see aos_ws_client_trace_dump).
+
+The input is the raw array of aos_ws_client_trace_entry_t as copied from the
+device (8 bytes per entry, little endian), either as a binary file or as a
+hex string (e.g. from a log line). Output is a timeline, one frame event per
+row, with absolute and delta times in microseconds.
+
+Usage:
+    aos_ws_trace.py dump.bin
+    aos_ws_trace.py --hex dump.txt
+"""
+import argparse
+import struct
+import sys
+
+EVENTS = ["ENQUEUE", "WRITE_START", "WRITE_END", "READ", "DISPATCH", "STATE"]
+OPCODES = {0x0: "CONT", 0x1: "TEXT", 0x2: "BINARY", 0x8: "CLOSE", 0x9: "PING", 0xA: "PONG"}
+REQUESTS = ["CONNECT", "DISCONNECT", "SEND_TEXT", "SEND_BINARY", "STATS_GET", "RPC"]
+STATES = ["DISCONNECTED", "CONNECTING", "CONNECTED", "RECONNECTING"]
+
+
+def _name(table, index):
+    if isinstance(table, dict):
+        return table.get(index, str(index))
+    return table[index] if index < len(table) else str(index)
+
+
+def decode(raw):
+    entries = []
+    base = None
+    previous = None
+    wraps = 0
+    for offset in range(0, len(raw) - len(raw) % 8, 8):
+        timestamp, packed = struct.unpack_from("<II", raw, offset)
+        # esp_timer timestamps are truncated to 32 bits on device
+        if previous is not None and timestamp < previous:
+            wraps += 1
+        previous = timestamp
+        timestamp += wraps << 32
+        if base is None:
+            base = timestamp
+        entries.append((timestamp - base, packed >> 24 & 0xF, packed >> 28 & 0xF, packed & 0xFFFFFF))
+    return entries
+
+
+def describe(event, opcode):
+    name = _name(EVENTS, event)
+    if name == "ENQUEUE":
+        return name, _name(REQUESTS, opcode)
+    if name == "STATE":
+        return name, _name(STATES, opcode)
+    return name, _name(OPCODES, opcode)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("dump", help="trace dump file")
+    parser.add_argument("--hex", action="store_true", help="dump file is a hex string")
+    args = parser.parse_args()
+
+    with open(args.dump, "rb") as f:
+        raw = f.read()
+    if args.hex:
+        raw = bytes.fromhex("".join(raw.decode().split()))
+
+    print("%6s %12s %10s  %-12s %-12s %8s" % ("No.", "Time (us)", "Delta (us)", "Event", "Info", "Length"))
+    last = 0
+    for index, (time_us, event, opcode, length) in enumerate(decode(raw)):
+        name, info = describe(event, opcode)
+        print("%6d %12d %10d  %-12s %-12s %8d" % (index, time_us, time_us - last, name, info, length))
+        last = time_us
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())